@@ -0,0 +1,638 @@
+#include "bytecode.hpp"
+#include "driver.hpp"
+
+#include <dlfcn.h>
+#include <iostream>
+
+using namespace bc;
+
+//  Native calls are made through a function pointer of the right type, one
+//  case per arity (see callNative)
+static const unsigned maxNativeArgs = 8;
+
+/*********************** Program and Compiler *********************/
+bool Program::link() {
+  bool ok = true;
+  for (auto &callee: callees) {
+    if (callee.code or callee.native)
+      continue;
+    if (callee.nargs > maxNativeArgs) {
+      std::cerr << "extern " << callee.name << " has " << callee.nargs << " arguments, the interpreter supports at most "
+                << maxNativeArgs << "\n";
+      ok = false;
+      continue;
+    }
+    callee.native = dlsym(RTLD_DEFAULT, callee.name.c_str());
+    if (not callee.native) {
+      std::cerr << "unresolved extern " << callee.name << "\n";
+      ok = false;
+    }
+  }
+
+  //  The call opcode is chosen once here, so that the interpreter does not
+  //  need to check the kind of callee at every call
+  for (auto &fn: functions)
+    for (auto &ins: fn->code)
+      if (ins.op == CALL or ins.op == CALLX)
+        ins.op = callees[ins.b].code ? CALL : CALLX;
+
+  return ok;
+}
+
+Compiler::Compiler(Program &prog): prog(prog), fn(nullptr), top(0), locals(0), overflow(false) {}
+
+unsigned Compiler::temp() {
+  return reserve(1);
+}
+
+unsigned Compiler::reserve(unsigned n) {
+  unsigned reg = top;
+  top += n;
+  if (top > fn->nregs)
+    fn->nregs = top;
+  return reg;
+}
+
+unsigned Compiler::constant(double val) {
+  for (unsigned k = 0; k < fn->consts.size(); k++)
+    if (fn->consts[k] == val)
+      return k;
+  fn->consts.push_back(val);
+  return fn->consts.size() - 1;
+}
+
+unsigned Compiler::emit(Opcode op, unsigned a, unsigned b, unsigned c) {
+  //  Constant and callee indices, array sizes: checked once per function, in
+  //  FunctionAST::bcgen
+  if (a > UINT16_MAX or b > UINT16_MAX or c > UINT16_MAX)
+    overflow = true;
+  fn->code.push_back({op, (uint16_t)a, (uint16_t)b, (uint16_t)c});
+  return fn->code.size() - 1;
+}
+
+unsigned Compiler::label() const {
+  return fn->code.size();
+}
+
+void Compiler::patch(unsigned at, unsigned target) {
+  fn->code[at].b = target & 0xffff;
+  fn->code[at].c = target >> 16;
+}
+
+int Compiler::error(const std::string &msg) {
+  std::cerr << msg << "\n";
+  return -1;
+}
+
+bool bc::compile(driver &drv, Program &prog) {
+  Compiler bc(prog);
+  return drv.root->bcgen(bc) >= 0;
+}
+
+/*********************** AST -> bytecode **************************/
+//  Every bcgen returns the register holding the value of the node, or -1
+//  in case of error. Nodes without a value (declarations) return 0.
+
+int RootAST::bcgen(bc::Compiler &bc) {
+  return bc.error("Construct not supported by the bytecode backend");
+}
+
+int SeqAST::bcgen(bc::Compiler &bc) {
+  if (first and first->bcgen(bc) < 0)
+    return -1;
+  if (continuation)
+    return continuation->bcgen(bc);
+  return 0;
+}
+
+int NumberExprAST::bcgen(bc::Compiler &bc) {
+  unsigned reg = bc.temp();
+  bc.emit(LOADK, reg, bc.constant(Val));
+  return reg;
+}
+
+int VariableExprAST::bcgen(bc::Compiler &bc) {
+  if (auto var = bc.scalars.find(Name); var != bc.scalars.end())
+    return var->second;
+
+  if (auto g = bc.prog.globals.find(Name); g != bc.prog.globals.end()) {
+    unsigned reg = bc.temp();
+    bc.emit(LOADG, reg, g->second);
+    return reg;
+  }
+
+  return bc.error("Undeclared variable " + Name);
+}
+
+int BinaryExprAST::bcgen(bc::Compiler &bc) {
+  int L = LHS->bcgen(bc);
+  int R = RHS->bcgen(bc);
+  if (L < 0 or R < 0)
+    return -1;
+
+  Opcode op;
+  switch (Op) {
+  case '+': op = ADD; break;
+  case '-': op = SUB; break;
+  case '*': op = MUL; break;
+  case '/': op = DIV; break;
+  default:
+    return bc.error("Operatore binario non supportato");
+  }
+  unsigned reg = bc.temp();
+  bc.emit(op, reg, L, R);
+  return reg;
+}
+
+int CallExprAST::bcgen(bc::Compiler &bc) {
+  auto idx = bc.prog.calleeIndex.find(Callee);
+  if (idx == bc.prog.calleeIndex.end())
+    return bc.error("Funzione non definita");
+  if (bc.prog.callees[idx->second].nargs != Args.size())
+    return bc.error("Numero di argomenti non corretto");
+
+  //  Arguments are evaluated first, then moved to consecutive registers
+  std::vector<int> values;
+  for (auto arg: Args) {
+    values.push_back(arg->bcgen(bc));
+    if (values.back() < 0)
+      return -1;
+  }
+  unsigned base = bc.reserve(Args.size());
+  for (unsigned i = 0; i < values.size(); i++)
+    bc.emit(MOV, base + i, values[i]);
+
+  unsigned reg = bc.temp();
+  bc.emit(CALL, reg, idx->second, base);
+  return reg;
+}
+
+int PrototypeAST::bcgen(bc::Compiler &bc) {
+  //  Arrays are register ranges, local to a frame
+  if (hasArrays())
+    return bc.error("Array parameters are not supported by the bytecode backend");
+  if (bc.prog.calleeIndex.count(Name))
+    return 0;
+  bc.prog.calleeIndex[Name] = bc.prog.callees.size();
+  bc.prog.callees.push_back({Name, (unsigned)Args.size(), nullptr, nullptr});
+  return 0;
+}
+
+int FunctionAST::bcgen(bc::Compiler &bc) {
+  if (Proto->bcgen(bc) < 0)
+    return -1;
+  const std::string &name = std::get<std::string>(Proto->getLexVal());
+  Callee &callee = bc.prog.callees[bc.prog.calleeIndex[name]];
+  if (callee.code)
+    return bc.error("Function " + name + " already defined");
+
+  bc.prog.functions.push_back(std::make_unique<bc::Function>());
+  bc::Function *fn = bc.prog.functions.back().get();
+  fn->name = name;
+  fn->nargs = Proto->getArgs().size();
+  fn->nregs = 0;
+
+  bc.fn = fn;
+  bc.top = 0;
+  bc.overflow = false;
+  bc.scalars.clear();
+  bc.arrays.clear();
+  for (auto &arg: Proto->getArgs())
+    bc.scalars[arg] = bc.temp();
+  bc.locals = bc.top;
+
+  int ret = Body->bcgen(bc);
+  if (ret < 0)
+    return -1;
+  bc.emit(RET, ret);
+
+  if (fn->nregs > UINT16_MAX)
+    return bc.error("Function " + name + " needs too many registers");
+  if (bc.overflow)
+    return bc.error("Function " + name + " is too large for the bytecode backend");
+
+  //  Published only now: a call emitted while compiling the body (recursion)
+  //  refers to the callee index, not to the code
+  bc.prog.callees[bc.prog.calleeIndex[name]].code = fn;
+  return 0;
+}
+
+int IfExprAST::bcgen(bc::Compiler &bc) {
+  int condv = cond->bcgen(bc);
+  if (condv < 0)
+    return -1;
+
+  unsigned result = bc.temp();
+  unsigned toFalse = bc.emit(JMPF, condv);
+
+  int TrueV = trueexp->bcgen(bc);
+  if (TrueV < 0)
+    return -1;
+  bc.emit(MOV, result, TrueV);
+  unsigned toMerge = bc.emit(JMP);
+
+  bc.patch(toFalse, bc.label());
+  int FalseV = falseexp->bcgen(bc);
+  if (FalseV < 0)
+    return -1;
+  bc.emit(MOV, result, FalseV);
+
+  bc.patch(toMerge, bc.label());
+  return result;
+}
+
+int BlockAST::bcgen(bc::Compiler &bc) {
+  //  Same scoping rules of BlockAST::codegen: bindings shadow outer variables
+  //  until the end of the block
+  auto scalars = bc.scalars;
+  auto arrays = bc.arrays;
+  unsigned locals = bc.locals;
+
+  for (auto bind: Bindings)
+    if (bind->bcgen(bc) < 0)
+      return bc.error("Invalid variable binding");
+
+  int ret = 0;
+  for (auto stptr = Statements.rbegin(); stptr != Statements.rend(); stptr++) {
+    //  Temporaries of the previous statement are dead by now
+    bc.top = bc.locals;
+    ret = (*stptr)->bcgen(bc);
+    if (ret < 0)
+      return bc.error("Error in generating calls for block");
+  }
+
+  //  The value of the block must survive the release of its registers
+  if ((unsigned)ret >= locals) {
+    bc.emit(MOV, locals, ret);
+    ret = locals;
+  }
+  bc.scalars = scalars;
+  bc.arrays = arrays;
+  bc.locals = locals;
+  bc.top = locals + 1;
+  return ret;
+}
+
+int VarBindingAST::bcgen(bc::Compiler &bc) {
+  int init = -1;
+  if (Val and (init = Val->bcgen(bc)) < 0)
+    return -1;
+
+  //  Local variables live below any temporary: the slot is taken at the top
+  //  and the temporaries used by the initializer are moved above it
+  unsigned reg = bc.locals++;
+  if (bc.top < bc.locals)
+    bc.reserve(bc.locals - bc.top);
+
+  if (Val)
+    bc.emit(MOV, reg, init);
+  else
+    bc.emit(LOADK, reg, bc.constant(0.0));
+
+  bc.scalars[Name] = reg;
+  bc.arrays.erase(Name);
+  bc.top = bc.locals;
+  return reg;
+}
+
+int AssignmentAST::bcgen(bc::Compiler &bc) {
+  int rval = Val->bcgen(bc);
+  if (rval < 0)
+    return -1;
+
+  if (auto var = bc.scalars.find(Id); var != bc.scalars.end()) {
+    bc.emit(MOV, var->second, rval);
+    return var->second;
+  }
+  if (auto g = bc.prog.globals.find(Id); g != bc.prog.globals.end()) {
+    bc.emit(STOREG, g->second, rval);
+    return rval;
+  }
+  return bc.error("Variable not declared.");
+}
+
+int RelationalExprAST::bcgen(bc::Compiler &bc) {
+  int L = leftoperand->bcgen(bc);
+  int R = rightoperand->bcgen(bc);
+  if (L < 0 or R < 0)
+    return -1;
+
+  unsigned reg = bc.temp();
+  if (kind == '=')
+    bc.emit(EQ, reg, L, R);
+  else if (kind == '<')
+    bc.emit(LT, reg, L, R);
+  else
+    return bc.error("Compare operand not supported");
+  return reg;
+}
+
+int GlobalVarAST::bcgen(bc::Compiler &bc) {
+  if (bc.prog.globals.count(Name))
+    return bc.error("Global variable already defined");
+  if (Init != 0)
+    bc.prog.globalInit[bc.prog.nglobals] = Init;
+  bc.prog.globals[Name] = bc.prog.nglobals++;
+  return 0;
+}
+
+int GlobalArrayAST::bcgen(bc::Compiler &bc) {
+  if (GlobalVarAST::bcgen(bc) < 0)
+    return -1;
+  std::string &name = getName();
+  bc.prog.globalSize[name] = Size;
+  for (unsigned i = 0; i < Values.size(); i++)
+    if (Values[i] != 0)
+      bc.prog.globalInit[bc.prog.globals[name] + i] = Values[i];
+  bc.prog.nglobals += Size - 1;
+  if (bc.prog.nglobals > UINT16_MAX)
+    return bc.error("Global array " + name + " is too large");
+  return 0;
+}
+
+int ImportAST::bcgen(bc::Compiler &bc) {
+  //  Without linking, the imported globals must be defined by another source
+  //  of the same program (e.g. kcomp --interp rand.k inssort.k)
+  for (PrototypeAST *proto: Protos)
+    if (proto->bcgen(bc) < 0)
+      return -1;
+  for (GlobalVarAST *var: Globals)
+    if (not bc.prog.globals.count(var->getName()))
+      return bc.error("Global variable " + var->getName() + " imported from " + Name + " is not defined");
+  return 0;
+}
+
+int IfStatementAST::bcgen(bc::Compiler &bc) {
+  int condv = cond->bcgen(bc);
+  if (condv < 0)
+    return -1;
+
+  unsigned toFalse = bc.emit(JMPF, condv);
+  if (truestmt->bcgen(bc) < 0)
+    return -1;
+
+  if (falsestmt) {
+    unsigned toMerge = bc.emit(JMP);
+    bc.patch(toFalse, bc.label());
+    if (falsestmt->bcgen(bc) < 0)
+      return -1;
+    bc.patch(toMerge, bc.label());
+  } else {
+    bc.patch(toFalse, bc.label());
+  }
+
+  unsigned reg = bc.temp();
+  bc.emit(LOADK, reg, bc.constant(0.0));
+  return reg;
+}
+
+int ForInitAST::bcgen(bc::Compiler &bc) {
+  return init->bcgen(bc);
+}
+
+int ForStatementAST::bcgen(bc::Compiler &bc) {
+  auto scalars = bc.scalars;
+  auto arrays = bc.arrays;
+  unsigned locals = bc.locals;
+
+  if (init->bcgen(bc) < 0)
+    return -1;
+
+  unsigned condition = bc.label();
+  bc.top = bc.locals;
+  int condval = cond->bcgen(bc);
+  if (condval < 0)
+    return bc.error("Condition value is a nullptr");
+  unsigned toExit = bc.emit(JMPF, condval);
+
+  bc.top = bc.locals;
+  if (body->bcgen(bc) < 0)
+    return -1;
+  bc.top = bc.locals;
+  if (update->bcgen(bc) < 0)
+    return -1;
+  bc.emit(JMP);
+  bc.patch(bc.label() - 1, condition);
+  bc.patch(toExit, bc.label());
+
+  bc.scalars = scalars;
+  bc.arrays = arrays;
+  bc.locals = locals;
+  bc.top = locals;
+
+  unsigned reg = bc.temp();
+  bc.emit(LOADK, reg, bc.constant(0.0));
+  return reg;
+}
+
+int ConditionalExprAST::bcgen(bc::Compiler &bc) {
+  if (kind == "")
+    return LHS->bcgen(bc);
+
+  unsigned reg;
+  if (kind == "not") {
+    int cond = RHS->bcgen(bc);
+    if (cond < 0)
+      return -1;
+    reg = bc.temp();
+    bc.emit(NOT, reg, cond);
+    return reg;
+  }
+
+  int L = LHS->bcgen(bc);
+  int R = RHS->bcgen(bc);
+  if (L < 0 or R < 0)
+    return -1;
+  reg = bc.temp();
+  if (kind == "and")
+    bc.emit(AND, reg, L, R);
+  else if (kind == "or")
+    bc.emit(OR, reg, L, R);
+  else
+    return bc.error("Invalid conditonal operation kind: " + kind);
+  return reg;
+}
+
+int ArrayBindingAST::bcgen(bc::Compiler &bc) {
+  if (not Init.empty() and Init.size() != Size)
+    return bc.error("Initialization array for " + Name + " is not the same size as binding array");
+
+  std::vector<int> values;
+  for (auto initParam: Init) {
+    values.push_back(initParam->bcgen(bc));
+    if (values.back() < 0)
+      return -1;
+  }
+
+  //  The elements are consecutive registers, placed like a scalar local
+  unsigned base = bc.locals;
+  bc.locals += Size;
+  if (bc.top < bc.locals)
+    bc.reserve(bc.locals - bc.top);
+
+  if (values.empty())
+    bc.emit(ZERO, base, Size);
+  for (unsigned i = 0; i < values.size(); i++)
+    bc.emit(MOV, base + i, values[i]);
+
+  bc.arrays[Name] = {base, (unsigned)Size};
+  bc.scalars.erase(Name);
+  bc.top = bc.locals;
+  return base;
+}
+
+int ArrayExprAST::bcgen(bc::Compiler &bc) {
+  if (Indices.size() != 1)
+    return bc.error("Multi-dimensional arrays are not supported by the bytecode backend");
+  int Index = Indices[0]->bcgen(bc);
+  if (Index < 0)
+    return -1;
+
+  unsigned reg = bc.temp();
+  if (auto A = bc.arrays.find(Name); A != bc.arrays.end()) {
+    bc.emit(ALOAD, reg, A->second.first, Index);
+    return reg;
+  }
+  if (auto G = bc.prog.globalSize.find(Name); G != bc.prog.globalSize.end()) {
+    bc.emit(GALOAD, reg, bc.prog.globals[Name], Index);
+    return reg;
+  }
+  return bc.error("Undeclared array " + Name);
+}
+
+int ArrayAssignmentAST::bcgen(bc::Compiler &bc) {
+  if (Indices.size() != 1)
+    return bc.error("Multi-dimensional arrays are not supported by the bytecode backend");
+  int Index = Indices[0]->bcgen(bc);
+  int rval = Val->bcgen(bc);
+  if (Index < 0 or rval < 0)
+    return -1;
+
+  if (auto A = bc.arrays.find(Id); A != bc.arrays.end()) {
+    bc.emit(ASTORE, A->second.first, Index, rval);
+    return rval;
+  }
+  if (auto G = bc.prog.globalSize.find(Id); G != bc.prog.globalSize.end()) {
+    bc.emit(GASTORE, bc.prog.globals[Id], Index, rval);
+    return rval;
+  }
+  return bc.error("Undeclared identifier " + Id);
+}
+
+int DynamicArrayBindingAST::bcgen(bc::Compiler &bc) {
+  //  Array elements are registers, allocated at compile time
+  return bc.error("Arrays of runtime size are not supported by the bytecode backend");
+}
+
+int MappedArrayBindingAST::bcgen(bc::Compiler &bc) {
+  return bc.error("mapfile is not supported by the bytecode backend");
+}
+
+int ArrayLengthAST::bcgen(bc::Compiler &bc) {
+  unsigned size;
+  if (auto A = bc.arrays.find(Name); A != bc.arrays.end())
+    size = A->second.second;
+  else if (auto G = bc.prog.globalSize.find(Name); G != bc.prog.globalSize.end())
+    size = G->second;
+  else
+    return bc.error("Undeclared array " + Name);
+
+  unsigned reg = bc.temp();
+  bc.emit(LOADK, reg, bc.constant(size));
+  return reg;
+}
+
+/******************************** VM ******************************/
+VM::VM(Program &prog, size_t stackSize):
+  prog(prog), globals(prog.nglobals, 0.0), stack(new double[stackSize]), stackSize(stackSize), sp(0) {
+  for (auto &[slot, val]: prog.globalInit)
+    globals[slot] = val;
+}
+
+bool VM::run(const std::string &name, double &result) {
+  auto idx = prog.calleeIndex.find(name);
+  if (idx == prog.calleeIndex.end() or not prog.callees[idx->second].code)
+    return false;
+  result = call(*prog.callees[idx->second].code, nullptr);
+  return true;
+}
+
+//  Native callees are plain C functions taking and returning doubles
+static double callNative(void *fn, unsigned nargs, const double *a) {
+  typedef double D;
+  switch (nargs) {
+  case 0: return ((D (*)())fn)();
+  case 1: return ((D (*)(D))fn)(a[0]);
+  case 2: return ((D (*)(D, D))fn)(a[0], a[1]);
+  case 3: return ((D (*)(D, D, D))fn)(a[0], a[1], a[2]);
+  case 4: return ((D (*)(D, D, D, D))fn)(a[0], a[1], a[2], a[3]);
+  case 5: return ((D (*)(D, D, D, D, D))fn)(a[0], a[1], a[2], a[3], a[4]);
+  case 6: return ((D (*)(D, D, D, D, D, D))fn)(a[0], a[1], a[2], a[3], a[4], a[5]);
+  case 7: return ((D (*)(D, D, D, D, D, D, D))fn)(a[0], a[1], a[2], a[3], a[4], a[5], a[6]);
+  case 8: return ((D (*)(D, D, D, D, D, D, D, D))fn)(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+  default:
+    //  Rejected by Program::link
+    std::cerr << "extern calls support at most " << maxNativeArgs << " arguments\n";
+    abort();
+  }
+}
+
+double VM::call(const Function &fn, const double *args) {
+  if (sp + fn.nregs > stackSize) {
+    std::cerr << "stack overflow in " << fn.name << "\n";
+    abort();
+  }
+  double *r = stack.get() + sp;
+  sp += fn.nregs;
+  for (unsigned i = 0; i < fn.nargs; i++)
+    r[i] = args[i];
+
+  const double *K = fn.consts.data();
+  double *G = globals.data();
+  const Instr *ip = fn.code.data();
+
+  //  Threaded dispatch: each handler jumps directly to the next one
+  static void *dispatch[NUM_OPCODES] = {
+    &&op_mov, &&op_loadk, &&op_loadg, &&op_storeg, &&op_add, &&op_sub,
+    &&op_mul, &&op_div, &&op_lt, &&op_eq, &&op_and, &&op_or, &&op_not,
+    &&op_jmp, &&op_jmpf, &&op_zero, &&op_aload, &&op_astore, &&op_gaload,
+    &&op_gastore, &&op_call, &&op_callx, &&op_ret};
+#define NEXT goto *dispatch[(++ip)->op]
+#define TARGET (ip->b | (ip->c << 16))
+
+  goto *dispatch[ip->op];
+
+op_mov:     r[ip->a] = r[ip->b]; NEXT;
+op_loadk:   r[ip->a] = K[ip->b]; NEXT;
+op_loadg:   r[ip->a] = G[ip->b]; NEXT;
+op_storeg:  G[ip->a] = r[ip->b]; NEXT;
+op_add:     r[ip->a] = r[ip->b] + r[ip->c]; NEXT;
+op_sub:     r[ip->a] = r[ip->b] - r[ip->c]; NEXT;
+op_mul:     r[ip->a] = r[ip->b] * r[ip->c]; NEXT;
+op_div:     r[ip->a] = r[ip->b] / r[ip->c]; NEXT;
+op_lt:      r[ip->a] = r[ip->b] < r[ip->c]; NEXT;
+op_eq:      r[ip->a] = r[ip->b] == r[ip->c]; NEXT;
+op_and:     r[ip->a] = r[ip->b] != 0 and r[ip->c] != 0; NEXT;
+op_or:      r[ip->a] = r[ip->b] != 0 or r[ip->c] != 0; NEXT;
+op_not:     r[ip->a] = r[ip->b] == 0; NEXT;
+op_jmp:     ip = fn.code.data() + TARGET; goto *dispatch[ip->op];
+op_jmpf:    if (r[ip->a] == 0) { ip = fn.code.data() + TARGET; goto *dispatch[ip->op]; } NEXT;
+op_zero:    for (unsigned i = 0; i < ip->b; i++) r[ip->a + i] = 0; NEXT;
+op_aload:   r[ip->a] = r[ip->b + (size_t)r[ip->c]]; NEXT;
+op_astore:  r[ip->a + (size_t)r[ip->b]] = r[ip->c]; NEXT;
+op_gaload:  r[ip->a] = G[ip->b + (size_t)r[ip->c]]; NEXT;
+op_gastore: G[ip->a + (size_t)r[ip->b]] = r[ip->c]; NEXT;
+op_call:    r[ip->a] = call(*prog.callees[ip->b].code, r + ip->c); NEXT;
+op_callx: {
+              const Callee &callee = prog.callees[ip->b];
+              r[ip->a] = callNative(callee.native, callee.nargs, r + ip->c);
+              NEXT;
+            }
+op_ret: {
+              double ret = r[ip->a];
+              sp -= fn.nregs;
+              return ret;
+            }
+#undef NEXT
+#undef TARGET
+}
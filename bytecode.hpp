@@ -0,0 +1,130 @@
+#ifndef BYTECODE_HPP
+#define BYTECODE_HPP
+/**
+ * Backend alternativo a LLVM: l'AST viene tradotto in un bytecode a registri
+ * ed eseguito da un interprete (kcomp --interp), senza costruire alcun
+ * modulo LLVM. Pensato per script brevi, in cui il tempo di avvio conta più
+ * della velocità di picco.
+ *
+ * Ogni funzione ha un file di registri (double) privato: i primi registri
+ * sono i parametri, seguono le variabili locali (un array locale occupa
+ * tanti registri consecutivi quanti sono i suoi elementi) e i temporanei.
+ * Le funzioni extern vengono risolte con dlsym al momento del link.
+ */
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+class driver;
+
+namespace bc {
+
+enum Opcode : uint16_t {
+  MOV,      // < r[a] = r[b]
+  LOADK,    // < r[a] = K[b]
+  LOADG,    // < r[a] = G[b]
+  STOREG,   // < G[a] = r[b]
+  ADD,      // < r[a] = r[b] + r[c]
+  SUB,      // < r[a] = r[b] - r[c]
+  MUL,      // < r[a] = r[b] * r[c]
+  DIV,      // < r[a] = r[b] / r[c]
+  LT,       // < r[a] = r[b] < r[c]
+  EQ,       // < r[a] = r[b] == r[c]
+  AND,      // < r[a] = r[b] and r[c]
+  OR,       // < r[a] = r[b] or r[c]
+  NOT,      // < r[a] = not r[b]
+  JMP,      // < ip = target
+  JMPF,     // < if (not r[a]) ip = target
+  ZERO,     // < r[a .. a+b) = 0
+  ALOAD,    // < r[a] = r[b + r[c]]      (array locale)
+  ASTORE,   // < r[a + r[b]] = r[c]      (array locale)
+  GALOAD,   // < r[a] = G[b + r[c]]      (array globale)
+  GASTORE,  // < G[a + r[b]] = r[c]      (array globale)
+  CALL,     // < r[a] = callee[b](r[c], r[c+1], ...), bytecode
+  CALLX,    // < r[a] = callee[b](r[c], r[c+1], ...), nativa (dlsym)
+  RET,      // < return r[a]
+  NUM_OPCODES
+};
+
+/// Istruzione a lunghezza fissa (8 byte). I salti usano b|c come target
+struct Instr {
+  uint16_t op, a, b, c;
+};
+
+struct Function {
+  std::string name;
+  unsigned nargs;
+  unsigned nregs;
+  std::vector<Instr> code;
+  std::vector<double> consts;
+};
+
+/// Una funzione chiamabile: definita in bytecode oppure nativa
+struct Callee {
+  std::string name;
+  unsigned nargs;
+  Function *code;     // < nullptr se la funzione è extern
+  void *native;       // < Risolto con dlsym al link
+};
+
+struct Program {
+  std::vector<Callee> callees;
+  std::map<std::string, unsigned> calleeIndex;
+  std::vector<std::unique_ptr<Function>> functions;
+  std::map<std::string, unsigned> globals;     // < Nome -> primo slot
+  std::map<std::string, unsigned> globalSize;  // < Solo per gli array
+  std::map<unsigned, double> globalInit;       // < Valori iniziali non nulli
+  unsigned nglobals = 0;
+
+  /// Risolve le extern e seleziona l'opcode di chiamata. false se qualche
+  /// simbolo non è stato trovato, o se una extern ha più argomenti di
+  /// quanti l'interprete ne sa passare
+  bool link();
+};
+
+/// Stato della traduzione AST -> bytecode (una funzione alla volta)
+class Compiler {
+  public:
+  Program &prog;
+  Function *fn;
+  std::map<std::string, unsigned> scalars;  // < Variabile -> registro
+  std::map<std::string, std::pair<unsigned, unsigned>> arrays; // < Array -> (base, size)
+  unsigned top;       // < Primo registro libero
+  unsigned locals;    // < Registri occupati da parametri e variabili in scope
+  bool overflow;      // < Un operando emesso non sta in 16 bit (funzione troppo grande)
+
+  explicit Compiler(Program &prog);
+
+  unsigned temp();
+  unsigned reserve(unsigned n);
+  unsigned constant(double val);
+  unsigned emit(Opcode op, unsigned a = 0, unsigned b = 0, unsigned c = 0);
+  unsigned label() const;
+  void patch(unsigned at, unsigned target);
+  int error(const std::string &msg);
+};
+
+/// Interprete a dispatch "threaded" (computed goto)
+class VM {
+  private:
+  Program &prog;
+  std::vector<double> globals;
+  std::unique_ptr<double[]> stack;
+  size_t stackSize;
+  size_t sp;
+
+  public:
+  explicit VM(Program &prog, size_t stackSize = 1 << 20);
+  double call(const Function &fn, const double *args);
+  /// Esegue fn() senza argomenti, se definita
+  bool run(const std::string &fn, double &result);
+};
+
+/// Aggiunge al programma le definizioni prodotte dal parsing di drv
+bool compile(driver &drv, Program &prog);
+
+} // namespace bc
+
+#endif // ! BYTECODE_HPP
@@ -0,0 +1,368 @@
+#include "consteval.hpp"
+#include "driver.hpp"
+
+using namespace ce;
+
+/***************************** Frame ******************************/
+void Frame::save(Frame &saved, const std::string &name) const {
+  if (auto var = scalars.find(name); var != scalars.end())
+    saved.scalars[name] = var->second;
+  if (auto A = arrays.find(name); A != arrays.end())
+    saved.arrays[name] = A->second;
+}
+
+void Frame::restore(const Frame &saved, const std::string &name) {
+  scalars.erase(name);
+  arrays.erase(name);
+  if (auto var = saved.scalars.find(name); var != saved.scalars.end())
+    scalars[name] = var->second;
+  if (auto A = saved.arrays.find(name); A != saved.arrays.end())
+    arrays[name] = A->second;
+}
+
+/*************************** Evaluator ****************************/
+Evaluator::Evaluator(size_t fuel, unsigned depth):
+  maxFuel(fuel), maxDepth(depth), fuel(0), frame(nullptr) {}
+
+void Evaluator::define(FunctionAST *fn) {
+  functions.emplace(fn->getName(), fn);
+}
+
+void Evaluator::clear() {
+  functions.clear();
+  rejected.clear();
+}
+
+bool Evaluator::call(const std::string &fn, const std::vector<double> &args, double &result) {
+  if (rejected.count(fn) or not functions.count(fn))
+    return false;
+
+  fuel = maxFuel;
+  callStack.clear();
+  Frame *outer = frame;
+  frame = nullptr;
+  bool ok = enter(fn, args, result);
+  frame = outer;
+
+  //  Other call sites would most likely exhaust the budget too
+  if (not ok and fuel == 0)
+    rejected.insert(fn);
+  return ok;
+}
+
+bool Evaluator::evaluate(ExprAST *exp, double &result) {
+  fuel = maxFuel;
+  callStack.clear();
+  Frame *outer = frame;
+  frame = nullptr;
+  bool ok = exp->eval(*this, result);
+  frame = outer;
+  return ok;
+}
+
+bool Evaluator::enter(const std::string &fn, const std::vector<double> &args, double &result) {
+  auto def = functions.find(fn);
+  //  Extern, not yet defined or rejected functions can only be called at runtime
+  if (def == functions.end() or rejected.count(fn))
+    return impure();
+  if (callStack.size() >= maxDepth or not step())
+    return false;
+
+  Frame local;
+  Frame *caller = frame;
+  frame = &local;
+  callStack.push_back(fn);
+  bool ok = def->second->apply(*this, args, result);
+  callStack.pop_back();
+  frame = caller;
+  return ok;
+}
+
+bool Evaluator::step() {
+  if (fuel == 0)
+    return false;
+  fuel--;
+  return true;
+}
+
+bool Evaluator::impure() {
+  //  The functions being evaluated depend on the global state too
+  rejected.insert(callStack.begin(), callStack.end());
+  return false;
+}
+
+/************************** AST evaluation ************************/
+//  Every eval mirrors the semantics of the corresponding codegen: booleans
+//  are 0 or 1, statements without a value evaluate to 0. A false return
+//  aborts the whole evaluation.
+
+bool RootAST::eval(ce::Evaluator &ev, double &result) {
+  return false;
+}
+
+bool NumberExprAST::eval(ce::Evaluator &ev, double &result) {
+  result = Val;
+  return true;
+}
+
+bool VariableExprAST::eval(ce::Evaluator &ev, double &result) {
+  if (ev.frame) {
+    if (auto var = ev.frame->scalars.find(Name); var != ev.frame->scalars.end()) {
+      result = var->second;
+      return true;
+    }
+    if (ev.frame->arrays.count(Name))
+      return false;
+  }
+  //  Globals may change at runtime
+  return ev.impure();
+}
+
+bool BinaryExprAST::eval(ce::Evaluator &ev, double &result) {
+  double L, R;
+  if (not LHS->eval(ev, L) or not RHS->eval(ev, R))
+    return false;
+
+  switch (Op) {
+  case '+': result = L + R; return true;
+  case '-': result = L - R; return true;
+  case '*': result = L * R; return true;
+  case '/': result = L / R; return true;
+  default:  return false;
+  }
+}
+
+bool CallExprAST::eval(ce::Evaluator &ev, double &result) {
+  std::vector<double> values;
+  for (auto arg: Args) {
+    values.push_back(0);
+    if (not arg->eval(ev, values.back()))
+      return false;
+  }
+  return ev.enter(Callee, values, result);
+}
+
+std::string FunctionAST::getName() const {
+  return std::get<std::string>(Proto->getLexVal());
+}
+
+bool FunctionAST::apply(ce::Evaluator &ev, const std::vector<double> &args, double &result) {
+  auto &params = Proto->getArgs();
+  if (params.size() != args.size())
+    return false;
+  for (unsigned i = 0; i < args.size(); i++)
+    ev.frame->scalars[params[i]] = args[i];
+  return Body->eval(ev, result);
+}
+
+bool IfExprAST::eval(ce::Evaluator &ev, double &result) {
+  double condv;
+  if (not cond->eval(ev, condv))
+    return false;
+  return condv != 0 ? trueexp->eval(ev, result) : falseexp->eval(ev, result);
+}
+
+bool BlockAST::eval(ce::Evaluator &ev, double &result) {
+  //  Only the bindings go out of scope: assignments to outer variables persist
+  Frame shadowed;
+  for (auto bind: Bindings)
+    ev.frame->save(shadowed, bind->getName());
+
+  double value;
+  for (auto bind: Bindings)
+    if (not bind->eval(ev, value))
+      return false;
+
+  for (auto stptr = Statements.rbegin(); stptr != Statements.rend(); stptr++)
+    if (not (*stptr)->eval(ev, result))
+      return false;
+
+  for (auto bind: Bindings)
+    ev.frame->restore(shadowed, bind->getName());
+  return true;
+}
+
+bool VarBindingAST::eval(ce::Evaluator &ev, double &result) {
+  result = 0;
+  if (Val and not Val->eval(ev, result))
+    return false;
+  ev.frame->scalars[Name] = result;
+  ev.frame->arrays.erase(Name);
+  return true;
+}
+
+bool AssignmentAST::eval(ce::Evaluator &ev, double &result) {
+  if (not Val->eval(ev, result))
+    return false;
+  auto var = ev.frame->scalars.find(Id);
+  if (var == ev.frame->scalars.end())
+    return ev.impure();
+  var->second = result;
+  return true;
+}
+
+bool RelationalExprAST::eval(ce::Evaluator &ev, double &result) {
+  double L, R;
+  if (not leftoperand->eval(ev, L) or not rightoperand->eval(ev, R))
+    return false;
+
+  //  Ordered comparisons, as FCMP_OEQ and FCMP_OLT: false if a NaN is involved
+  if (kind == '=')
+    result = L == R;
+  else if (kind == '<')
+    result = L < R;
+  else
+    return false;
+  return true;
+}
+
+bool IfStatementAST::eval(ce::Evaluator &ev, double &result) {
+  double condv;
+  if (not cond->eval(ev, condv))
+    return false;
+
+  if (condv != 0 and not truestmt->eval(ev, result))
+    return false;
+  if (condv == 0 and falsestmt and not falsestmt->eval(ev, result))
+    return false;
+  result = 0;
+  return true;
+}
+
+bool ForInitAST::eval(ce::Evaluator &ev, double &result) {
+  return init->eval(ev, result);
+}
+
+bool ForStatementAST::eval(ce::Evaluator &ev, double &result) {
+  Frame shadowed;
+  if (init->isBinding())
+    ev.frame->save(shadowed, init->getName());
+
+  if (not init->eval(ev, result))
+    return false;
+
+  double condv;
+  while (true) {
+    if (not ev.step() or not cond->eval(ev, condv))
+      return false;
+    if (condv == 0)
+      break;
+    if (not body->eval(ev, result) or not update->eval(ev, result))
+      return false;
+  }
+
+  if (init->isBinding())
+    ev.frame->restore(shadowed, init->getName());
+  result = 0;
+  return true;
+}
+
+bool ConditionalExprAST::eval(ce::Evaluator &ev, double &result) {
+  if (kind == "")
+    return LHS->eval(ev, result);
+
+  double L, R;
+  if (kind == "not") {
+    if (not RHS->eval(ev, R))
+      return false;
+    result = R == 0;
+    return true;
+  }
+
+  if (not LHS->eval(ev, L) or not RHS->eval(ev, R))
+    return false;
+  if (kind == "and")
+    result = L != 0 and R != 0;
+  else if (kind == "or")
+    result = L != 0 or R != 0;
+  else
+    return false;
+  return true;
+}
+
+bool ArrayBindingAST::eval(ce::Evaluator &ev, double &result) {
+  if (not Init.empty() and Init.size() != Size)
+    return false;
+
+  std::vector<double> values(Size, 0.0);
+  for (unsigned i = 0; i < Init.size(); i++)
+    if (not Init[i]->eval(ev, values[i]))
+      return false;
+
+  ev.frame->arrays[Name] = std::move(values);
+  ev.frame->scalars.erase(Name);
+  result = 0;
+  return true;
+}
+
+bool DynamicArrayBindingAST::eval(ce::Evaluator &ev, double &result) {
+  //  Larger arrays are left to the runtime
+  const double maxSize = 1 << 20;
+  double size;
+  if (Dims.size() != 1 or not Dims[0]->eval(ev, size))
+    return false;
+  if (not (size > -1.0 and size <= maxSize))
+    return false;
+
+  ev.frame->arrays[Name] = std::vector<double>((size_t)size, 0.0);
+  ev.frame->scalars.erase(Name);
+  result = 0;
+  return true;
+}
+
+//  Out of bounds accesses are undefined at runtime: the call is left there
+static bool ElementIndex(double offset, size_t size, size_t &index) {
+  if (not (offset > -1.0 and offset < size))
+    return false;
+  index = (size_t)offset;
+  return true;
+}
+
+bool ArrayExprAST::eval(ce::Evaluator &ev, double &result) {
+  //  The frame keeps arrays flattened, without their dimensions
+  double offset;
+  if (Indices.size() != 1 or not Indices[0]->eval(ev, offset))
+    return false;
+
+  if (not ev.frame or not ev.frame->arrays.count(Name))
+    return ev.impure();
+
+  auto &A = ev.frame->arrays[Name];
+  size_t index;
+  if (not ElementIndex(offset, A.size(), index))
+    return false;
+  result = A[index];
+  return true;
+}
+
+bool ArrayAssignmentAST::eval(ce::Evaluator &ev, double &result) {
+  double offset;
+  if (Indices.size() != 1 or not Val->eval(ev, result) or not Indices[0]->eval(ev, offset))
+    return false;
+
+  auto A = ev.frame->arrays.find(Id);
+  if (A == ev.frame->arrays.end())
+    return ev.impure();
+
+  size_t index;
+  if (not ElementIndex(offset, A->second.size(), index))
+    return false;
+  A->second[index] = result;
+  return true;
+}
+
+bool ArrayLengthAST::eval(ce::Evaluator &ev, double &result) {
+  if (not ev.frame or not ev.frame->arrays.count(Name))
+    return ev.impure();
+  result = ev.frame->arrays[Name].size();
+  return true;
+}
+
+//  File I/O only happens at runtime
+bool MappedArrayBindingAST::eval(ce::Evaluator &ev, double &result) {
+  return ev.impure();
+}
+
+bool SaveFileAST::eval(ce::Evaluator &ev, double &result) {
+  return ev.impure();
+}
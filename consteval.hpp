@@ -0,0 +1,84 @@
+#ifndef CONSTEVAL_HPP
+#define CONSTEVAL_HPP
+/**
+ * Valutazione a tempo di compilazione (partial evaluation).
+ *
+ * Una chiamata a funzione i cui argomenti sono tutti costanti viene eseguita
+ * durante la compilazione, interpretando direttamente l'AST, e sostituita
+ * dal suo risultato: sqrt(2) diventa 1.41421... nell'IR.
+ * Questo è possibile solo per le funzioni pure, cioè che non accedono a
+ * variabili globali e non chiamano funzioni extern. La purezza viene
+ * scoperta durante la valutazione stessa: al primo accesso non consentito
+ * la valutazione si interrompe e la funzione (con tutte quelle che la
+ * stavano chiamando) non viene più considerata.
+ * Ogni valutazione ha un budget di passi (fuel, consumato da chiamate e
+ * iterazioni) e di profondità di ricorsione: superato il budget la chiamata
+ * resta a runtime, e la funzione non viene più valutata.
+ *
+ * Lo stesso meccanismo valuta gli inizializzatori delle variabili globali
+ * (global m = 2147483647), che diventano dati costanti del modulo.
+ */
+#include <cstddef>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+class ExprAST;
+class FunctionAST;
+
+namespace ce {
+
+/// Variabili e array locali della chiamata in corso
+struct Frame {
+  std::map<std::string, double> scalars;
+  std::map<std::string, std::vector<double>> arrays;
+
+  /// Copia in saved il binding corrente di name, se esiste
+  void save(Frame &saved, const std::string &name) const;
+  /// Ripristina il binding di name com'era in saved (fine di uno scope)
+  void restore(const Frame &saved, const std::string &name);
+};
+
+class Evaluator {
+  private:
+  std::map<std::string, FunctionAST *> functions;
+  std::set<std::string> rejected;   // < Impure, o troppo costose da valutare
+  std::vector<std::string> callStack;
+  size_t maxFuel;
+  unsigned maxDepth;
+  size_t fuel;
+
+  public:
+  Frame *frame;     // < nullptr fuori da una funzione (inizializzatori globali)
+
+  explicit Evaluator(size_t fuel = 1 << 20, unsigned depth = 256);
+
+  /// Registra una definizione; le definizioni successive con lo stesso
+  /// nome sono ignorate, come in codegen
+  void define(FunctionAST *fn);
+  /// Dimentica tutte le definizioni (--repl, prima di ogni riga): le
+  /// funzioni delle righe precedenti possono essere ridefinite, quindi le
+  /// chiamate a esse restano a runtime
+  void clear();
+
+  /// Valuta fn(args). false se fn non è pura, non è definita o eccede il
+  /// budget: in tal caso la chiamata va generata normalmente
+  bool call(const std::string &fn, const std::vector<double> &args, double &result);
+
+  /// Valuta un'espressione costante, fuori da qualunque funzione
+  bool evaluate(ExprAST *exp, double &result);
+
+  /******** Usati dai metodi eval dei nodi dell'AST (consteval.cpp) ********/
+  /// Chiamata annidata, durante una valutazione
+  bool enter(const std::string &fn, const std::vector<double> &args, double &result);
+  /// Consuma un passo del budget; false quando il budget è esaurito
+  bool step();
+  /// Registra un accesso non consentito (global o extern) e restituisce
+  /// false, interrompendo la valutazione
+  bool impure();
+};
+
+} // namespace ce
+
+#endif // ! CONSTEVAL_HPP
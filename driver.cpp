@@ -1,6 +1,18 @@
 #include "driver.hpp"
 #include "parser.hpp"
-
+#include "runtime.hpp"
+
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Analysis/VectorUtils.h"
+#include "llvm/BinaryFormat/Dwarf.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Path.h"
+
+#include <algorithm>
 #include <iostream>
 using namespace std;
 
@@ -10,26 +22,399 @@ LLVMContext *context = new LLVMContext;
 Module *module = new Module("Kaleidoscope", *context);
 IRBuilder<> *builder = new IRBuilder(*context);
 
+/* Messaggi di errore: su stdout, o accumulati in diagnostics se non è
+   nullo (Engine, che li restituisce con lastError). errorCount permette a
+   codegen di sapere se ne sono stati segnalati */
+std::string *diagnostics = nullptr;
+unsigned errorCount = 0;
+
 Value *LogErrorV(const std::string Str) {
-  outs() << Str << "\n";
+  errorCount++;
+  if (diagnostics)
+    *diagnostics += Str + "\n";
+  else
+    outs() << Str << "\n";
   return nullptr;
 }
 
-/* Il codice seguente sulle prime non è semplice da comprendere.
-   Esso definisce una utility (funzione C++) con due parametri:
-   1) la rappresentazione di una funzione llvm IR, e
-   2) il nome per un registro SSA
-   La chiamata di questa utility restituisce un'istruzione IR che alloca un double
-   in memoria e ne memorizza il puntatore in un registro SSA cui viene attribuito
-   il nome passato come secondo parametro. L'istruzione verrà scritta all'inizio
-   dell'entry block della funzione passata come primo parametro.
-   Si ricordi che le istruzioni sono generate da un builder. Per non
-   interferire con il builder globale, la generazione viene dunque effettuata
-   con un builder temporaneo TmpB
-*/
-static AllocaInst *CreateEntryBlockAlloca(Function *fun, StringRef VarName) {
-  IRBuilder<> TmpB(&fun->getEntryBlock(), fun->getEntryBlock().begin());
-  return TmpB.CreateAlloca(Type::getDoubleTy(*context), nullptr, VarName);
+/* Metadati TBAA per gli accessi ad array e variabili globali.
+   Nel linguaggio non esistono puntatori: due variabili (o array) con nome
+   diverso non occupano mai la stessa memoria. Ad ogni nome viene quindi
+   associato un "tipo" TBAA distinto, figlio di una radice comune: così
+   LLVM sa che una store in A[j+1] non può modificare seed né un altro array.
+   Nomi uguali (es. un locale che oscura un globale) hanno lo stesso tag,
+   cioè possono essere alias: è la scelta conservativa.
+   I nodi sono "uniqued" dal contesto, quindi non serve una cache. */
+static void TagAccess(Instruction *I, StringRef Name) {
+  MDBuilder MDB(*context);
+  MDNode *Root = MDB.createTBAARoot("kcomp TBAA");
+  MDNode *Var = MDB.createTBAAScalarTypeNode(Name, Root);
+  I->setMetadata(LLVMContext::MD_tbaa, MDB.createTBAAStructTagNode(Var, Var, 0));
+}
+
+/* Il nome distingue la memoria solo per le globali e gli array sullo stack.
+   Un parametro array è la memoria dell'array passato dal chiamante, con un
+   altro nome (e dopo l'inlining nella stessa funzione); anche gli array
+   mappati da file o nell'arena sono raggiunti tramite un puntatore: i loro
+   accessi restano senza tag, e possono essere alias di qualunque array */
+static void TagArrayAccess(Instruction *I, Value *Ptr, StringRef Name) {
+  if (isa<GlobalVariable, AllocaInst>(getUnderlyingObject(Ptr)))
+    TagAccess(I, Name);
+}
+
+/* Array locali e scope (corpo di funzione, blocco, for), in drv.scopes.
+   Gli array sullo stack hanno tutti un'alloca nell'entry block, ma il loro
+   lifetime è delimitato da llvm.lifetime.start (alla dichiarazione) e
+   llvm.lifetime.end (all'uscita dallo scope): lo stack coloring del backend
+   può così assegnare lo stesso slot ad array di scope disgiunti, e il frame
+   è grande quanto lo scope più esigente invece che la somma di tutti.
+   Gli array nell'arena della runtime library (krt_arena_*, si veda
+   runtime.hpp) sono liberati in blocco all'uscita dallo scope, tornando al
+   mark preso al primo array allocato nello scope. Anche le mappature dei
+   file (mapfile) sono rimosse all'uscita dallo scope: una funzione chiamata
+   in un ciclo non accumula mappature.
+   Il linguaggio non ha uscite anticipate: la dichiarazione di un array
+   domina sempre la fine del suo scope. */
+static void BeginScope(driver &drv) {
+  drv.scopes.emplace_back();
+}
+
+static void EndScope(driver &drv) {
+  LocalScope scope = std::move(drv.scopes.back());
+  drv.scopes.pop_back();
+
+  for (AllocaInst *slot: scope.allocas)
+    builder->CreateLifetimeEnd(slot, builder->getInt64(module->getDataLayout().getTypeAllocSize(slot->getAllocatedType())));
+
+  Type *ptrTy = PointerType::getUnqual(*context);
+  if (not scope.mappings.empty()) {
+    FunctionCallee unmap = module->getOrInsertFunction("krt_unmapfile",
+        FunctionType::get(builder->getVoidTy(), {ptrTy, builder->getInt64Ty()}, false));
+    for (auto &[base, length]: scope.mappings)
+      builder->CreateCall(unmap, {base, length});
+  }
+
+  if (not scope.arenaMark)
+    return;
+
+  FunctionCallee release = module->getOrInsertFunction("krt_arena_release",
+      FunctionType::get(builder->getVoidTy(), {ptrTy}, false));
+  builder->CreateCall(release, {scope.arenaMark});
+}
+
+/// n double azzerati, allineati a 64 byte
+static Value *ArenaAlloc(driver &drv, Value *n, const std::string &Name) {
+  Type *ptrTy = PointerType::getUnqual(*context);
+  Value *&mark = drv.scopes.back().arenaMark;
+  if (not mark) {
+    FunctionCallee markFn = module->getOrInsertFunction("krt_arena_mark",
+        FunctionType::get(ptrTy, false));
+    mark = builder->CreateCall(markFn, {}, "arena.mark");
+  }
+
+  FunctionCallee alloc = module->getOrInsertFunction("krt_arena_alloc",
+      FunctionType::get(ptrTy, {builder->getInt64Ty()}, false));
+  if (Function *F = dyn_cast<Function>(alloc.getCallee())) {
+    F->addRetAttr(Attribute::NoAlias);
+    F->addRetAttr(Attribute::getWithAlignment(*context, Align(64)));
+  }
+  return builder->CreateCall(alloc, {n}, Name);
+}
+
+static bool IsArenaRuntime(const Function *F) {
+  return F and F->getName().startswith("krt_arena_");
+}
+
+/* Strumentazione per il profilo (-finstrument=functions,loops, si veda
+   runtime.hpp). Ogni funzione o ciclo ha un descrittore costante, passato a
+   krt_prof_enter e krt_prof_exit. Le iterazioni di un ciclo sono contate in
+   un registro e passate all'uscita: il corpo del ciclo non chiama la
+   runtime library. */
+static Constant *ProfileSite(driver &drv, StringRef name, krt_prof_kind kind, const yy::location &loc) {
+  Type *ptrTy = PointerType::getUnqual(*context);
+  Type *int32Ty = builder->getInt32Ty();
+  //  struct krt_prof_site
+  StructType *siteTy = StructType::get(ptrTy, ptrTy, int32Ty, int32Ty);
+  Constant *site = ConstantStruct::get(siteTy, {builder->CreateGlobalStringPtr(name, "prof.name"),
+                                                builder->CreateGlobalStringPtr(drv.file, "prof.file"),
+                                                builder->getInt32(loc.begin.line), builder->getInt32(kind)});
+  return new GlobalVariable(*module, siteTy, true, GlobalValue::PrivateLinkage, site, "prof.site");
+}
+
+static void ProfileEnter(Constant *site) {
+  Type *ptrTy = PointerType::getUnqual(*context);
+  FunctionCallee enter = module->getOrInsertFunction("krt_prof_enter",
+      FunctionType::get(builder->getVoidTy(), {ptrTy}, false));
+  builder->CreateCall(enter, {site});
+}
+
+static void ProfileExit(Constant *site, Value *iterations) {
+  Type *ptrTy = PointerType::getUnqual(*context);
+  FunctionCallee exit = module->getOrInsertFunction("krt_prof_exit",
+      FunctionType::get(builder->getVoidTy(), {ptrTy, builder->getInt64Ty()}, false));
+  builder->CreateCall(exit, {site, iterations});
+}
+
+static bool IsProfileRuntime(const Function *F) {
+  return F and F->getName().startswith("krt_prof_");
+}
+
+/// Ingresso e uscite di F già generata: per una funzione pure, il wrapper,
+/// così che anche le chiamate risolte dalla tabella siano contate
+static void InstrumentFunction(driver &drv, Function *F, const yy::location &loc) {
+  std::vector<ReturnInst *> exits;
+  for (BasicBlock &BB: *F)
+    if (auto *ret = dyn_cast<ReturnInst>(BB.getTerminator()))
+      exits.push_back(ret);
+
+  BasicBlock &entry = F->getEntryBlock();
+  builder->SetInsertPoint(&entry, entry.getFirstNonPHIOrDbgOrAlloca());
+  Constant *site = ProfileSite(drv, F->getName(), KRT_PROF_FUNCTION, loc);
+  ProfileEnter(site);
+  for (ReturnInst *ret: exits) {
+    builder->SetInsertPoint(ret);
+    ProfileExit(site, builder->getInt64(0));
+  }
+  builder->SetCurrentDebugLocation(DebugLoc());
+}
+
+/* Informazioni di debug (-g). Ogni funzione ha un DISubprogram e ogni
+   statement imposta la posizione corrente del builder: le istruzioni
+   generate portano la riga del sorgente .k da cui provengono, così che
+   debugger e profiler (gdb, perf annotate) possano ricondurre il codice
+   macchina ai sorgenti. Vengono emesse solo le line table, non la
+   descrizione delle variabili locali */
+static void BeginSubprogram(driver &drv, Function *F, const yy::location &loc) {
+  if (not drv.dbuilder)
+    return;
+
+  DIBuilder &DB = *drv.dbuilder;
+  DIType *doubleTy = DB.createBasicType("double", 64, dwarf::DW_ATE_float);
+  SmallVector<Metadata *, 8> types = {doubleTy};
+  for (Argument &Arg: F->args())
+    if (Arg.getType()->isPointerTy())
+      types.push_back(DB.createPointerType(doubleTy, 64));
+    else if (Arg.getType()->isIntegerTy())
+      types.push_back(DB.createBasicType("int64_t", 64, dwarf::DW_ATE_signed));
+    else
+      types.push_back(doubleTy);
+
+  DISubprogram *SP = DB.createFunction(drv.debugFile, F->getName(), StringRef(), drv.debugFile,
+                                       loc.begin.line, DB.createSubroutineType(DB.getOrCreateTypeArray(types)),
+                                       loc.begin.line, DINode::FlagPrototyped, DISubprogram::SPFlagDefinition);
+  F->setSubprogram(SP);
+  builder->SetCurrentDebugLocation(DILocation::get(*context, loc.begin.line, loc.begin.column, SP));
+}
+
+static DILocation *SourceLocation(driver &drv, RootAST *node) {
+  DISubprogram *SP = builder->GetInsertBlock()->getParent()->getSubprogram();
+  if (not drv.dbuilder or not SP)
+    return nullptr;
+  const yy::location &loc = node->getLocation();
+  return DILocation::get(*context, loc.begin.line, loc.begin.column, SP);
+}
+
+static void EmitLocation(driver &drv, RootAST *node) {
+  if (DILocation *loc = SourceLocation(drv, node))
+    builder->SetCurrentDebugLocation(loc);
+}
+
+/* Funzioni e variabili globali del modulo. Con --repl possono essere state
+   definite da una riga precedente, in un altro modulo: drv.declare le
+   dichiara in questo */
+static Function *LookupFunction(driver &drv, const std::string &Name) {
+  if (Function *F = module->getFunction(Name))
+    return F;
+  return drv.declare ? dyn_cast_or_null<Function>(drv.declare(Name)) : nullptr;
+}
+
+static GlobalVariable *LookupGlobal(driver &drv, const std::string &Name) {
+  if (GlobalVariable *G = module->getGlobalVariable(Name))
+    return G;
+  return drv.declare ? dyn_cast_or_null<GlobalVariable>(drv.declare(Name)) : nullptr;
+}
+
+/* Risolve il nome di un array: prima gli array locali (sullo stack o mappati
+   da file), poi quelli globali, la cui lunghezza è nel tipo */
+static bool LookupArray(driver &drv, const std::string &Name, ArraySymbol &A) {
+  if (auto local = drv.NamedValues.find(Name); local != drv.NamedValues.end()) {
+    A = local->second;
+    return true;
+  }
+
+  GlobalVariable *G = LookupGlobal(drv, Name);
+  if (not G) {
+    LogErrorV("Undeclared array " + Name);
+    return false;
+  }
+
+  //  The dimensions of a global are in its (nested) array type
+  A = {G, nullptr, {}};
+  uint64_t length = 1;
+  Type *T = G->getValueType();
+  for (; T->isArrayTy(); T = T->getArrayElementType()) {
+    A.dims.push_back(builder->getInt64(T->getArrayNumElements()));
+    length *= T->getArrayNumElements();
+  }
+  if (A.dims.empty() or not T->isDoubleTy()) {
+    LogErrorV("Global variable " + Name + " is not an array of doubles");
+    return false;
+  }
+
+  A.length = builder->getInt64(length);
+  return true;
+}
+
+/* Un array locale con inizializzatore costante è copiato (memcpy) da dati
+   read-only. Se l'array non viene mai modificato né passato a una funzione
+   la copia è inutile: a funzione completata le letture sono redirette sui
+   dati read-only, e la copia eliminata */
+static bool OnlyLoaded(Value *ptr, Instruction *copy) {
+  for (User *U: ptr->users()) {
+    if (U == copy or isa<LoadInst>(U) or cast<Instruction>(U)->isLifetimeStartOrEnd())
+      continue;
+    if (auto *GEP = dyn_cast<GetElementPtrInst>(U); GEP and OnlyLoaded(GEP, copy))
+      continue;
+    return false;
+  }
+  return true;
+}
+
+static void ForwardConstantArrays(driver &drv) {
+  for (MemCpyInst *copy: drv.constantCopies) {
+    Value *base = copy->getRawDest();
+    if (not OnlyLoaded(base, copy))
+      continue;
+
+    Value *data = copy->getRawSource();
+    copy->eraseFromParent();
+    //  The read-only data is live for the whole program
+    for (User *U: make_early_inc_range(base->users()))
+      if (cast<Instruction>(U)->isLifetimeStartOrEnd())
+        cast<Instruction>(U)->eraseFromParent();
+    base->replaceAllUsesWith(data);
+    //  Either the alloca or the arena allocation
+    if (auto *I = dyn_cast<Instruction>(base))
+      I->eraseFromParent();
+  }
+  drv.constantCopies.clear();
+}
+
+/************************** SSA builder ***************************/
+SSABuilder::SSABuilder(): variables(0) {}
+
+void SSABuilder::reset() {
+  variables = 0;
+  names.clear();
+  currentDef.clear();
+  incompletePhis.clear();
+  sealed.clear();
+}
+
+unsigned SSABuilder::newVariable(const std::string &name) {
+  names.push_back(name);
+  return variables++;
+}
+
+void SSABuilder::writeVariable(unsigned var, BasicBlock *BB, Value *val) {
+  currentDef[BB][var] = val;
+}
+
+Value *SSABuilder::readVariable(unsigned var, BasicBlock *BB) {
+  //  Definizione locale al blocco
+  auto defs = currentDef.find(BB);
+  if (defs != currentDef.end()) {
+    auto def = defs->second.find(var);
+    if (def != defs->second.end() and def->second)
+      return def->second;
+  }
+  return readVariableRecursive(var, BB);
+}
+
+Value *SSABuilder::readVariableRecursive(unsigned var, BasicBlock *BB) {
+  Type *doubleTy = Type::getDoubleTy(BB->getContext());
+  Value *val;
+
+  if (not sealed.count(BB)) {
+    //  Non tutti i predecessori sono noti: PHI incompleto, gli operandi
+    //  vengono aggiunti da sealBlock
+    PHINode *phi = BB->empty() ? PHINode::Create(doubleTy, 0, names[var], BB)
+                               : PHINode::Create(doubleTy, 0, names[var], &BB->front());
+    incompletePhis[BB][var] = phi;
+    val = phi;
+  } else if (BasicBlock *pred = BB->getSinglePredecessor()) {
+    //  Nessun PHI necessario
+    val = readVariable(var, pred);
+  } else if (pred_empty(BB)) {
+    //  Variabile letta prima di qualunque definizione
+    val = PoisonValue::get(doubleTy);
+  } else {
+    //  Il PHI viene registrato prima di leggere gli operandi, per
+    //  interrompere i cicli
+    PHINode *phi = BB->empty() ? PHINode::Create(doubleTy, 0, names[var], BB)
+                               : PHINode::Create(doubleTy, 0, names[var], &BB->front());
+    writeVariable(var, BB, phi);
+    val = addPhiOperands(var, phi);
+  }
+  writeVariable(var, BB, val);
+  return val;
+}
+
+Value *SSABuilder::addPhiOperands(unsigned var, PHINode *phi) {
+  BasicBlock *BB = phi->getParent();
+  for (BasicBlock *pred: predecessors(BB))
+    phi->addIncoming(readVariable(var, pred), pred);
+  return tryRemoveTrivialPhi(phi);
+}
+
+Value *SSABuilder::tryRemoveTrivialPhi(PHINode *phi) {
+  //  Un PHI ancora in attesa dei suoi operandi non può essere valutato
+  auto pending = incompletePhis.find(phi->getParent());
+  if (pending != incompletePhis.end())
+    for (auto &[var, incomplete]: pending->second)
+      if (incomplete == phi)
+        return phi;
+
+  Value *same = nullptr;
+  for (Value *op: phi->incoming_values()) {
+    if (op == same or op == phi)
+      continue;
+    if (same)
+      return phi;   // < Almeno due valori distinti: il PHI serve
+    same = op;
+  }
+  if (not same)
+    same = PoisonValue::get(phi->getType());
+
+  //  I PHI che usano questo potrebbero diventare a loro volta banali.
+  //  I riferimenti sono "tracking": seguono le sostituzioni ricorsive
+  std::vector<WeakVH> users;
+  for (User *U: phi->users())
+    if (U != phi and isa<PHINode>(U))
+      users.push_back(U);
+  WeakTrackingVH result = same;
+
+  phi->replaceAllUsesWith(same);
+  phi->eraseFromParent();
+
+  for (auto &U: users)
+    if (U)
+      tryRemoveTrivialPhi(cast<PHINode>(U));
+  return result;
+}
+
+void SSABuilder::sealBlock(BasicBlock *BB) {
+  auto pending = incompletePhis.find(BB);
+  if (pending != incompletePhis.end()) {
+    auto &phis = pending->second;
+    while (not phis.empty()) {
+      auto [var, phi] = *phis.begin();
+      phis.erase(phis.begin());
+      addPhiOperands(var, phi);
+    }
+    incompletePhis.erase(BB);
+  }
+  sealed.insert(BB);
 }
 
 Function * RootAST::currentFunction() {
@@ -37,11 +422,20 @@ Function * RootAST::currentFunction() {
 }
 
 // Implementazione del costruttore della classe driver
-driver::driver(): trace_parsing(false), trace_scanning(false) {};
+driver::driver(): arrayAlign(64), in_memory(false), trace_parsing(false), trace_scanning(false), batch_all(false),
+  memoTables(true), debugInfo(false), trackLocations(false), instrumentFunctions(false), instrumentLoops(false), repl(false),
+  debugFile(nullptr) {};
+
+bool driver::wantsBatch(const std::string &fn) const {
+  return batch_all or batch.count(fn);
+}
 
 // Implementazione del metodo parse
 int driver::parse (const std::string &f) {
   file = f;                    // File con il programma
+  definitions.clear();
+  statements.clear();
+  in_memory = false;
   location.initialize(&file);  // Inizializzazione dell'oggetto location
   scan_begin();                // Inizio scanning (ovvero apertura del file programma)
   yy::parser parser(*this);    // Istanziazione del parser
@@ -51,10 +445,60 @@ int driver::parse (const std::string &f) {
   return res;
 }
 
+bool driver::import(const std::string &name, ki::Interface &I, std::string &error) {
+  SmallString<128> path(in_memory ? "" : sys::path::parent_path(file));
+  sys::path::append(path, name + ".ki");
+  if (not sys::fs::exists(path))
+    path = name + ".ki";
+  return ki::read(std::string(path), I, error);
+}
+
+// Come parse, ma il programma viene letto da un buffer in memoria invece
+// che da file. name è usato solo per i messaggi di errore (location)
+int driver::parse_string (std::string_view src, const std::string &name) {
+  file = name;
+  definitions.clear();
+  statements.clear();
+  source = src;
+  in_memory = true;
+  location.initialize(&file);
+  scan_begin();
+  yy::parser parser(*this);
+  parser.set_debug_level(trace_parsing);
+  int res = parser.parse();
+  scan_end();
+  return res;
+}
+
 // Implementazione del metodo codegen, che è una "semplice" chiamata del 
 // metodo omonimo presente nel nodo root (il puntatore root è stato scritto dal parser)
-void driver::codegen() {
+// Con debugInfo ogni sorgente diventa una compile unit DWARF. Con
+// trackLocations (remark delle ottimizzazioni) le posizioni nel sorgente
+// sono nell'IR, ma non vengono emesse nel codice oggetto
+bool driver::codegen() {
+  unsigned errors = errorCount;
+  if (debugInfo or trackLocations) {
+    //  The path as given on the command line, relative to the current directory
+    SmallString<128> dir;
+    if (not in_memory)
+      sys::fs::current_path(dir);
+    dbuilder = std::make_unique<DIBuilder>(*module);
+    debugFile = dbuilder->createFile(file, dir);
+    dbuilder->createCompileUnit(dwarf::DW_LANG_C, debugFile, "kcomp", false, "", 0, "",
+                                debugInfo ? DICompileUnit::LineTablesOnly : DICompileUnit::NoDebug);
+    if (not module->getModuleFlag("Debug Info Version")) {
+      module->addModuleFlag(Module::Warning, "Debug Info Version", DEBUG_METADATA_VERSION);
+      module->addModuleFlag(Module::Warning, "Dwarf Version", 4);
+    }
+  }
+
   root->codegen(*this);
+
+  if (dbuilder) {
+    dbuilder->finalize();
+    dbuilder.reset();
+  }
+  return errorCount == errors;
 };
 
 /************************* Sequence tree **************************/
@@ -99,24 +543,21 @@ lexval VariableExprAST::getLexVal() const {
   return lval;
 };
 
-// NamedValues è una tabella che ad ogni variabile (che, in Kaleidoscope1.0, 
-// può essere solo un parametro di funzione) associa non un valore bensì
-// la rappresentazione di una funzione che alloca memoria e restituisce in un
-// registro SSA il puntatore alla memoria allocata. Generare il codice corrispondente
-// ad una varibile equivale dunque a recuperare il tipo della variabile 
-// allocata e il nome del registro e generare una corrispondente istruzione di load
-// Negli argomenti della CreateLoad ritroviamo quindi: (1) il tipo allocato, (2) il registro
-// SSA in cui è stato messo il puntatore alla memoria allocata (si ricordi che A è
-// l'istruzione ma è anche il registro, vista la corrispodenza 1-1 fra le due nozioni), (3)
-// il nome del registro in cui verrà trasferito il valore dalla memoria
+// Le variabili locali (parametri compresi) non risiedono in memoria: NamedVars
+// associa ad ogni nome una variabile dello SSABuilder, che restituisce il
+// registro SSA contenente il valore corrente nel blocco in cui ci si trova
+// (eventualmente un PHI, se il valore dipende dal cammino percorso).
+// Le variabili globali sono invece lette dalla memoria con una load
 Value *VariableExprAST::codegen(driver& drv) {
-  AllocaInst *A = drv.NamedValues[Name];
-  if (A)
-    return builder->CreateLoad(A->getAllocatedType(), A, Name.c_str());
-  
-  GlobalVariable *G = module->getGlobalVariable(Name);
-  if (G)
-    return builder->CreateLoad(G->getValueType(), G, Name.c_str());
+  if (auto var = drv.NamedVars.find(Name); var != drv.NamedVars.end())
+    return drv.ssa.readVariable(var->second, builder->GetInsertBlock());
+
+  GlobalVariable *G = LookupGlobal(drv, Name);
+  if (G) {
+    LoadInst *L = builder->CreateLoad(G->getValueType(), G, Name.c_str());
+    TagAccess(L, Name);
+    return L;
+  }
 
   return LogErrorV("Undeclared variable " + Name);
 }
@@ -165,32 +606,81 @@ Value* CallExprAST::codegen(driver& drv) {
   // il cui nome coincide con il nome memorizzato nel nodo dell'AST
   // Se la funzione non viene trovata (e dunque non è stata precedentemente definita)
   // viene generato un errore
-  Function *CalleeF = module->getFunction(Callee);
+  Function *CalleeF = LookupFunction(drv, Callee);
   if (!CalleeF)
      return LogErrorV("Funzione non definita");
-  // Il secondo controllo è che la funzione recuperata abbia tanti parametri
-  // quanti sono gi argomenti previsti nel nodo AST
-  if (CalleeF->arg_size() != Args.size())
-     return LogErrorV("Numero di argomenti non corretto");
-  // Passato con successo anche il secondo controllo, viene predisposta
-  // ricorsivamente la valutazione degli argomenti presenti nella chiamata 
-  // (si ricordi che gli argomenti possono essere espressioni arbitarie)
+  // Viene quindi predisposta ricorsivamente la valutazione degli argomenti
+  // presenti nella chiamata (si ricordi che gli argomenti possono essere
+  // espressioni arbitarie)
   // I risultati delle valutazioni degli argomenti (registri SSA, come sempre)
   // vengono inseriti in un vettore, dove "se li aspetta" il metodo CreateCall
   // del builder, che viene chiamato subito dopo per la generazione dell'istruzione
-  // IR di chiamata
+  // IR di chiamata.
+  // Un parametro array occupa due parametri LLVM, il puntatore al primo
+  // elemento e la lunghezza: l'argomento corrispondente deve essere il nome
+  // di un array, che viene passato per riferimento
+  FunctionType *FT = CalleeF->getFunctionType();
   std::vector<Value *> ArgsV;
   for (auto arg : Args) {
-     ArgsV.push_back(arg->codegen(drv));
-     if (!ArgsV.back())
+     if (ArgsV.size() >= FT->getNumParams())
+        return LogErrorV("Numero di argomenti non corretto");
+
+     if (not FT->getParamType(ArgsV.size())->isPointerTy()) {
+        ArgsV.push_back(arg->codegen(drv));
+        if (!ArgsV.back())
+           return nullptr;
+        continue;
+     }
+
+     auto *var = dynamic_cast<VariableExprAST *>(arg);
+     if (not var or dynamic_cast<ArrayExprAST *>(arg))
+        return LogErrorV("Argument " + std::to_string(ArgsV.size()) + " of " + Callee + " must be an array");
+     std::string Name = std::get<std::string>(var->getLexVal());
+     ArraySymbol A;
+     if (not LookupArray(drv, Name, A))
         return nullptr;
+     ArgsV.push_back(A.base);
+     ArgsV.push_back(A.length);
   }
-  return builder->CreateCall(CalleeF, ArgsV, "calltmp");
+  // Il secondo controllo è che la funzione recuperata abbia tanti parametri
+  // quanti sono gi argomenti previsti nel nodo AST
+  if (ArgsV.size() != FT->getNumParams())
+     return LogErrorV("Numero di argomenti non corretto");
+
+  // Se tutti gli argomenti sono costanti e la funzione è pura, la chiamata
+  // viene valutata durante la compilazione (si veda consteval.hpp) e
+  // sostituita dal suo risultato. Con --repl solo negli statement, eseguiti
+  // subito: in una definizione il risultato non cambierebbe quando il
+  // chiamato viene ridefinito da una riga successiva
+  std::vector<double> constArgs;
+  for (Value *arg : ArgsV)
+     if (auto *C = dyn_cast<ConstantFP>(arg))
+        constArgs.push_back(C->getValueAPF().convertToDouble());
+  StringRef caller = builder->GetInsertBlock()->getParent()->getName();
+  bool foldable = not drv.repl or std::any_of(drv.statements.begin(), drv.statements.end(),
+                                              [&](auto &statement) { return statement.first == caller; });
+  double result;
+  if (foldable and constArgs.size() == ArgsV.size() and drv.constEval.call(Callee, constArgs, result))
+     return ConstantFP::get(*context, APFloat(result));
+
+  CallInst *call = builder->CreateCall(CalleeF, ArgsV, "calltmp");
+  //  Inlining remarks point at the call, not at the statement
+  if (DILocation *loc = SourceLocation(drv, this))
+    call->setDebugLoc(loc);
+  return call;
 }
 
 /************************* Prototype Tree *************************/
 PrototypeAST::PrototypeAST(std::string Name, std::vector<std::string> Args):
-  Name(Name), Args(std::move(Args)), emitcode(true) {};  //Di regola il codice viene emesso
+  Name(Name), Args(std::move(Args)), ArrayArgs(this->Args.size(), false) {};
+
+PrototypeAST::PrototypeAST(std::string Name, std::vector<std::pair<std::string, bool>> Params):
+  Name(Name) {
+  for (auto &[arg, isArray]: Params) {
+    Args.push_back(arg);
+    ArrayArgs.push_back(isArray);
+  }
+};
 
 lexval PrototypeAST::getLexVal() const {
    lexval lval = Name;
@@ -201,21 +691,37 @@ const std::vector<std::string>& PrototypeAST::getArgs() const {
    return Args;
 };
 
-// Previene la doppia emissione del codice. Si veda il commento più avanti.
-void PrototypeAST::noemit() { 
-   emitcode = false; 
+bool PrototypeAST::isArray(unsigned Idx) const {
+   return ArrayArgs[Idx];
+};
+
+bool PrototypeAST::hasArrays() const {
+   return std::find(ArrayArgs.begin(), ArrayArgs.end(), true) != ArrayArgs.end();
 };
 
+FunctionType *PrototypeAST::getType() const {
+  // Prima definiamo il vettore (qui chiamato Params) con il tipo degli argomenti
+  std::vector<Type*> Params;
+  for (unsigned Idx = 0; Idx < Args.size(); Idx++) {
+    if (ArrayArgs[Idx]) {
+      Params.push_back(PointerType::getUnqual(*context));
+      Params.push_back(Type::getInt64Ty(*context));
+    } else
+      Params.push_back(Type::getDoubleTy(*context));
+  }
+  // Quindi definiamo il tipo della funzione
+  return FunctionType::get(Type::getDoubleTy(*context), Params, false);
+}
+
 Function *PrototypeAST::codegen(driver& drv) {
   // Costruisce una struttura, qui chiamata FT, che rappresenta il "tipo" di una
   // funzione. Con ciò si intende a sua volta una coppia composta dal tipo
   // del risultato (valore di ritorno) e da un vettore che contiene il tipo di tutti
-  // i parametri. Si ricordi, tuttavia, che nel nostro caso l'unico tipo è double.
+  // i parametri. Si ricordi, tuttavia, che nel nostro caso l'unico tipo è double:
+  // un array è passato come puntatore al primo elemento e numero di elementi
+  // (i64), come farebbe una funzione C.
   
-  // Prima definiamo il vettore (qui chiamato Doubles) con il tipo degli argomenti
-  std::vector<Type*> Doubles(Args.size(), Type::getDoubleTy(*context));
-  // Quindi definiamo il tipo (FT) della funzione
-  FunctionType *FT = FunctionType::get(Type::getDoubleTy(*context), Doubles, false);
+  FunctionType *FT = getType();
   // Infine definiamo una funzione (al momento senza body) del tipo creato e con il nome
   // presente nel nodo AST. ExternalLinkage vuol dire che la funzione può avere
   // visibilità anche al di fuori del modulo
@@ -224,93 +730,340 @@ Function *PrototypeAST::codegen(driver& drv) {
   // Ad ogni parametro della funzione F (che, è bene ricordare, è la rappresentazione 
   // llvm di una funzione, non è una funzione C++) attribuiamo ora il nome specificato dal
   // programmatore e presente nel nodo AST relativo al prototipo
-  unsigned Idx = 0;
-  for (auto &Arg : F->args())
-    Arg.setName(Args[Idx++]);
-
-  /* Abbiamo completato la creazione del codice del prototipo.
-     Il codice può quindi essere emesso, ma solo se esso corrisponde
-     ad una dichiarazione extern. Se invece il prototipo fa parte
-     della definizione "completa" di una funzione (prototipo+body) allora
-     l'emissione viene fatta al momendo dell'emissione della funzione.
-     In caso contrario nel codice si avrebbe sia una dichiarazione
-     (come nel caso di funzione esterna) sia una definizione della stessa
-     funzione.
-  */
-  if (emitcode) {
-    F->print(errs());
-    fprintf(stderr, "\n");
-  };
-  
+  // Gli array sono passati per riferimento, senza copie. Nel linguaggio non
+  // esistono puntatori e l'indirizzo di un array non può essere salvato
+  // (nocapture); un parametro può invece coincidere con un altro parametro
+  // o con un array globale, per cui non è noalias
+  auto Arg = F->arg_begin();
+  for (unsigned Idx = 0; Idx < Args.size(); Idx++) {
+    Arg->setName(Args[Idx]);
+    if (ArrayArgs[Idx]) {
+      Arg->addAttr(Attribute::NoCapture);
+      (++Arg)->setName(Args[Idx] + ".len");
+    }
+    ++Arg;
+  }
+
+  // Il codice non viene emesso qui: il modulo viene stampato per intero
+  // al termine della generazione (si veda kcomp.cpp), così che una
+  // dichiarazione extern e una definizione non compaiano due volte
   return F;
 }
 
 /************************* Function Tree **************************/
-FunctionAST::FunctionAST(PrototypeAST* Proto, ExprAST* Body): Proto(Proto), Body(Body) {};
+FunctionAST::FunctionAST(PrototypeAST* Proto, ExprAST* Body): Proto(Proto), Body(Body), memoSize(0) {};
+
+void FunctionAST::memoize(unsigned entries) {
+  //  Power of two, so that the slot is given by the high bits of the hash
+  memoSize = std::max<unsigned>(PowerOf2Ceil(entries), memoProbes);
+}
+
+/* Una funzione pure non deve dipendere dallo stato globale né modificarlo:
+   non può accedere a variabili globali né chiamare funzioni extern.
+   Le funzioni chiamate devono essere a loro volta pure, annotate o no.
+   visited contiene le funzioni già esaminate (o in corso di definizione) */
+static bool IsPure(driver &drv, Function *F, std::set<Function *> &visited, std::string &why) {
+  if (not visited.insert(F).second)
+    return true;
+
+  for (Instruction &I: instructions(F)) {
+    Value *ptr = nullptr;
+    if (auto *L = dyn_cast<LoadInst>(&I))
+      ptr = L->getPointerOperand();
+    else if (auto *S = dyn_cast<StoreInst>(&I))
+      ptr = S->getPointerOperand();
+    //  Locals arrays (on the stack or in the arena) are the only memory a
+    //  pure function may use, besides read-only data
+    if (ptr) {
+      const Value *object = getUnderlyingObject(ptr);
+      auto *call = dyn_cast<CallInst>(object);
+      auto *data = dyn_cast<GlobalVariable>(object);
+      if (not isa<AllocaInst>(object) and not (call and IsArenaRuntime(call->getCalledFunction()))
+          and not (data and data->isConstant())) {
+        why = "accesses global " + object->getName().str();
+        return false;
+      }
+    }
+
+    if (auto *call = dyn_cast<CallInst>(&I)) {
+      Function *callee = call->getCalledFunction();
+      //  Intrinsics (memset, memcpy, lifetime markers) only work on local arrays
+      if (drv.memoized.count(callee) or IsArenaRuntime(callee) or IsProfileRuntime(callee) or callee->isIntrinsic())
+        continue;
+      if (callee->isDeclaration() and not visited.count(callee)) {
+        why = "calls extern " + callee->getName().str();
+        return false;
+      }
+      if (not IsPure(drv, callee, visited, why))
+        return false;
+    }
+  }
+  return true;
+}
 
 Function *FunctionAST::codegen(driver& drv) {
   // Verifica che la funzione non sia già presente nel modulo, cioò che non
   // si tenti una "doppia definizione"
-  Function *function = 
-      module->getFunction(std::get<std::string>(Proto->getLexVal()));
+  Function *function = LookupFunction(drv, std::get<std::string>(Proto->getLexVal()));
   // Se la funzione non è già presente, si prova a definirla, innanzitutto
   // generando (ma non emettendo) il codice del prototipo
   if (!function)
     function = Proto->codegen(drv);
   // Se, per qualche ragione, la definizione "fallisce" si restituisce nullptr
   if (!function)
-    return nullptr;  
+    return nullptr;
+
+  // Il corpo importato da un file .ki è solo una copia: vale quello definito qui
+  if (function->hasAvailableExternallyLinkage())
+    function->deleteBody();
+
+  // Una dichiarazione extern precedente deve avere gli stessi parametri
+  if (function->getFunctionType() != Proto->getType())
+    return (Function *)LogErrorV("Function " + function->getName().str() + " redeclared with different parameters");
+
+  // Le chiamate a una funzione pure sono memoizzate in base al valore degli
+  // argomenti: il contenuto di un array non fa parte della chiave
+  if (memoSize and Proto->hasArrays())
+    return (Function *)LogErrorV("Pure function " + function->getName().str() + " can not take arrays");
+
+  // Per una funzione pure il corpo viene generato in name.impl, mentre name
+  // diventa il wrapper che consulta la tabella di memoizzazione: anche le
+  // chiamate ricorsive nel corpo passano quindi dalla tabella. Senza tabelle
+  // (memoTables) viene solo verificato che la funzione sia pura
+  Function *memo = nullptr;
+  if (memoSize and drv.memoTables) {
+    memo = function;
+    function = Function::Create(memo->getFunctionType(), Function::InternalLinkage,
+                                memo->getName() + ".impl", *module);
+    for (unsigned Idx = 0; Idx < memo->arg_size(); Idx++)
+      function->getArg(Idx)->setName(memo->getArg(Idx)->getName());
+  }
 
   // Altrimenti si crea un blocco di base in cui iniziare a inserire il codice
   BasicBlock *BB = BasicBlock::Create(*context, "entry", function);
   builder->SetInsertPoint(BB);
- 
-  // Ora viene la parte "più delicata". Per ogni parametro formale della
-  // funzione, nella symbol table si registra una coppia in cui la chiave
-  // è il nome del parametro mentre il valore è un'istruzione alloca, generata
-  // invocando l'utility CreateEntryBlockAlloca già commentata.
-  // Vale comunque la pena ricordare: l'istruzione di allocazione riserva 
-  // spazio in memoria (nel nostro caso per un double) e scrive l'indirizzo
-  // in un registro SSA
-  // Il builder crea poi un'istruzione che memorizza il valore del parametro x
-  // (al momento contenuto nel registro SSA %x) nell'area di memoria allocata.
-  // Si noti che il builder conosce il registro che contiene il puntatore all'area
-  // perché esso è parte della rappresentazione C++ dell'istruzione di allocazione
-  // (variabile Alloca) 
-  
-  for (auto &Arg : function->args()) {
-    // Genera l'istruzione di allocazione per il parametro corrente
-    AllocaInst *Alloca = CreateEntryBlockAlloca(function, Arg.getName());
-    // Genera un'istruzione per la memorizzazione del parametro nell'area
-    // di memoria allocata
-    builder->CreateStore(&Arg, Alloca);
-    // Registra gli argomenti nella symbol table per eventuale riferimento futuro
-    drv.NamedValues[std::string(Arg.getName())] = Alloca;
-  } 
+  BeginSubprogram(drv, function, Loc);
+
+  // Le symbol table e lo stato della costruzione SSA sono relativi alla
+  // singola funzione. L'entry block non ha predecessori: è subito "sealed"
+  drv.NamedVars.clear();
+  drv.NamedValues.clear();
+  drv.scopes.clear();
+  drv.constantCopies.clear();
+  drv.ssa.reset();
+  drv.ssa.sealBlock(BB);
+
+  // Ogni parametro formale diventa una variabile, il cui valore iniziale
+  // (nell'entry block) è l'argomento stesso: nessuna alloca né store.
+  // Un parametro array è la coppia (puntatore, lunghezza)
+  auto Arg = function->arg_begin();
+  for (unsigned Idx = 0; Idx < Proto->getArgs().size(); Idx++) {
+    const std::string &Name = Proto->getArgs()[Idx];
+    if (Proto->isArray(Idx)) {
+      Argument *base = &*Arg++;
+      drv.NamedValues[Name] = {base, &*Arg++};
+      continue;
+    }
+    unsigned var = drv.ssa.newVariable(Name);
+    drv.ssa.writeVariable(var, BB, &*Arg++);
+    drv.NamedVars[Name] = var;
+  }
   
   // Ora può essere generato il codice corssipondente al body (che potrà
   // fare riferimento alla symbol table)
+  BeginScope(drv);
   if (Value *RetVal = Body->codegen(drv)) {
     // Se la generazione termina senza errori, ciò che rimane da fare è
     // di generare l'istruzione return, che ("a tempo di esecuzione") prenderà
     // il valore lasciato nel registro RetVal 
 
+    EndScope(drv);
     builder->CreateRet(RetVal);
+    builder->SetCurrentDebugLocation(DebugLoc());
+    ForwardConstantArrays(drv);
 
     // Effettua la validazione del codice e un controllo di consistenza
     verifyFunction(*function);
- 
-    // Emissione del codice su su stderr) 
-    function->print(errs());
-    fprintf(stderr, "\n");
+
+    if (memoSize) {
+      Function *pure = memo ? memo : function;
+      std::set<Function *> visited;
+      if (memo)
+        visited.insert(memo);
+      std::string why;
+      if (not IsPure(drv, function, visited, why)) {
+        LogErrorV("Function " + pure->getName().str() + " is declared pure but " + why);
+        function->eraseFromParent();
+        if (memo)
+          memo->eraseFromParent();
+        return nullptr;
+      }
+      if (memo)
+        codegenMemo(memo, function);
+      drv.memoized.insert(pure);
+      function = pure;
+    }
+
+    //  Batch columns are scalar parameters
+    if (drv.wantsBatch(std::string(function->getName())) and not Proto->hasArrays())
+      codegenBatch(function);
+    if (drv.instrumentFunctions)
+      InstrumentFunction(drv, function, Loc);
     return function;
   }
 
   // Errore nella definizione. La funzione viene rimossa
+  builder->SetCurrentDebugLocation(DebugLoc());
   function->eraseFromParent();
+  if (memo)
+    memo->eraseFromParent();
   return nullptr;
 };
 
+Function *FunctionAST::codegenBatch(Function *scalar) {
+  //  One read-only column per parameter, the output column and the row count
+  Type *doubleTy = Type::getDoubleTy(*context);
+  Type *ptrTy = PointerType::getUnqual(*context);
+  Type *sizeTy = module->getDataLayout().getIntPtrType(*context);
+
+  std::vector<Type *> params(scalar->arg_size() + 1, ptrTy);
+  params.push_back(sizeTy);
+  FunctionType *FT = FunctionType::get(Type::getVoidTy(*context), params, false);
+  Function *batch = Function::Create(FT, Function::ExternalLinkage, scalar->getName() + "_batch", *module);
+
+  //  Columns never overlap each other nor the output: this is what allows
+  //  the loop to be vectorized without runtime checks
+  for (auto &Arg : batch->args()) {
+    if (not Arg.getType()->isPointerTy())
+      continue;
+    Arg.addAttr(Attribute::NoAlias);
+    Arg.addAttr(Arg.getArgNo() < scalar->arg_size() ? Attribute::ReadOnly : Attribute::WriteOnly);
+  }
+  unsigned Idx = 0;
+  for (auto &Arg : scalar->args())
+    batch->getArg(Idx++)->setName(Arg.getName());
+  Argument *out = batch->getArg(scalar->arg_size());
+  Argument *n = batch->getArg(scalar->arg_size() + 1);
+  out->setName("out");
+  n->setName("n");
+
+  BasicBlock *entry = BasicBlock::Create(*context, "entry", batch);
+  BasicBlock *loop = BasicBlock::Create(*context, "loop", batch);
+  BasicBlock *exit = BasicBlock::Create(*context, "exit", batch);
+
+  builder->SetInsertPoint(entry);
+  builder->CreateCondBr(builder->CreateICmpEQ(n, ConstantInt::get(sizeTy, 0)), exit, loop);
+
+  builder->SetInsertPoint(loop);
+  PHINode *i = builder->CreatePHI(sizeTy, 2, "i");
+  i->addIncoming(ConstantInt::get(sizeTy, 0), entry);
+
+  std::vector<Value *> row;
+  for (unsigned col = 0; col < scalar->arg_size(); col++) {
+    Value *colPtr = builder->CreateInBoundsGEP(doubleTy, batch->getArg(col), i);
+    row.push_back(builder->CreateLoad(doubleTy, colPtr, batch->getArg(col)->getName()));
+  }
+  CallInst *call = builder->CreateCall(scalar, row, "row");
+  call->addFnAttr(Attribute::AlwaysInline);
+  builder->CreateStore(call, builder->CreateInBoundsGEP(doubleTy, out, i));
+
+  Value *next = builder->CreateNUWAdd(i, ConstantInt::get(sizeTy, 1), "next");
+  i->addIncoming(next, loop);
+  BranchInst *latch = builder->CreateCondBr(builder->CreateICmpEQ(next, n), exit, loop);
+
+  //  Loop metadata: the first operand is the (distinct) loop id itself
+  MDNode *vectorize = MDNode::get(*context, {
+    MDString::get(*context, "llvm.loop.vectorize.enable"),
+    ConstantAsMetadata::get(builder->getTrue())});
+  MDNode *loopID = MDNode::getDistinct(*context, {nullptr, vectorize});
+  loopID->replaceOperandWith(0, loopID);
+  latch->setMetadata(LLVMContext::MD_loop, loopID);
+
+  builder->SetInsertPoint(exit);
+  builder->CreateRetVoid();
+
+  verifyFunction(*batch);
+  return batch;
+}
+
+void FunctionAST::codegenMemo(Function *memo, Function *impl) {
+  //  Entry: {tag, argument bits, value}. Tag 0 marks an empty slot; arguments are
+  //  compared bit by bit, so that -0.0 and 0.0 (or NaNs) are different keys
+  Type *i64 = builder->getInt64Ty();
+  Type *doubleTy = builder->getDoubleTy();
+  unsigned nargs = memo->arg_size();
+  StructType *entryTy = StructType::get(*context, {i64, ArrayType::get(i64, nargs), doubleTy});
+  ArrayType *tableTy = ArrayType::get(entryTy, memoSize);
+  std::string tableName = memo->getName().str() + ".memo";
+  GlobalVariable *table = new GlobalVariable(*module, tableTy, false, GlobalValue::InternalLinkage,
+                                             Constant::getNullValue(tableTy), tableName);
+
+  BasicBlock *entry = BasicBlock::Create(*context, "entry", memo);
+  BasicBlock *probe = BasicBlock::Create(*context, "probe", memo);
+  BasicBlock *check = BasicBlock::Create(*context, "check", memo);
+  BasicBlock *next = BasicBlock::Create(*context, "next", memo);
+  BasicBlock *hit = BasicBlock::Create(*context, "hit", memo);
+  BasicBlock *miss = BasicBlock::Create(*context, "miss", memo);
+
+  //  Multiplicative (Fibonacci) hashing: the high bits select the first slot
+  builder->SetInsertPoint(entry);
+  std::vector<Value *> keys;
+  Value *hash = builder->getInt64(0);
+  for (auto &Arg : memo->args()) {
+    keys.push_back(builder->CreateBitCast(&Arg, i64, Arg.getName() + ".bits"));
+    hash = builder->CreateMul(builder->CreateXor(hash, keys.back()), builder->getInt64(0x9E3779B97F4A7C15ull));
+  }
+  Value *home = builder->CreateLShr(hash, 64 - Log2_32(memoSize), "home");
+  Value *tag = builder->CreateOr(hash, 1, "tag");
+  builder->CreateBr(probe);
+
+  //  Linear probing of memoProbes consecutive slots: they share one or two cache lines
+  builder->SetInsertPoint(probe);
+  PHINode *i = builder->CreatePHI(i64, 2, "i");
+  i->addIncoming(builder->getInt64(0), entry);
+  Value *slot = builder->CreateAnd(builder->CreateAdd(home, i), memoSize - 1, "slot");
+  LoadInst *slotTag = builder->CreateLoad(i64, builder->CreateInBoundsGEP(tableTy, table, {builder->getInt64(0), slot, builder->getInt32(0)}));
+  TagAccess(slotTag, tableName);
+  builder->CreateCondBr(builder->CreateICmpEQ(slotTag, builder->getInt64(0)), miss, check);
+
+  builder->SetInsertPoint(check);
+  Value *match = builder->CreateICmpEQ(slotTag, tag);
+  for (unsigned k = 0; k < nargs; k++) {
+    LoadInst *key = builder->CreateLoad(i64, builder->CreateInBoundsGEP(tableTy, table, {builder->getInt64(0), slot, builder->getInt32(1), builder->getInt32(k)}));
+    TagAccess(key, tableName);
+    match = builder->CreateAnd(match, builder->CreateICmpEQ(key, keys[k]));
+  }
+  builder->CreateCondBr(match, hit, next);
+
+  builder->SetInsertPoint(next);
+  Value *inext = builder->CreateAdd(i, builder->getInt64(1));
+  i->addIncoming(inext, next);
+  builder->CreateCondBr(builder->CreateICmpEQ(inext, builder->getInt64(memoProbes)), miss, probe);
+
+  builder->SetInsertPoint(hit);
+  LoadInst *cached = builder->CreateLoad(doubleTy, builder->CreateInBoundsGEP(tableTy, table, {builder->getInt64(0), slot, builder->getInt32(2)}), "cached");
+  TagAccess(cached, tableName);
+  builder->CreateRet(cached);
+
+  //  The first empty slot, or the home slot (evicted) if all of them are taken.
+  //  The entry is written after the call: the recursion may use the same slots
+  builder->SetInsertPoint(miss);
+  PHINode *victim = builder->CreatePHI(i64, 2, "victim");
+  victim->addIncoming(slot, probe);
+  victim->addIncoming(home, next);
+  std::vector<Value *> args;
+  for (auto &Arg : memo->args())
+    args.push_back(&Arg);
+  Value *result = builder->CreateCall(impl, args, "result");
+  for (unsigned k = 0; k < nargs; k++)
+    TagAccess(builder->CreateStore(keys[k], builder->CreateInBoundsGEP(tableTy, table, {builder->getInt64(0), victim, builder->getInt32(1), builder->getInt32(k)})), tableName);
+  TagAccess(builder->CreateStore(result, builder->CreateInBoundsGEP(tableTy, table, {builder->getInt64(0), victim, builder->getInt32(2)})), tableName);
+  TagAccess(builder->CreateStore(tag, builder->CreateInBoundsGEP(tableTy, table, {builder->getInt64(0), victim, builder->getInt32(0)})), tableName);
+  builder->CreateRet(result);
+
+  verifyFunction(*memo);
+}
+
 IfExprAST::IfExprAST(ExprAST *cond, ExprAST *trueexp, ExprAST *falseexp) :
 cond(cond), trueexp(trueexp), falseexp(falseexp) {}
 
@@ -329,6 +1082,9 @@ Value * IfExprAST::codegen(driver& drv)
   BasicBlock *MergeBB = BasicBlock::Create(*context, "mergeblock");
 
   builder->CreateCondBr(condv, TrueBB, FalseBB);
+  // I due rami hanno un solo predecessore, ormai noto
+  drv.ssa.sealBlock(TrueBB);
+  drv.ssa.sealBlock(FalseBB);
 
   // Posso cominciare a generare la parte true
   // Cambiamo blocco del builder.
@@ -357,6 +1113,7 @@ Value * IfExprAST::codegen(driver& drv)
   // Inseriamo il merge block
   fun->insert(fun->end(), MergeBB);
   builder->SetInsertPoint(MergeBB);
+  drv.ssa.sealBlock(MergeBB);
 
   // Riunione dei flussi. PHINode è un particolare value.
   PHINode *P = builder->CreatePHI(Type::getDoubleTy(*context), 2);  // il 2 sta per numero di coppie uguale al
@@ -378,40 +1135,34 @@ Value * BlockAST::codegen(driver &drv) {
   //  Bindings can shadow variables, thus they must be replaced before generating code for
   //  the statements.
 
-  std::map<std::string, AllocaInst *> shadowed;
+  //  The symbol tables are restored on exit. Globals need not to be shadowed: since local
+  //  vars are checked first, this block is declaring local variables, with the same name as
+  //  a global.
+  auto shadowedVars = drv.NamedVars;
+  auto shadowedArrays = drv.NamedValues;
+  BeginScope(drv);
 
   for (auto bind: Bindings) {
-    std::string const &name = bind->getName();
-    AllocaInst *boundVal = bind->codegen(drv);
-    if (not boundVal) {
+    EmitLocation(drv, bind);
+    if (not bind->codegen(drv)) {
       return LogErrorV("Invalid variable binding"); // invalid binding
     }
-
-    auto alloc = drv.NamedValues[name];
-    if (alloc)
-      shadowed[name] = alloc;
-
-    drv.NamedValues[name] = boundVal;
-    
-    //  Globals need not to be shadowed: since local vars are checked first, this blocks is
-    //  declaring local variables, with the same name as a global.
   }
 
   Value *ret;
   for (auto stptr = Statements.rbegin(); stptr != Statements.rend(); stptr++) {
     auto &stmt = *stptr;
+    EmitLocation(drv, stmt);
     ret = stmt->codegen(drv);
     if (not ret)
       return LogErrorV("Error in generating calls for block");
   }
 
 
-  // Restore shadowed variables
-  for (auto bind: Bindings) {
-    drv.NamedValues.erase(bind->getName());
-  }
-
-  drv.NamedValues.merge(shadowed);
+  // Restore shadowed variables, releasing the arrays of the block
+  EndScope(drv);
+  drv.NamedVars = std::move(shadowedVars);
+  drv.NamedValues = std::move(shadowedArrays);
 
   return ret;
 }
@@ -423,76 +1174,88 @@ std::string & VarBindingAST::getName() {
   return Name;
 }
 
-AllocaInst * VarBindingAST::codegen(driver &drv) {
-  Function *fun = builder->GetInsertBlock()->getParent();
-  AllocaInst *alloc = CreateEntryBlockAlloca(fun, Name);
-  
-  if (not alloc) {
-    outs() << "Can't allocate binding\n";
-    return nullptr;
-  }
-
+Value * VarBindingAST::codegen(driver &drv) {
+  //  The initializer is evaluated before the binding, so that var x = x+1 refers to the
+  //  shadowed x
+  Value *ExpVal = ConstantFP::get(Type::getDoubleTy(*context), 0.0);
   if (Val != nullptr) { // initexp is not empty
-    Value *ExpVal = Val->codegen(drv);
-
-    if (not ExpVal) {
-      outs() << "Expression value is null\n";
-      return nullptr;
-    }
+    ExpVal = Val->codegen(drv);
 
-    builder->CreateStore(ExpVal, alloc);
-  } else {
-    builder->CreateStore(ConstantFP::get(Type::getDoubleTy(*context), 0.0), alloc);
+    if (not ExpVal)
+      return LogErrorV("Expression value is null");
   }
 
-  drv.NamedValues[Name] = alloc;
-  return alloc;
+  //  Each binding is a new SSA variable, even if it shadows another one
+  unsigned var = drv.ssa.newVariable(Name);
+  drv.ssa.writeVariable(var, builder->GetInsertBlock(), ExpVal);
+  drv.NamedVars[Name] = var;
+  drv.NamedValues.erase(Name);
+  return ExpVal;
 }
 
 AssignmentAST::AssignmentAST(std::string Id, ExprAST *Val): Id(Id), Val(Val) {}
 
 Value * AssignmentAST::getVariable(driver &drv) {
-  //  Search variable in local table
-  Value *ptr = drv.NamedValues[Id];
-  if (ptr)
-    return ptr;
-  
-  //  Resolve global table
-  ptr = module->getGlobalVariable(Id);
-
-  if (ptr)
-    return ptr;
+  //  Local arrays can only be assigned element by element
+  if (drv.NamedValues.count(Id))
+    return LogErrorV(Id + " is an array");
 
-  return nullptr;
+  //  Resolve global table
+  return LookupGlobal(drv, Id);
 }
 
 Value * AssignmentAST::codegen(driver &drv) {
   Value *rval = Val->codegen(drv);
+  if (not rval)
+    return nullptr;
+
+  //  A local scalar gets a new SSA definition in the current block
+  if (auto var = drv.NamedVars.find(Id); var != drv.NamedVars.end()) {
+    drv.ssa.writeVariable(var->second, builder->GetInsertBlock(), rval);
+    return rval;
+  }
 
   Value *ptr = getVariable(drv);
 
   if (not ptr)
     return LogErrorV("Variable not declared.");
 
-  return builder->CreateStore(rval, ptr, false);
+  StoreInst *S = builder->CreateStore(rval, ptr, false);
+  TagAccess(S, Id);
+  return S;
 }
 
-GlobalVarAST::GlobalVarAST(std::string Name): Name(Name) {}
+GlobalVarAST::GlobalVarAST(std::string Name, double Init): Name(Name), Init(Init), Imported(false) {}
+
+std::string & GlobalVarAST::getName() {
+  return Name;
+}
 
 Type * GlobalVarAST::getVariableType() {
   return Type::getDoubleTy(*context);
 }
 
 Constant * GlobalVarAST::codegen(driver &drv) {
-  //  Find out if the variable is already defined
-  if(module->getGlobalVariable(Name))
+  //  Find out if the variable is already defined. An import only declares it:
+  //  the definition (in the same module) may come before or after the import
+  auto contextDouble = getVariableType();
+  GlobalVariable *var = module->getGlobalVariable(Name);
+  if (var and (var->getValueType() != contextDouble or not (Imported or var->isDeclaration())))
     return (GlobalVariable *)LogErrorV("Global variable already defined");
+  if (Imported)
+    return var ? var : new GlobalVariable(*module, contextDouble, false, GlobalValue::ExternalLinkage, nullptr, Name);
 
-  auto contextDouble = getVariableType();
-  GlobalVariable *var = new GlobalVariable(*module, contextDouble, false, GlobalValue::CommonLinkage, Constant::getNullValue(contextDouble), Name);
+  Constant *initializer = Constant::getNullValue(contextDouble);
+  if (contextDouble->isDoubleTy())
+    initializer = ConstantFP::get(contextDouble, Init);
 
-  var->print(errs()); // Output variable definition on stderr
-  cerr << endl;
+  //  Common symbols can only be zero-initialized
+  auto linkage = initializer->isNullValue() ? GlobalValue::CommonLinkage : GlobalValue::ExternalLinkage;
+  if (var) {
+    var->setInitializer(initializer);
+    var->setLinkage(linkage);
+  } else
+    var = new GlobalVariable(*module, contextDouble, false, linkage, initializer, Name);
 
   return var;
 }
@@ -533,8 +1296,11 @@ Value * IfStatementAST::codegen(driver& drv) {
 
   if (falsestmt) {
     builder->CreateCondBr(condv, TrueBB, FalseBB);
+    drv.ssa.sealBlock(TrueBB);
+    drv.ssa.sealBlock(FalseBB);
 
     builder->SetInsertPoint(TrueBB);
+    EmitLocation(drv, truestmt);
     Value *TrueV = truestmt->codegen(drv);  // codegen chiama il builder e inserisce il codice
     if (not TrueV)
       return nullptr;
@@ -546,6 +1312,7 @@ Value * IfStatementAST::codegen(driver& drv) {
     fun->insert(fun->end(), FalseBB);  // inserisci il blocco alla fine della funzione
     builder->SetInsertPoint(FalseBB);
 
+    EmitLocation(drv, falsestmt);
     Value *FalseV = falsestmt->codegen(drv);
     if (not FalseV)
       return nullptr;
@@ -557,8 +1324,10 @@ Value * IfStatementAST::codegen(driver& drv) {
 
   } else {
     builder->CreateCondBr(condv, TrueBB, MergeBB);
+    drv.ssa.sealBlock(TrueBB);
 
     builder->SetInsertPoint(TrueBB);
+    EmitLocation(drv, truestmt);
     Value *TrueV = truestmt->codegen(drv);  // codegen chiama il builder e inserisce il codice
     if (not TrueV)
       return nullptr;
@@ -571,6 +1340,7 @@ Value * IfStatementAST::codegen(driver& drv) {
   // Inseriamo il merge block
   fun->insert(fun->end(), MergeBB);
   builder->SetInsertPoint(MergeBB);
+  drv.ssa.sealBlock(MergeBB);
 
   return ConstantFP::get(Type::getDoubleTy(*context), 0.0);
 }
@@ -595,6 +1365,89 @@ Value * ForInitAST::codegen(driver& drv) {
 ForStatementAST::ForStatementAST(ForInitAST *init, ConditionalExprAST *cond, AssignmentAST *update, RootAST *body):
 init(init), cond(cond), update(update), body(body) {}
 
+bool LoopHints::set(const std::string &hint, double value) {
+  bool none = value == -1;
+  bool count = value >= 1 and value <= (1 << 16) and value == (unsigned)value;
+  if (hint == "unroll" and none)
+    unroll = true;
+  else if ((hint == "unroll" or hint == "unroll.count") and count) {
+    unroll = true;
+    unrollCount = value;
+  }
+  else if (hint == "nounroll" and none) {
+    unroll = false;
+    unrollCount = 0;
+  }
+  else if (hint == "vectorize" and none)
+    vectorize = true;
+  else if ((hint == "vectorize" or hint == "vectorize.width") and count) {
+    vectorize = true;
+    vectorizeWidth = value;
+  }
+  else if (hint == "novectorize" and none) {
+    vectorize = false;
+    vectorizeWidth = 0;
+  }
+  else if ((hint == "interleave" or hint == "interleave.count") and count)
+    interleaveCount = value;
+  else if (hint == "parallel_accesses" and none)
+    parallelAccesses = true;
+  else
+    return false;
+  return true;
+}
+
+/* Loop ID del ciclo: un nodo distinct che riferisce sé stesso, seguito
+   dalla posizione del for (usata dai remark) e dalle proprietà richieste.
+   Con @parallel_accesses tutti gli accessi alla memoria del ciclo (anche
+   quelli dei cicli annidati) appartengono a un access group: il vettorizzatore
+   li considera indipendenti fra iterazioni diverse, senza controlli a runtime. */
+static MDNode *LoopMetadata(const LoopHints &hints, BasicBlock *first, BasicBlock *exit) {
+  SmallVector<Metadata *, 8> properties = {nullptr};
+  if (DILocation *loc = builder->getCurrentDebugLocation())
+    properties.push_back(loc);
+
+  auto property = [&](StringRef name, Constant *value = nullptr) {
+    SmallVector<Metadata *, 2> operands = {MDString::get(*context, name)};
+    if (value)
+      operands.push_back(ConstantAsMetadata::get(value));
+    properties.push_back(MDNode::get(*context, operands));
+  };
+
+  if (hints.unroll == false)
+    property("llvm.loop.unroll.disable");
+  else if (hints.unrollCount)
+    property("llvm.loop.unroll.count", builder->getInt32(hints.unrollCount));
+  else if (hints.unroll == true)
+    property("llvm.loop.unroll.enable");
+
+  if (hints.vectorize)
+    property("llvm.loop.vectorize.enable", builder->getInt1(*hints.vectorize));
+  if (hints.vectorizeWidth)
+    property("llvm.loop.vectorize.width", builder->getInt32(hints.vectorizeWidth));
+  if (hints.interleaveCount)
+    property("llvm.loop.interleave.count", builder->getInt32(hints.interleaveCount));
+
+  if (hints.parallelAccesses) {
+    MDNode *group = MDNode::getDistinct(*context, {});
+    //  The blocks of the loop follow its condition, except the exit that was created
+    //  before the body
+    for (BasicBlock &BB: make_range(first->getIterator(), first->getParent()->end()))
+      if (&BB != exit)
+        for (Instruction &I: BB)
+          if (I.mayReadOrWriteMemory())
+            I.setMetadata(LLVMContext::MD_access_group,
+                          uniteAccessGroups(I.getMetadata(LLVMContext::MD_access_group), group));
+    properties.push_back(MDNode::get(*context, {MDString::get(*context, "llvm.loop.parallel_accesses"), group}));
+  }
+
+  if (properties.size() == 1)
+    return nullptr;
+  MDNode *loopID = MDNode::getDistinct(*context, properties);
+  loopID->replaceOperandWith(0, loopID);
+  return loopID;
+}
+
 Value * ForStatementAST::codegen(driver& drv) {
   Function *fun = currentFunction();
   BasicBlock *forInit = BasicBlock::Create(*context, "forinit", fun);
@@ -604,38 +1457,62 @@ Value * ForStatementAST::codegen(driver& drv) {
 
   //  Point to init from current BB
   builder->CreateBr(forInit);
+  drv.ssa.sealBlock(forInit);
 
-  //  Init variable
+  //  Init variable. The binding (if any) is visible only inside the loop
   builder->SetInsertPoint(forInit);
-  AllocaInst *shadowed = nullptr;
-  if (init->isBinding()) {
-    std::string Name = init->getName();
-    shadowed = drv.NamedValues[Name];
-    //if shadowed is null: binding is either shadowing a global or is not shadowing anything
+  Constant *site = nullptr;
+  if (drv.instrumentLoops) {
+    //  A loop of a pure function is in name.impl: the profile shows name
+    StringRef name = fun->getName();
+    name.consume_back(".impl");
+    EmitLocation(drv, this);
+    site = ProfileSite(drv, name, KRT_PROF_LOOP, Loc);
+    ProfileEnter(site);
   }
+  auto shadowedVars = drv.NamedVars;
+  auto shadowedArrays = drv.NamedValues;
+  BeginScope(drv);
   init->codegen(drv);
+  BasicBlock *preheader = builder->GetInsertBlock();
   builder->CreateBr(condition);
 
-  //  Check condition
+  //  Check condition. The block is sealed only after the back edge from the body exists:
+  //  variables read here get a (possibly incomplete) PHI
   builder->SetInsertPoint(condition);
+  PHINode *iterations = nullptr;
+  if (site) {
+    iterations = builder->CreatePHI(builder->getInt64Ty(), 2, "for.iterations");
+    iterations->addIncoming(builder->getInt64(0), preheader);
+  }
+  EmitLocation(drv, this);
   Value *condval = cond->codegen(drv);
   if (not condval)
     return LogErrorV("Condition value is a nullptr");
   builder->CreateCondBr(condval, bodyBlock, exit);
+  drv.ssa.sealBlock(bodyBlock);
+  drv.ssa.sealBlock(exit);
 
   builder->SetInsertPoint(bodyBlock);
+  EmitLocation(drv, body);
   body->codegen(drv);
+  EmitLocation(drv, this);
   update->codegen(drv);
-  builder->CreateBr(condition);
+  if (iterations)
+    iterations->addIncoming(builder->CreateNUWAdd(iterations, builder->getInt64(1), "for.next"),
+                            builder->GetInsertBlock());
+  BranchInst *latch = builder->CreateBr(condition);
+  if (MDNode *loopID = LoopMetadata(hints, condition, exit))
+    latch->setMetadata(LLVMContext::MD_loop, loopID);
+  drv.ssa.sealBlock(condition);
 
   builder->SetInsertPoint(exit);
 
-  if (init->isBinding()) {
-    drv.NamedValues.erase(init->getName());
-
-    if (shadowed)
-      drv.NamedValues[init->getName()] = shadowed;
-  }
+  EndScope(drv);
+  if (site)
+    ProfileExit(site, iterations);
+  drv.NamedVars = std::move(shadowedVars);
+  drv.NamedValues = std::move(shadowedArrays);
 
   return ConstantFP::get(Type::getDoubleTy(*context), 0.0);
 }
@@ -656,7 +1533,7 @@ Value * ConditionalExprAST::codegen(driver& drv) {
     return LHS->codegen(drv);
   } else if (kind == "not") {
     Value *cond = RHS->codegen(drv);
-    return builder->CreateNeg(cond);
+    return builder->CreateNot(cond);
   }
   
   if (kind == "and") {
@@ -676,116 +1553,314 @@ Value * ConditionalExprAST::codegen(driver& drv) {
 
 ArrayBindingAST::ArrayBindingAST(std::string Name, int Size): ArrayBindingAST(Name, Size, {}) {}
 
-ArrayBindingAST::ArrayBindingAST(std::string Name, int Size, std::vector<ExprAST *> Init): Size(Size), Init(Init), VarBindingAST(Name, nullptr) {}
+ArrayBindingAST::ArrayBindingAST(std::string Name, int Size, std::vector<ExprAST *> Init): ArrayBindingAST(Name, std::vector<int>{Size}, Init) {}
+
+ArrayBindingAST::ArrayBindingAST(std::string Name, std::vector<int> Dims, std::vector<ExprAST *> Init): Size(1), Dims(Dims), Init(Init), VarBindingAST(Name, nullptr) {
+  for (int dim: Dims)
+    Size *= dim;
+}
 
-AllocaInst * ArrayBindingAST::CreateEntryBlockAlloca() {
+AllocaInst * ArrayBindingAST::CreateEntryBlockAlloca(driver &drv) {
   Function *fun = currentFunction();
 
   IRBuilder<> TmpBlock(&fun->getEntryBlock(), fun->getEntryBlock().begin());
 
   ArrayType *type = ArrayType::get(Type::getDoubleTy(*context), Size);
-  return TmpBlock.CreateAlloca(type, nullptr, Name);
+  AllocaInst *alloc = TmpBlock.CreateAlloca(type, nullptr, Name);
+  alloc->setAlignment(Align(drv.arrayAlign));
+  return alloc;
 }
 
-AllocaInst * ArrayBindingAST::codegen(driver& drv) {
-  if (Init.size() != Size)
-    return (AllocaInst *)LogErrorV("Initialization array for " + Name + " is not the same size as binding array");
-
-  AllocaInst *alloc = CreateEntryBlockAlloca();  //< Base ptr for array
-  if (not alloc)
-    return (AllocaInst *)LogErrorV("Can't create stack array " + Name);
-
-  ArrayType *type = ArrayType::get(Type::getDoubleTy(*context), Size);
-  std:vector<Value *> initValues = {};
+Value * ArrayBindingAST::codegen(driver& drv) {
+  if (not Init.empty() and Init.size() != Size)
+    return LogErrorV("Initialization array for " + Name + " is not the same size as binding array");
 
+  std::vector<Value *> initValues = {};
   for (auto initParam: Init) {
     initValues.push_back(initParam->codegen(drv));
+    if (not initValues.back())
+      return nullptr;
   }
 
-  Value *InitStore;
-  for (int i=0; i<initValues.size(); i++) {
-    Value *Index = llvm::ConstantInt::get(builder->getInt32Ty(), i);
-    Value *ElementPtr = builder->CreateInBoundsGEP(type, alloc, {builder->getInt32(0), Index});
+  //  Large arrays would overflow the stack: they go in the arena, which
+  //  returns zeroed memory
+  Value *base;
+  Align baseAlign(64);
+  if (Size > maxStackSize)
+    base = ArenaAlloc(drv, builder->getInt64(Size), Name);
+  else {
+    AllocaInst *slot = CreateEntryBlockAlloca(drv);  //< Base ptr for array
+    if (not slot)
+      return LogErrorV("Can't create stack array " + Name);
+    //  The slot is in use from here to the end of the enclosing scope
+    builder->CreateLifetimeStart(slot, builder->getInt64(Size * sizeof(double)));
+    drv.scopes.back().allocas.push_back(slot);
+    base = slot;
+    baseAlign = Align(drv.arrayAlign);
+    //  Without an initializer the elements are zero, as in the interpreter
+    if (initValues.empty())
+      builder->CreateMemSet(base, builder->getInt8(0), Size * sizeof(double), baseAlign);
+  }
 
-    InitStore = builder->CreateStore(initValues[i], ElementPtr);
+  //  An initializer made only of constants (possibly folded calls) becomes
+  //  read-only data, copied with a single memcpy instead of one store per
+  //  element
+  std::vector<double> constants;
+  for (Value *value: initValues)
+    if (auto *C = dyn_cast<ConstantFP>(value))
+      constants.push_back(C->getValueAPF().convertToDouble());
+
+  if (not initValues.empty() and constants.size() == initValues.size()) {
+    auto *data = new GlobalVariable(*module, ArrayType::get(builder->getDoubleTy(), Size), true,
+                                    GlobalValue::PrivateLinkage, ConstantDataArray::get(*context, constants),
+                                    Name + ".init");
+    data->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+    data->setAlignment(Align(drv.arrayAlign));
+    CallInst *copy = builder->CreateMemCpy(base, baseAlign, data, data->getAlign(), Size * sizeof(double));
+    drv.constantCopies.push_back(cast<MemCpyInst>(copy));
+  } else {
+    for (int i=0; i<initValues.size(); i++) {
+      Value *ElementPtr = builder->CreateConstInBoundsGEP1_64(builder->getDoubleTy(), base, i);
+      StoreInst *InitStore = builder->CreateStore(initValues[i], ElementPtr);
+      TagArrayAccess(InitStore, ElementPtr, Name);
+    }
   }
 
-  drv.NamedValues[Name] = alloc;
+  ArraySymbol &A = drv.NamedValues[Name] = {base, builder->getInt64(Size), {}};
+  for (int dim: Dims)
+    A.dims.push_back(builder->getInt64(dim));
+  drv.NamedVars.erase(Name);
 
-  return alloc;
+  return base;
+}
+
+DynamicArrayBindingAST::DynamicArrayBindingAST(std::string Name, std::vector<ExprAST *> Dims): VarBindingAST(Name, nullptr), Dims(Dims) {}
+
+Value * DynamicArrayBindingAST::codegen(driver &drv) {
+  //  As for scalars, the sizes are evaluated before the binding
+  ArraySymbol A = {nullptr, nullptr, {}};
+  for (auto dim: Dims) {
+    Value *size = dim->codegen(drv);
+    if (not size)
+      return nullptr;
+    //  Signed: a negative size is reported by the runtime
+    A.dims.push_back(builder->CreateFPToSI(size, builder->getInt64Ty(), Name + ".dim"));
+    A.length = A.length ? builder->CreateNSWMul(A.length, A.dims.back(), Name + ".n") : A.dims.back();
+  }
+  A.base = ArenaAlloc(drv, A.length, Name);
+
+  drv.NamedValues[Name] = A;
+  drv.NamedVars.erase(Name);
+  return A.base;
+}
+
+/* Indirizzo di Name[i][j]... Gli indici sono a 64 bit: gli array mappati da
+   file possono superare i 4G elementi.
+   Se le dimensioni interne sono costanti l'indirizzo è un'unica GEP sul
+   tipo array annidato ([m x double] per una matrice): l'ultimo indice ha
+   passo unitario e LLVM riconosce i cicli sulla dimensione interna come
+   accessi contigui, vettorizzabili. Altrimenti l'indice lineare
+   ((i*m)+j)... è calcolato con operazioni senza overflow (nuw nsw). */
+static Value *ElementPointer(driver &drv, const std::string &Name, const std::vector<ExprAST *> &Indices) {
+  ArraySymbol A;
+  if (not LookupArray(drv, Name, A))
+    return nullptr;
+  if (A.dims.empty())
+    A.dims.push_back(A.length);
+  if (Indices.size() != A.dims.size())
+    return LogErrorV("Array " + Name + " has " + std::to_string(A.dims.size()) + " dimensions");
+
+  std::vector<Value *> Index;
+  for (auto Offset: Indices) {
+    //  Compute the offset value
+    Value *offsetFloat = Offset->codegen(drv);
+    if (not offsetFloat)
+      return nullptr;
+    //  Cast to integer
+    Index.push_back(builder->CreateFPToUI(offsetFloat, builder->getInt64Ty()));
+  }
+
+  bool staticInner = std::all_of(A.dims.begin() + 1, A.dims.end(), [](Value *dim) { return isa<ConstantInt>(dim); });
+  if (staticInner) {
+    Type *row = builder->getDoubleTy();
+    for (size_t k = A.dims.size() - 1; k > 0; k--)
+      row = ArrayType::get(row, cast<ConstantInt>(A.dims[k])->getZExtValue());
+    return builder->CreateInBoundsGEP(row, A.base, Index);
+  }
+
+  Value *linear = Index[0];
+  for (size_t k = 1; k < Index.size(); k++)
+    linear = builder->CreateAdd(builder->CreateMul(linear, A.dims[k], "", true, true), Index[k], "", true, true);
+  return builder->CreateInBoundsGEP(builder->getDoubleTy(), A.base, linear);
 }
 
 
-ArrayExprAST::ArrayExprAST(std::string Name, ExprAST *Offset): Offset(Offset), VariableExprAST(Name) {}
+ArrayExprAST::ArrayExprAST(std::string Name, std::vector<ExprAST *> Indices): Indices(Indices), VariableExprAST(Name) {}
 
 Value * ArrayExprAST::codegen(driver &drv) {
-  AllocaInst *A = drv.NamedValues[Name];
+  Value *ElementPtr = ElementPointer(drv, Name, Indices);
+  if (not ElementPtr)
+    return nullptr;
+
+  LoadInst *L = builder->CreateLoad(Type::getDoubleTy(*context), ElementPtr, Name.c_str());
+  TagArrayAccess(L, ElementPtr, Name);
+  return L;
+}
 
-  //  Compute the offset value
-  Value *offsetFloat = Offset->codegen(drv);
+ArrayAssignmentAST::ArrayAssignmentAST(std::string Id, std::vector<ExprAST *> Indices, ExprAST *Value): AssignmentAST(Id, Value), Indices(Indices) {}
 
-  //  Cast to integer
-  Value *Index = builder->CreateFPToUI(offsetFloat, builder->getInt32Ty());
+Value * ArrayAssignmentAST::getVariable(driver &drv) {
+  return ElementPointer(drv, Id, Indices);
+}
 
-  if (A) {
-    if (not A->isArrayAllocation())
-      return LogErrorV(Name + " is not an array type");
+Value * ArrayAssignmentAST::codegen(driver &drv) {
+  //  Array elements always live in memory, even for local arrays
+  Value *rval = Val->codegen(drv);
+  if (not rval)
+    return nullptr;
 
-    if (ArrayType *ArrType = dyn_cast<ArrayType>(A->getAllocatedType()); ArrType and not ArrType->getElementType()->isDoubleTy())
-      return LogErrorV(Name + " is not an array of doubles");
-    
-    Value *ElementPtr = builder->CreateInBoundsGEP(A->getAllocatedType(), A, {builder->getInt32(0), Index});
-    return builder->CreateLoad(Type::getDoubleTy(*context), ElementPtr, Name.c_str());
-  }
+  Value *ptr = getVariable(drv);
+  if (not ptr)
+    return nullptr;
 
-  if (GlobalVariable *G = module->getGlobalVariable(Name); G) {
-    if (not G->getValueType()->isArrayTy())
-      return LogErrorV("Global variable " + Name + " is not an array");
+  StoreInst *S = builder->CreateStore(rval, ptr, false);
+  TagArrayAccess(S, ptr, Id);
+  return S;
+}
 
-    if (ArrayType *ArrType = dyn_cast<ArrayType>(G->getValueType()); ArrType and not ArrType->getElementType()->isDoubleTy())
-      return LogErrorV(Name + " is not an array of doubles");    
 
-    Value *ElementPtr = builder->CreateInBoundsGEP(G->getValueType(), G, {builder->getInt32(0), Index});
-    return builder->CreateLoad(Type::getDoubleTy(*context), ElementPtr, Name.c_str());
-  }
+MappedArrayBindingAST::MappedArrayBindingAST(std::string Name, std::string Path): VarBindingAST(Name, nullptr), Path(Path) {}
+
+Value * MappedArrayBindingAST::codegen(driver &drv) {
+  //  double *krt_mapfile(const char *path, int64_t *length)
+  Type *ptrTy = PointerType::getUnqual(*context);
+  FunctionCallee mapfile = module->getOrInsertFunction("krt_mapfile",
+      FunctionType::get(ptrTy, {ptrTy, ptrTy}, false));
+  //  Like malloc, the mapping does not alias any other memory
+  if (Function *F = dyn_cast<Function>(mapfile.getCallee()))
+    F->addRetAttr(Attribute::NoAlias);
+
+  Function *fun = currentFunction();
+  IRBuilder<> TmpBlock(&fun->getEntryBlock(), fun->getEntryBlock().begin());
+  AllocaInst *length = TmpBlock.CreateAlloca(builder->getInt64Ty(), nullptr, Name + ".len");
 
-  return LogErrorV("Undeclared array " + Name);
+  Value *path = builder->CreateGlobalStringPtr(Path, Name + ".path");
+  Value *base = builder->CreateCall(mapfile, {path, length}, Name);
+  Value *n = builder->CreateLoad(builder->getInt64Ty(), length, Name + ".n");
+  drv.scopes.back().mappings.push_back({base, n});
+
+  drv.NamedValues[Name] = {base, n};
+  drv.NamedVars.erase(Name);
+  return base;
 }
 
-ArrayAssignmentAST::ArrayAssignmentAST(std::string Id, ExprAST *Offset, ExprAST *Value): AssignmentAST(Id, Value), Offset(Offset) {}
+ArrayLengthAST::ArrayLengthAST(std::string Name): Name(Name) {}
 
-Value * ArrayAssignmentAST::getVariable(driver &drv) {
-  Value *ptr = AssignmentAST::getVariable(drv);
+Value * ArrayLengthAST::codegen(driver &drv) {
+  ArraySymbol A;
+  if (not LookupArray(drv, Name, A))
+    return nullptr;
+  return builder->CreateUIToFP(A.length, builder->getDoubleTy(), "len");
+}
 
-  //  Compute the offset value
-  Value *offsetFloat = Offset->codegen(drv);
+SaveFileAST::SaveFileAST(std::string Name, std::string Path): Name(Name), Path(Path) {}
 
-  //  Cast to integer
-  Value *Index = builder->CreateFPToUI(offsetFloat, builder->getInt32Ty());
+Value * SaveFileAST::codegen(driver &drv) {
+  ArraySymbol A;
+  if (not LookupArray(drv, Name, A))
+    return nullptr;
 
-  Value *ElementPtr;  //< Contains the element pointer of base+offset
+  //  double krt_savefile(const char *path, const double *A, int64_t n)
+  Type *ptrTy = PointerType::getUnqual(*context);
+  FunctionCallee savefile = module->getOrInsertFunction("krt_savefile",
+      FunctionType::get(builder->getDoubleTy(), {ptrTy, ptrTy, builder->getInt64Ty()}, false));
 
-  if (not ptr)
-    return LogErrorV("Undeclared identifier " + Id);
+  Value *path = builder->CreateGlobalStringPtr(Path, Name + ".path");
+  return builder->CreateCall(savefile, {path, A.base, A.length}, "savefile");
+}
 
-  if (AllocaInst *basePtr = dyn_cast<AllocaInst>(ptr); basePtr) {
-    if (not basePtr->isArrayAllocation())
-      return LogErrorV(Id + " does not identify an array");
 
-    ElementPtr = builder->CreateInBoundsGEP(basePtr->getAllocatedType(), basePtr, {builder->getInt32(0), Index});
-  } else if (GlobalVariable *basePtr = dyn_cast<GlobalVariable>(ptr); basePtr) {
-    if (not basePtr->getValueType()->isArrayTy())
-      return LogErrorV("Global " + Id + "does not identify an array");
+GlobalArrayAST::GlobalArrayAST(std::string Name, int Size): GlobalArrayAST(Name, std::vector<int>{Size}) {}
 
-    ElementPtr = builder->CreateInBoundsGEP(basePtr->getValueType(), basePtr, {builder->getInt32(0), Index});
-  }
+GlobalArrayAST::GlobalArrayAST(std::string Name, std::vector<int> Dims, std::vector<double> Values):
+  GlobalVarAST(Name), Size(1), Dims(Dims), Values(Values) {
+  for (int dim: Dims)
+    Size *= dim;
+}
 
-  return ElementPtr;
+/// Costante di tipo T (array, anche annidato, di double) con i valori dati in ordine row-major
+static Constant *ArrayInitializer(Type *T, ArrayRef<double> values) {
+  Type *element = T->getArrayElementType();
+  if (element->isDoubleTy())
+    return ConstantDataArray::get(*context, values);
+
+  std::vector<Constant *> rows;
+  size_t rowSize = values.size() / T->getArrayNumElements();
+  for (size_t row = 0; row < T->getArrayNumElements(); row++)
+    rows.push_back(ArrayInitializer(element, values.slice(row * rowSize, rowSize)));
+  return ConstantArray::get(cast<ArrayType>(T), rows);
 }
 
+Constant * GlobalArrayAST::codegen(driver &drv) {
+  auto *G = cast_or_null<GlobalVariable>(GlobalVarAST::codegen(drv));
+  if (not G)
+    return nullptr;
 
-GlobalArrayAST::GlobalArrayAST(std::string Name, int Size): GlobalVarAST(Name), Size(Size) {}
+  //  Wider than the ABI alignment of double, for aligned vector accesses
+  G->setAlignment(Align(drv.arrayAlign));
+  //  Static data: initialized when the program is loaded
+  if (not Values.empty()) {
+    G->setInitializer(ArrayInitializer(G->getValueType(), Values));
+    G->setLinkage(GlobalValue::ExternalLinkage);
+  }
+  return G;
+}
 
 Type * GlobalArrayAST::getVariableType() {
-  return ArrayType::get(Type::getDoubleTy(*context), Size);
+  //  Row-major: M[512][256] is [512 x [256 x double]]
+  Type *type = Type::getDoubleTy(*context);
+  for (auto dim = Dims.rbegin(); dim != Dims.rend(); dim++)
+    type = ArrayType::get(type, *dim);
+  return type;
+}
+
+/***************************** Import *****************************/
+ImportAST::ImportAST(std::string Name, ki::Interface Interface): Name(Name), Interface(std::move(Interface)) {
+  //  The parameter names only matter inside a body, which is not here
+  for (auto &fn: this->Interface.functions) {
+    std::vector<std::pair<std::string, bool>> params;
+    for (unsigned i = 0; i < fn.arrays.size(); i++)
+      params.push_back({"x" + std::to_string(i), fn.arrays[i]});
+    Protos.push_back(new PrototypeAST(fn.name, params));
+  }
+  for (auto &G: this->Interface.globals) {
+    GlobalVarAST *var = G.dims.empty() ? new GlobalVarAST(G.name) : new GlobalArrayAST(G.name, G.dims);
+    var->setImported();
+    Globals.push_back(var);
+  }
+}
+
+Value *ImportAST::codegen(driver &drv) {
+  for (PrototypeAST *proto: Protos) {
+    const std::string &fn = std::get<std::string>(proto->getLexVal());
+    if (Function *F = LookupFunction(drv, fn)) {
+      if (F->getFunctionType() != proto->getType())
+        return LogErrorV("Function " + fn + " imported from " + Name + " with different parameters");
+    } else if (not proto->codegen(drv))
+      return nullptr;
+  }
+  for (GlobalVarAST *var: Globals)
+    if (not var->codegen(drv))
+      return nullptr;
+
+  //  The linker drops an available_externally body nobody refers to: the
+  //  declarations above make it replace them (a definition wins instead)
+  if (not Interface.bitcode.empty()) {
+    auto bodies = parseBitcodeFile(MemoryBufferRef(Interface.bitcode, Name + ".ki"), *context);
+    if (not bodies)
+      return LogErrorV("Cannot read the bodies in " + Name + ".ki: " + toString(bodies.takeError()));
+    if (Linker::linkModules(*module, std::move(*bodies)))
+      return LogErrorV("Cannot link the bodies in " + Name + ".ki");
+  }
+  return nullptr;
 }
@@ -4,25 +4,38 @@
 #include "llvm/ADT/APFloat.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DIBuilder.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
+#include "llvm/IR/ValueHandle.h"
 #include "llvm/IR/Verifier.h"
 /**************** C++ modules and generic data types ***********************/
 #include <cstdio>
 #include <cstdlib>
+#include <functional>
 #include <map>
+#include <memory>
+#include <optional>
+#include <set>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <variant>
 
+#include "consteval.hpp"
+#include "interface.hpp"
 #include "parser.hpp"
 
 using namespace llvm;
 
+namespace bc { class Compiler; }
+
 // Dichiarazione del prototipo yylex per Flex
 // Flex va proprio a cercare YY_DECL perché
 // deve espanderla (usando M4) nel punto appropriato
@@ -31,28 +44,131 @@ using namespace llvm;
 // Per il parser è sufficiente una forward declaration
 YY_DECL;
 
+/**
+ * Costruzione diretta della forma SSA durante la generazione del codice
+ * (Braun et al., "Simple and Efficient Construction of Static Single
+ * Assignment Form", CC 2013).
+ * Le variabili scalari locali non vengono allocate in memoria: per ogni
+ * blocco si ricorda il valore SSA corrente di ciascuna variabile, e i PHI
+ * vengono creati solo dove servono quando la variabile viene letta.
+ * Un blocco è "sealed" quando tutti i suoi predecessori sono noti; le letture
+ * in un blocco non ancora sealed producono PHI incompleti, completati alla
+ * chiamata di sealBlock.
+ */
+class SSABuilder {
+  private:
+  unsigned variables;
+  std::vector<std::string> names;   // < Usati per i nomi dei PHI
+  std::map<BasicBlock *, std::map<unsigned, WeakTrackingVH>> currentDef;
+  std::map<BasicBlock *, std::map<unsigned, PHINode *>> incompletePhis;
+  std::set<BasicBlock *> sealed;
+
+  Value *readVariableRecursive(unsigned var, BasicBlock *BB);
+  Value *addPhiOperands(unsigned var, PHINode *phi);
+  Value *tryRemoveTrivialPhi(PHINode *phi);
+
+  public:
+  SSABuilder();
+  void reset();         // < Da chiamare all'inizio di ogni funzione
+  unsigned newVariable(const std::string &name);
+  void writeVariable(unsigned var, BasicBlock *BB, Value *val);
+  Value *readVariable(unsigned var, BasicBlock *BB);
+  void sealBlock(BasicBlock *BB);
+};
+
+/**
+ * Array visibile nello scope corrente: puntatore al primo elemento e numero
+ * di elementi (i64). Per gli array di dimensione fissa la lunghezza è una
+ * costante, per quelli mappati da file è nota solo a runtime.
+ * Un array a più dimensioni è memorizzato per righe (row-major), in un'unica
+ * area contigua; dims contiene l'estensione (i64) di ogni dimensione.
+ */
+struct ArraySymbol {
+  Value *base;
+  Value *length;
+  std::vector<Value *> dims;
+};
+
+/**
+ * Scope aperto durante la generazione di una funzione (corpo, blocco, for):
+ * le risorse degli array dichiarati nello scope, rilasciate all'uscita.
+ */
+struct LocalScope {
+  Value *arenaMark = nullptr;         // < Da krt_arena_mark, preso al primo array nell'arena
+  std::vector<std::pair<Value *, Value *>> mappings; // < Array mappati da file: base e numero di elementi
+  std::vector<AllocaInst *> allocas;  // < Array sullo stack, vivi solo dentro lo scope
+};
+
 // Classe che organizza e gestisce il processo di compilazione
 class driver
 {
 public:
   driver();
-  std::map<std::string, AllocaInst *> NamedValues; // < Symbol table
+  std::map<std::string, ArraySymbol> NamedValues; // < Symbol table degli array
             /**
              * Tabella associativa in cui ogni 
-             * chiave x è una variabile e il cui corrispondente valore è un'istruzione 
-             * che alloca uno spazio di memoria della dimensione necessaria per 
-             * memorizzare un variabile del tipo di x (nel nostro caso solo double)
+             * chiave x è un array locale e il cui corrispondente valore è
+             * la coppia (indirizzo base, numero di elementi). Gli array di
+             * dimensione fissa sono allocati sullo stack (alloca)
+             */
+  std::map<std::string, unsigned> NamedVars; // < Symbol table degli scalari
+            /**
+             * Ad ogni variabile scalare locale (parametri compresi) è associato
+             * l'identificativo della variabile nello SSABuilder
+             */
+  SSABuilder ssa;
+  unsigned arrayAlign; // < Allineamento (byte) degli array globali e sullo stack
+  std::vector<MemCpyInst *> constantCopies; // < Inizializzatori costanti di array
+            /**
+             * Copie dei dati read-only negli array locali della funzione,
+             * eliminate se l'array è solo letto
+             */
+  std::vector<LocalScope> scopes; // < Scope aperti (funzione, blocchi, for)
+            /**
+             * All'uscita da ogni scope l'arena torna al suo mark e gli
+             * array sullo stack terminano il loro lifetime
              */
 
   RootAST* root;      // A fine parsing "punta" alla radice dell'AST
   int parse (const std::string& f);
+  int parse_string (std::string_view src, const std::string& name = "<string>");
   std::string file;
+  std::string_view source; // Programma in memoria (se in_memory)
+  bool in_memory;     // Lo scanner legge da source invece che da file
   bool trace_parsing; // Abilita le tracce di debug el parser
   void scan_begin (); // Implementata nello scanner
   void scan_end ();   // Implementata nello scanner
   bool trace_scanning;// Abilita le tracce di debug nello scanner
   yy::location location; // Utillizata dallo scannar per localizzare i token
-  void codegen();
+  std::set<std::string> externs; // Funzioni dichiarate extern nei sorgenti
+  std::vector<RootAST *> definitions; // Definizioni e globali dell'ultimo sorgente (--emit-interface)
+  /// Cerca name.ki accanto al sorgente, poi nella directory corrente
+  bool import(const std::string &name, ki::Interface &I, std::string &error);
+  bool batch_all;     // Genera il wrapper batch per tutte le funzioni
+  std::set<std::string> batch; // Funzioni per cui generare il wrapper batch
+  bool wantsBatch(const std::string &fn) const;
+  std::set<Function *> memoized; // Funzioni pure già verificate (i wrapper, se memoizzate)
+  bool memoTables;    // Tabelle di memoizzazione per le funzioni pure (non thread safe)
+  ce::Evaluator constEval; // Valutazione a tempo di compilazione
+  bool debugInfo;     // Genera le line table DWARF (opzione -g)
+  bool trackLocations;// Posizioni nel sorgente solo per i remark, senza DWARF
+  bool instrumentFunctions; // -finstrument=functions: profilo delle chiamate (runtime.hpp)
+  bool instrumentLoops;     // -finstrument=loops: profilo dei cicli for
+  bool repl;          // Statement anche fuori dalle funzioni (--repl, repl.hpp)
+  /// Funzioni repl.N generate per gli statement di top nell'ultimo sorgente,
+  /// e se il loro valore (di un'espressione) va stampato
+  std::vector<std::pair<std::string, bool>> statements;
+  /**
+   * Chiamata quando una funzione o una variabile globale non è nel modulo:
+   * con --repl la dichiara, se definita da una riga precedente, e la
+   * restituisce. nullptr se name non esiste
+   */
+  std::function<GlobalValue *(const std::string &name)> declare;
+  std::unique_ptr<DIBuilder> dbuilder; // Durante codegen, se debugInfo
+  DIFile *debugFile;  // Il sorgente in corso di generazione
+  /// Genera l'IR nel modulo; false se una definizione o uno statement
+  /// contiene errori (e non è stato generato)
+  bool codegen();
 };
 
 typedef std::variant<std::string,double> lexval;
@@ -63,11 +179,16 @@ const lexval NONE = 0.0;
 class RootAST {
 protected:
   static Function *currentFunction();
+  yy::location Loc;   // Posizione nel sorgente (definizioni, statement e binding)
 
 public:
   virtual ~RootAST() {};
+  void setLocation(const yy::location &loc) { Loc = loc; };
+  const yy::location &getLocation() const { return Loc; };
   virtual lexval getLexVal() const {return NONE;};
   virtual Value *codegen(driver& drv) { return nullptr; };
+  virtual int bcgen(bc::Compiler &bc); // Backend bytecode (bytecode.cpp)
+  virtual bool eval(ce::Evaluator &ev, double &result); // Valutazione a compile time (consteval.cpp)
 };
 
 // Classe che rappresenta la sequenza di statement
@@ -79,6 +200,7 @@ private:
 public:
   SeqAST(RootAST* first, RootAST* continuation);
   Value *codegen(driver& drv) override;
+  int bcgen(bc::Compiler &bc) override;
 };
 
 /// ExprAST - Classe base per tutti i nodi espressione
@@ -93,6 +215,8 @@ public:
   NumberExprAST(double Val);
   lexval getLexVal() const override;
   Value *codegen(driver& drv) override;
+  int bcgen(bc::Compiler &bc) override;
+  bool eval(ce::Evaluator &ev, double &result) override;
 };
 
 /// VariableExprAST - Classe per la rappresentazione di riferimenti a variabili
@@ -104,6 +228,8 @@ public:
   VariableExprAST(const std::string &Name);
   lexval getLexVal() const override;
   Value *codegen(driver& drv) override;
+  int bcgen(bc::Compiler &bc) override;
+  bool eval(ce::Evaluator &ev, double &result) override;
 };
 
 /// BinaryExprAST - Classe per la rappresentazione di operatori binari
@@ -116,6 +242,8 @@ private:
 public:
   BinaryExprAST(char Op, ExprAST* LHS, ExprAST* RHS);
   Value *codegen(driver& drv) override;
+  int bcgen(bc::Compiler &bc) override;
+  bool eval(ce::Evaluator &ev, double &result) override;
 };
 
 /// CallExprAST - Classe per la rappresentazione di chiamate di funzione
@@ -128,6 +256,8 @@ public:
   CallExprAST(std::string Callee, std::vector<ExprAST*> Args);
   lexval getLexVal() const override;
   Value *codegen(driver& drv) override;
+  int bcgen(bc::Compiler &bc) override;
+  bool eval(ce::Evaluator &ev, double &result) override;
 };
 
 /// PrototypeAST - Classe per la rappresentazione dei prototipi di funzione
@@ -137,14 +267,19 @@ class PrototypeAST : public RootAST {
 private:
   std::string Name;
   std::vector<std::string> Args;
-  bool emitcode;
+  std::vector<bool> ArrayArgs;  // < Parametri array (A[]), passati per riferimento
 
 public:
   PrototypeAST(std::string Name, std::vector<std::string> Args);
+  PrototypeAST(std::string Name, std::vector<std::pair<std::string, bool>> Params);
   const std::vector<std::string> &getArgs() const;
+  bool isArray(unsigned Idx) const;
+  bool hasArrays() const;
+  /// Tipo LLVM: un parametro array diventa puntatore e lunghezza (i64)
+  FunctionType *getType() const;
   lexval getLexVal() const override;
   Function *codegen(driver& drv) override;
-  void noemit();
+  int bcgen(bc::Compiler &bc) override;
 };
 
 /// FunctionAST - Classe che rappresenta la definizione di una funzione
@@ -153,10 +288,35 @@ private:
   PrototypeAST* Proto;
   ExprAST* Body;
   bool external;
+  unsigned memoSize;  // < Elementi della tabella di memoizzazione, 0 se non pure
   
 public:
+  static constexpr unsigned defaultMemoSize = 1024;
+  static constexpr unsigned memoProbes = 4;  // < Slot esaminati per ogni lookup
+
   FunctionAST(PrototypeAST* Proto, ExprAST* Body);
+  /// Funzione dichiarata pure: i risultati sono memorizzati in una tabella
+  /// di (almeno) entries elementi
+  void memoize(unsigned entries = defaultMemoSize);
   Function *codegen(driver& drv) override;
+  int bcgen(bc::Compiler &bc) override;
+  std::string getName() const;
+  PrototypeAST *getProto() const { return Proto; };
+  /// Valuta il corpo con i parametri legati ad args (consteval.cpp)
+  bool apply(ce::Evaluator &ev, const std::vector<double> &args, double &result);
+
+private:
+  /**
+   * Generates name_batch(const double *a, ..., double *out, size_t n), which
+   * applies the scalar function to n rows of columnar input.
+   */
+  Function *codegenBatch(Function *scalar);
+  /**
+   * Generates the body of memo, which looks up its arguments in a hash
+   * table (open addressing, memoProbes slots per lookup) and calls impl only
+   * on a miss. When all the probed slots are taken, the first one is evicted.
+   */
+  void codegenMemo(Function *memo, Function *impl);
 };
 
 class IfExprAST: public ExprAST {
@@ -168,6 +328,8 @@ class IfExprAST: public ExprAST {
   public:
   IfExprAST(ExprAST *cond, ExprAST *trueexp, ExprAST *falseexp);
   Value *codegen(driver& drv) override;
+  int bcgen(bc::Compiler &bc) override;
+  bool eval(ce::Evaluator &ev, double &result) override;
 };
 
 class BlockAST: public ExprAST {
@@ -179,6 +341,8 @@ class BlockAST: public ExprAST {
   BlockAST(std::vector<RootAST *>);
   BlockAST(std::vector<VarBindingAST *>, std::vector<RootAST *>);
   Value *codegen(driver &drv) override;
+  int bcgen(bc::Compiler &bc) override;
+  bool eval(ce::Evaluator &ev, double &result) override;
 };
 
 class VarBindingAST: public RootAST {
@@ -191,7 +355,9 @@ class VarBindingAST: public RootAST {
   public:
   VarBindingAST(std::string Name, ExprAST *Val);
   std::string &getName();
-  AllocaInst *codegen(driver& drv) override;
+  Value *codegen(driver& drv) override;
+  int bcgen(bc::Compiler &bc) override;
+  bool eval(ce::Evaluator &ev, double &result) override;
 };
 
 class AssignmentAST: public ExprAST {
@@ -202,6 +368,8 @@ class AssignmentAST: public ExprAST {
   public:
   AssignmentAST(std::string Id, ExprAST *Val);
   Value * codegen(driver &drv) override;
+  int bcgen(bc::Compiler &bc) override;
+  bool eval(ce::Evaluator &ev, double &result) override;
 
   protected:
   /**
@@ -219,19 +387,25 @@ class RelationalExprAST: public ExprAST {
   public:
   RelationalExprAST(char kind, ExprAST *leftoperand, ExprAST *rightoperand);
   Value *codegen(driver& drv) override;
+  int bcgen(bc::Compiler &bc) override;
+  bool eval(ce::Evaluator &ev, double &result) override;
 };
 
 class GlobalVarAST: public RootAST {
   private:
   std::string Name;
+  double Init;    // < Valore iniziale, calcolato durante il parsing
+  bool Imported;  // < Definita in un altro modulo (import): solo dichiarata
 
   protected:
   virtual Type * getVariableType();
 
   public:
-  GlobalVarAST(std::string Name);
+  GlobalVarAST(std::string Name, double Init = 0.0);
   std::string &getName();
+  void setImported() { Imported = true; };
   Constant *codegen(driver& drv) override;
+  int bcgen(bc::Compiler &bc) override;
 };
 
 class IfStatementAST: public RootAST {
@@ -244,6 +418,8 @@ class IfStatementAST: public RootAST {
   IfStatementAST(ExprAST *cond, RootAST *truestmt);
   IfStatementAST(ExprAST *cond, RootAST *truestmt, RootAST *falsestmt);
   Value *codegen(driver& drv) override;
+  int bcgen(bc::Compiler &bc) override;
+  bool eval(ce::Evaluator &ev, double &result) override;
 };
 
 class ForInitAST: public RootAST {
@@ -254,20 +430,42 @@ class ForInitAST: public RootAST {
   public:
   ForInitAST(RootAST *init, bool binding);
   Value *codegen(driver& drv) override;
+  int bcgen(bc::Compiler &bc) override;
+  bool eval(ce::Evaluator &ev, double &result) override;
   bool isBinding();
   std::string getName();
 };
 
+/**
+ * Annotazioni di un ciclo for (@unroll(4), @vectorize(width=8), @interleave(2),
+ * @nounroll, @novectorize, @parallel_accesses), tradotte nei metadati llvm.loop
+ * del salto all'indietro. Ciò che non è indicato resta al cost model di LLVM.
+ */
+struct LoopHints {
+  std::optional<bool> unroll, vectorize;
+  unsigned unrollCount = 0, vectorizeWidth = 0, interleaveCount = 0;
+  bool parallelAccesses = false;  // < Le iterazioni non dipendono l'una dall'altra
+
+  /// hint è il nome dell'annotazione, eventualmente seguito da "." e dal
+  /// nome dell'argomento (vectorize.width); value è -1 se manca l'argomento.
+  /// Restituisce false se l'annotazione non esiste o l'argomento non è valido
+  bool set(const std::string &hint, double value);
+};
+
 class ForStatementAST: public RootAST {
   private:
   ForInitAST *init;
   ConditionalExprAST *cond;
   AssignmentAST *update;
   RootAST *body;
+  LoopHints hints;
 
   public:
   ForStatementAST(ForInitAST *init, ConditionalExprAST *cond, AssignmentAST *update, RootAST *body);
+  bool addHint(const std::string &hint, double value) { return hints.set(hint, value); };
   Value *codegen(driver& drv) override;
+  int bcgen(bc::Compiler &bc) override;
+  bool eval(ce::Evaluator &ev, double &result) override;
 };
 
 /**
@@ -301,6 +499,8 @@ class ConditionalExprAST: public ExprAST {
   ConditionalExprAST(RelationalExprAST *LHS);
   ConditionalExprAST(std::string kind, ConditionalExprAST *RHS);
   Value *codegen(driver& drv) override;
+  int bcgen(bc::Compiler &bc) override;
+  bool eval(ce::Evaluator &ev, double &result) override;
 };
 
 /**
@@ -308,16 +508,39 @@ class ConditionalExprAST: public ExprAST {
  */
 class ArrayBindingAST: public VarBindingAST {
   private:
-  int Size;
-  std::vector<ExprAST *> Init;
+  int Size;                   // < Numero totale di elementi
+  std::vector<int> Dims;
+  std::vector<ExprAST *> Init;  // < Elementi in ordine row-major
 
   public:
+  /// Array più grandi (in elementi) sono allocati nell'arena invece che sullo stack
+  static constexpr int maxStackSize = 1 << 13;
+
   ArrayBindingAST(std::string Name, int Size);
   ArrayBindingAST(std::string Name, int Size, std::vector<ExprAST *> Init);
-  AllocaInst *codegen(driver& drv) override;
+  ArrayBindingAST(std::string Name, std::vector<int> Dims, std::vector<ExprAST *> Init = {});
+  Value *codegen(driver& drv) override;
+  int bcgen(bc::Compiler &bc) override;
+  bool eval(ce::Evaluator &ev, double &result) override;
 
   private:
-  AllocaInst * CreateEntryBlockAlloca();
+  AllocaInst * CreateEntryBlockAlloca(driver &drv);
+};
+
+/**
+ * var A[n], var T[n][m]: array le cui dimensioni sono calcolate a runtime,
+ * allocato nell'arena della runtime library e rilasciato all'uscita dallo
+ * scope
+ */
+class DynamicArrayBindingAST: public VarBindingAST {
+  private:
+  std::vector<ExprAST *> Dims;
+
+  public:
+  DynamicArrayBindingAST(std::string Name, std::vector<ExprAST *> Dims);
+  Value *codegen(driver &drv) override;
+  int bcgen(bc::Compiler &bc) override;
+  bool eval(ce::Evaluator &ev, double &result) override;
 };
 
 /**
@@ -325,31 +548,99 @@ class ArrayBindingAST: public VarBindingAST {
  */
 class ArrayExprAST: public VariableExprAST {
   private:
-  ExprAST *Offset;
+  std::vector<ExprAST *> Indices;   // < Uno per dimensione: A[i][j]
 
   public:
-  ArrayExprAST(std::string Name, ExprAST *Offset);
+  ArrayExprAST(std::string Name, std::vector<ExprAST *> Indices);
   Value *codegen(driver &drv) override;
+  int bcgen(bc::Compiler &bc) override;
+  bool eval(ce::Evaluator &ev, double &result) override;
 };
 
 class ArrayAssignmentAST: public AssignmentAST {
   private:
-  ExprAST *Offset;
+  std::vector<ExprAST *> Indices;
 
   public:
-  ArrayAssignmentAST(std::string Id, ExprAST *Offset, ExprAST *Value);
+  ArrayAssignmentAST(std::string Id, std::vector<ExprAST *> Indices, ExprAST *Value);
+  Value *codegen(driver &drv) override;
+  int bcgen(bc::Compiler &bc) override;
+  bool eval(ce::Evaluator &ev, double &result) override;
   virtual Value *getVariable(driver &drv) override;
 };
 
+/**
+ * var A[] = mapfile("data.bin"): il file (una sequenza di double) è mappato
+ * in memoria con mmap, senza copie; la lunghezza dell'array è nota a runtime
+ */
+class MappedArrayBindingAST: public VarBindingAST {
+  private:
+  std::string Path;
+
+  public:
+  MappedArrayBindingAST(std::string Name, std::string Path);
+  Value *codegen(driver &drv) override;
+  int bcgen(bc::Compiler &bc) override;
+  bool eval(ce::Evaluator &ev, double &result) override;
+};
+
+/// len(A): numero di elementi dell'array A
+class ArrayLengthAST: public ExprAST {
+  private:
+  std::string Name;
+
+  public:
+  ArrayLengthAST(std::string Name);
+  Value *codegen(driver &drv) override;
+  int bcgen(bc::Compiler &bc) override;
+  bool eval(ce::Evaluator &ev, double &result) override;
+};
+
+/// savefile(A, "out.bin"): scrive gli elementi di A nel file, come double
+class SaveFileAST: public RootAST {
+  private:
+  std::string Name;
+  std::string Path;
+
+  public:
+  SaveFileAST(std::string Name, std::string Path);
+  Value *codegen(driver &drv) override;
+  bool eval(ce::Evaluator &ev, double &result) override;
+};
+
 class GlobalArrayAST: public GlobalVarAST {
   private:
   int Size;
+  std::vector<int> Dims;
+  std::vector<double> Values;   // < Inizializzatore (row-major), calcolato durante il parsing
 
   protected:
   Type * getVariableType() override;
 
   public:
   GlobalArrayAST(std::string Name, int Size);
+  GlobalArrayAST(std::string Name, std::vector<int> Dims, std::vector<double> Values = {});
+  const std::vector<int> &getDims() const { return Dims; };
+  Constant *codegen(driver &drv) override;
+  int bcgen(bc::Compiler &bc) override;
+};
+
+/**
+ * import "rand": le funzioni e le variabili globali di rand.k, lette dal
+ * file di interfaccia rand.ki (interface.hpp). I corpi inlinabili vengono
+ * collegati al modulo come definizioni available_externally.
+ */
+class ImportAST: public RootAST {
+  private:
+  std::string Name;
+  ki::Interface Interface;
+  std::vector<PrototypeAST *> Protos;
+  std::vector<GlobalVarAST *> Globals;
+
+  public:
+  ImportAST(std::string Name, ki::Interface Interface);
+  Value *codegen(driver &drv) override;
+  int bcgen(bc::Compiler &bc) override;
 };
 
 #endif // ! DRIVER_HH
@@ -0,0 +1,319 @@
+#include "engine.hpp"
+#include "driver.hpp"
+#include "transforms.hpp"
+
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ObjectTransformLayer.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include <unistd.h>
+
+using namespace llvm::orc;
+
+extern LLVMContext *context;
+extern Module *module;
+extern IRBuilder<> *builder;
+extern std::string *diagnostics;
+
+namespace kcomp {
+
+/**************************** Handle ******************************/
+Handle::Handle(std::shared_ptr<CompiledUnit> unit): unit(std::move(unit)) {}
+
+Handle::operator bool() const {
+  return unit != nullptr;
+}
+
+void * Handle::address(const std::string &name) const {
+  if (not unit)
+    return nullptr;
+
+  auto sym = unit->symbols.find(name);
+  return sym != unit->symbols.end() ? sym->second : nullptr;
+}
+
+/************************** Perf map ******************************/
+namespace {
+
+/**
+ * Scrive in /tmp/perf-PID.map una riga "indirizzo dimensione nome" (in
+ * esadecimale) per ogni funzione caricata dal JIT: perf la usa per dare un
+ * nome agli indirizzi del codice anonimo, senza bisogno di perf inject.
+ */
+class PerfMapListener: public JITEventListener {
+  private:
+  FILE *map;
+
+  public:
+  PerfMapListener(): map(fopen(("/tmp/perf-" + std::to_string(getpid()) + ".map").c_str(), "a")) {}
+
+  ~PerfMapListener() override {
+    if (map)
+      fclose(map);
+  }
+
+  void notifyObjectLoaded(ObjectKey key, const object::ObjectFile &obj,
+                          const RuntimeDyld::LoadedObjectInfo &info) override {
+    //  The copy for debuggers has the sections at their final addresses
+    object::OwningBinary<object::ObjectFile> loaded = info.getObjectForDebug(obj);
+    if (not map or not loaded.getBinary())
+      return;
+
+    for (auto &[sym, size]: object::computeSymbolSizes(*loaded.getBinary())) {
+      Expected<object::SymbolRef::Type> type = sym.getType();
+      if (not type or *type != object::SymbolRef::ST_Function) {
+        consumeError(type.takeError());
+        continue;
+      }
+      Expected<StringRef> name = sym.getName();
+      Expected<uint64_t> address = sym.getAddress();
+      if (not name or not address) {
+        consumeError(name.takeError());
+        consumeError(address.takeError());
+        continue;
+      }
+      fprintf(map, "%llx %llx %s\n", (unsigned long long)*address, (unsigned long long)size,
+              name->str().c_str());
+    }
+    fflush(map);
+  }
+};
+
+} // namespace
+
+/**************************** Engine ******************************/
+Engine::Engine(): Engine(Options()) {}
+
+Engine::Engine(Options opts): opts(opts), usage(0), pendingBytes(0), unitCounter(0) {
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+
+  auto JTMB = cantFail(JITTargetMachineBuilder::detectHost());
+  target = cantFail(JTMB.createTargetMachine());
+  LLJITBuilder jitBuilder;
+  jitBuilder.setJITTargetMachineBuilder(std::move(JTMB));
+
+  //  Debuggers and profilers are notified by RuntimeDyld, through its event
+  //  listeners: the linking layer is chosen explicitly, since the default
+  //  one may be JITLink
+  std::vector<JITEventListener *> listeners;
+  if (opts.debugInfo)
+    listeners.push_back(JITEventListener::createGDBRegistrationListener());
+  if (opts.perfMap) {
+    perfMap = std::make_unique<PerfMapListener>();
+    listeners.push_back(perfMap.get());
+    //  nullptr when LLVM is built without perf support
+    if (JITEventListener *jitdump = JITEventListener::createPerfJITEventListener())
+      listeners.push_back(jitdump);
+  }
+  if (not listeners.empty())
+    jitBuilder.setObjectLinkingLayerCreator(
+      [listeners](ExecutionSession &ES, const Triple &TT) -> Expected<std::unique_ptr<ObjectLayer>> {
+        //  The arguments of the memory manager factory differ across LLVM versions
+        auto layer = std::make_unique<RTDyldObjectLinkingLayer>(
+          ES, [](auto &&...) { return std::make_unique<SectionMemoryManager>(); });
+        for (JITEventListener *listener: listeners)
+          layer->registerJITEventListener(*listener);
+        return std::move(layer);
+      });
+  jit = cantFail(jitBuilder.create());
+
+  //  Every object produced by the JIT goes through this layer: it is the
+  //  only place where the actual size of the generated code is known
+  jit->getObjTransformLayer().setTransform(
+    [this](std::unique_ptr<MemoryBuffer> obj) -> Expected<std::unique_ptr<MemoryBuffer>> {
+      pendingBytes += obj->getBufferSize();
+      return std::move(obj);
+    });
+}
+
+Engine::~Engine() = default;
+
+std::string Engine::lastError() const {
+  std::lock_guard<std::mutex> guard(lock);
+  return error;
+}
+
+size_t Engine::memoryUsage() const {
+  std::lock_guard<std::mutex> guard(lock);
+  return usage;
+}
+
+size_t Engine::cachedUnits() const {
+  std::lock_guard<std::mutex> guard(lock);
+  return cache.size();
+}
+
+Handle Engine::compile(std::string_view src, const std::string &name) {
+  std::lock_guard<std::mutex> guard(lock);
+  uint64_t hash = xxHash64(StringRef(src.data(), src.size()));
+
+  //  Cache hit: the source is compared too, so a hash collision only costs
+  //  a compilation
+  auto hit = cache.find(hash);
+  if (hit != cache.end() and hit->second->source == src) {
+    lru.splice(lru.begin(), lru, hit->second->lru);
+    return Handle(hit->second);
+  }
+
+  std::shared_ptr<CompiledUnit> unit = build(src, name, hash);
+  if (not unit)
+    return Handle();
+
+  //  Hash collision: the new unit takes the place of the old one, which is
+  //  removed by evict once no handle references it
+  if (hit != cache.end()) {
+    lru.erase(hit->second->lru);
+    orphans.push_back(hit->second);
+  }
+  lru.push_front(hash);
+  unit->lru = lru.begin();
+  usage += unit->codeSize;
+  cache[hash] = unit;
+
+  evict();
+  return Handle(unit);
+}
+
+namespace {
+//  The globals replaced by build are shared by every Engine of the process
+std::mutex codegenLock;
+}
+
+/**
+ * Parsing and code generation reuse the same path as the command line
+ * compiler: the global context, module and builder are temporarily replaced
+ * with fresh instances, so that the generated module can then be handed
+ * over to the JIT.
+ */
+std::shared_ptr<CompiledUnit> Engine::build(std::string_view src, const std::string &sourceName, uint64_t hash) {
+  auto ctx = std::make_unique<LLVMContext>();
+  auto mod = std::make_unique<Module>("kcomp.engine", *ctx);
+  mod->setDataLayout(jit->getDataLayout());
+  mod->setTargetTriple(target->getTargetTriple().str());
+  IRBuilder<> irb(*ctx);
+
+  std::unique_lock<std::mutex> codegenGuard(codegenLock);
+  LLVMContext *savedContext = context;
+  Module *savedModule = module;
+  IRBuilder<> *savedBuilder = builder;
+  context = ctx.get();
+  module = mod.get();
+  builder = &irb;
+
+  //  Error messages go to lastError(), not to the output of the host
+  std::string messages;
+  std::string *savedDiagnostics = diagnostics;
+  diagnostics = &messages;
+
+  driver drv;
+  drv.batch_all = opts.batch;
+  //  The functions of a unit may be called by several threads at once: a
+  //  memo table would be updated without synchronization
+  drv.memoTables = false;
+  //  perf annotate maps the samples back to the source lines too
+  drv.debugInfo = opts.debugInfo or opts.perfMap;
+  bool failed = drv.parse_string(src, sourceName) != 0;
+  if (not failed)
+    failed = not drv.codegen();
+
+  context = savedContext;
+  module = savedModule;
+  builder = savedBuilder;
+  diagnostics = savedDiagnostics;
+  codegenGuard.unlock();
+
+  if (failed) {
+    error = messages.empty() ? "syntax error" : StringRef(messages).rtrim("\n").str();
+    return nullptr;
+  }
+
+  std::string verifierErrors;
+  raw_string_ostream verifierStream(verifierErrors);
+  if (verifyModule(*mod, &verifierStream)) {
+    error = "invalid module: " + verifierStream.str();
+    return nullptr;
+  }
+
+  optimize(*mod, opts.optLevel, target.get());
+
+  std::vector<std::string> defined;
+  for (Function &F : *mod)
+    if (not F.isDeclaration())
+      defined.push_back(F.getName().str());
+
+  //  Each unit lives in its own JITDylib: different sources may define
+  //  functions with the same name, and the whole unit can be dropped at once
+  auto dylib = jit->createJITDylib("kcomp.unit." + std::to_string(unitCounter++));
+  if (not dylib) {
+    error = toString(dylib.takeError());
+    return nullptr;
+  }
+  JITDylib &JD = *dylib;
+  JD.addGenerator(cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
+    jit->getDataLayout().getGlobalPrefix())));
+
+  if (Error err = jit->addIRModule(JD, ThreadSafeModule(std::move(mod), std::move(ctx)))) {
+    error = toString(std::move(err));
+    cantFail(jit->getExecutionSession().removeJITDylib(JD));
+    return nullptr;
+  }
+
+  auto unit = std::make_shared<CompiledUnit>();
+  unit->source = std::string(src);
+  unit->hash = hash;
+  unit->dylib = &JD;
+
+  //  Looking every function up forces the materialization of the whole unit
+  //  now, so that handles never hit the JIT again
+  pendingBytes = 0;
+  for (auto &name : defined) {
+    auto addr = jit->lookup(JD, name);
+    if (not addr) {
+      error = toString(addr.takeError());
+      cantFail(jit->getExecutionSession().removeJITDylib(JD));
+      return nullptr;
+    }
+    unit->symbols[name] = addr->toPtr<void *>();
+  }
+  unit->codeSize = pendingBytes;
+
+  return unit;
+}
+
+void Engine::evict() {
+  //  Units replaced after a hash collision go as soon as they are unused
+  for (auto it = orphans.begin(); it != orphans.end();)
+    if (it->use_count() == 1) {
+      usage -= (*it)->codeSize;
+      cantFail(jit->getExecutionSession().removeJITDylib(*(*it)->dylib));
+      it = orphans.erase(it);
+    } else
+      ++it;
+
+  //  Least recently used units go first. Units still referenced by some
+  //  handle are skipped, thus the limit may be temporarily exceeded
+  auto it = lru.end();
+  while (usage > opts.memoryLimit and it != lru.begin()) {
+    --it;
+    auto entry = cache.find(*it);
+    if (entry->second.use_count() > 1)
+      continue;
+
+    usage -= entry->second->codeSize;
+    cantFail(jit->getExecutionSession().removeJITDylib(*entry->second->dylib));
+    cache.erase(entry);
+    it = lru.erase(it);
+  }
+}
+
+} // namespace kcomp
@@ -0,0 +1,131 @@
+#ifndef ENGINE_HPP
+#define ENGINE_HPP
+/**
+ * Embedding API di kcomp: compila sorgenti Kaleidoscope presenti in memoria
+ * e restituisce puntatori a funzione chiamabili direttamente da C++.
+ *
+ *   kcomp::Engine engine;
+ *   kcomp::Handle h = engine.compile("def f(a b) { a*b+1 };");
+ *   auto f = h.get<double(double, double)>("f");
+ *   double r = f(2, 3);
+ *
+ * Le funzioni compilate possono essere chiamate da più thread: le funzioni
+ * pure non hanno quindi la tabella di memoizzazione.
+ *
+ * Con Options::batch ogni funzione f(a b) è accompagnata da
+ *   void f_batch(const double *a, const double *b, double *out, size_t n)
+ * che valuta f su n righe di input colonnare.
+ *
+ * Con Options::debugInfo il codice ha le line table DWARF dei sorgenti ed è
+ * registrato presso gdb (GDB JIT interface): backtrace e breakpoint vedono
+ * le funzioni Kaleidoscope. Con Options::perfMap le funzioni compilate sono
+ * elencate in /tmp/perf-PID.map e, se LLVM è compilato con il supporto per
+ * perf, in un file jitdump (perf record -k 1, poi perf inject --jit).
+ *
+ * Il codice compilato è memorizzato in una cache indicizzata dall'hash del
+ * sorgente: ricompilare un sorgente già visto costa una lookup. La cache ha
+ * un limite di memoria; superato il limite le unità usate meno di recente
+ * (e non più referenziate da alcun Handle) vengono rimosse dal JIT.
+ */
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace llvm {
+class JITEventListener;
+class TargetMachine;
+namespace orc {
+class LLJIT;
+class JITDylib;
+}
+}
+
+namespace kcomp {
+
+/// Unità di codice compilato, corrispondente a un sorgente
+struct CompiledUnit {
+  std::string source;
+  uint64_t hash;
+  llvm::orc::JITDylib *dylib;           // < Contiene il codice dell'unità
+  std::map<std::string, void *> symbols; // < Funzioni definite nel sorgente
+  size_t codeSize;                      // < Dimensione del codice oggetto
+  std::list<uint64_t>::iterator lru;    // < Posizione nella lista LRU
+};
+
+/**
+ * Riferimento a un'unità compilata. Finché esiste almeno un Handle l'unità
+ * non viene rimossa dalla cache, quindi i puntatori ottenuti con get()
+ * restano validi.
+ */
+class Handle {
+  private:
+  std::shared_ptr<CompiledUnit> unit;
+
+  public:
+  Handle() = default;
+  explicit Handle(std::shared_ptr<CompiledUnit> unit);
+  explicit operator bool() const;
+
+  /// Indirizzo della funzione name, nullptr se non è definita nell'unità
+  void *address(const std::string &name) const;
+
+  template <typename Sig> Sig *get(const std::string &name) const {
+    return reinterpret_cast<Sig *>(address(name));
+  }
+};
+
+class Engine {
+  public:
+  struct Options {
+    size_t memoryLimit = 64 << 20; // < Limite (in byte) del codice in cache
+    unsigned optLevel = 2;         // < Livello di ottimizzazione (0-3)
+    bool batch = false;            // < Genera anche i wrapper f_batch
+    bool debugInfo = false;        // < Line table DWARF e registrazione in gdb
+    bool perfMap = false;          // < Simboli per perf (perf map e jitdump)
+  };
+
+  Engine();
+  explicit Engine(Options opts);
+  ~Engine();
+
+  /**
+   * Compila src (o lo recupera dalla cache). In caso di errore restituisce
+   * un Handle non valido e il messaggio è disponibile in lastError().
+   * name è il nome del sorgente nelle informazioni di debug.
+   */
+  Handle compile(std::string_view src, const std::string &name = "<string>");
+
+  std::string lastError() const;
+  size_t memoryUsage() const;   // < Byte di codice attualmente in cache
+  size_t cachedUnits() const;
+
+  private:
+  Options opts;
+  std::unique_ptr<llvm::JITEventListener> perfMap; // < Deve sopravvivere al JIT
+  std::unique_ptr<llvm::orc::LLJIT> jit;
+  std::unique_ptr<llvm::TargetMachine> target;
+  std::unordered_map<uint64_t, std::shared_ptr<CompiledUnit>> cache;
+  std::list<uint64_t> lru;      // < In testa le unità usate più di recente
+  /// Unità sostituite nella cache da un sorgente con lo stesso hash, ancora
+  /// referenziate da qualche Handle
+  std::vector<std::shared_ptr<CompiledUnit>> orphans;
+  size_t usage;
+  size_t pendingBytes;          // < Codice prodotto dalla compilazione in corso
+  unsigned unitCounter;
+  std::string error;
+  mutable std::mutex lock;
+
+  std::shared_ptr<CompiledUnit> build(std::string_view src, const std::string &sourceName, uint64_t hash);
+  void evict();
+};
+
+} // namespace kcomp
+
+#endif // ! ENGINE_HPP
@@ -0,0 +1,192 @@
+#include "interface.hpp"
+#include "driver.hpp"
+
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/DebugInfo.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include <set>
+
+using namespace llvm;
+using namespace ki;
+
+namespace {
+
+const char magic[4] = {'K', 'I', '0', '1'};
+
+/// Il valore (anche attraverso espressioni costanti) riferisce un simbolo interno
+bool ReferencesLocal(const Value *V) {
+  if (auto *GV = dyn_cast<GlobalValue>(V))
+    return GV->hasLocalLinkage();
+  if (auto *C = dyn_cast<ConstantExpr>(V))
+    return any_of(C->operands(), [](const Use &U) { return ReferencesLocal(U.get()); });
+  return false;
+}
+
+/// Un corpo available_externally non può usare simboli interni (ad es. le
+/// tabelle di memoizzazione), che l'oggetto non esporta
+bool Inlinable(const Function &F) {
+  if (F.isDeclaration() or F.getInstructionCount() > inlineLimit)
+    return false;
+  for (const BasicBlock &BB: F)
+    for (const Instruction &I: BB)
+      if (any_of(I.operands(), [](const Use &U) { return ReferencesLocal(U.get()); }))
+        return false;
+  return true;
+}
+
+/// Modulo in bitcode con i soli corpi esportati, senza debug info né target
+std::string Bodies(const Module &M, const std::set<const GlobalValue *> &bodies) {
+  if (bodies.empty())
+    return "";
+  ValueToValueMapTy VMap;
+  std::unique_ptr<Module> code = CloneModule(M, VMap, [&](const GlobalValue *GV) {
+    return bodies.count(GV) > 0;
+  });
+  for (Function &F: make_early_inc_range(code->functions())) {
+    if (not F.isDeclaration())
+      F.setLinkage(GlobalValue::AvailableExternallyLinkage);
+    else if (F.use_empty())
+      F.eraseFromParent();
+  }
+  for (GlobalVariable &GV: make_early_inc_range(code->globals()))
+    if (GV.isDeclaration() and GV.use_empty())
+      GV.eraseFromParent();
+  StripDebugInfo(*code);
+  //  The importing module sets them when the target is known
+  code->setTargetTriple("");
+  code->setDataLayout("");
+
+  std::string bitcode;
+  raw_string_ostream out(bitcode);
+  WriteBitcodeToFile(*code, out);
+  return out.str();
+}
+
+/// Lettura sequenziale, con controllo dei limiti, del file mappato
+struct Reader {
+  StringRef data;
+  size_t pos = 0;
+  bool ok = true;
+
+  StringRef bytes(size_t n) {
+    if (not ok or n > data.size() - pos) {
+      ok = false;
+      return "";
+    }
+    pos += n;
+    return data.substr(pos - n, n);
+  }
+  uint32_t u32() {
+    StringRef b = bytes(4);
+    return ok ? support::endian::read32le(b.data()) : 0;
+  }
+  void align() {
+    bytes((4 - pos % 4) % 4);
+  }
+};
+
+} // namespace
+
+bool ki::write(const std::string &path, const std::vector<RootAST *> &definitions, Module &M) {
+  Interface I;
+  std::set<const GlobalValue *> bodies;
+  for (RootAST *def: definitions) {
+    if (auto *fn = dynamic_cast<FunctionAST *>(def)) {
+      Function *F = M.getFunction(fn->getName());
+      if (not F or F->hasLocalLinkage())
+        continue;
+      Signature sig = {fn->getName(), {}};
+      for (unsigned i = 0; i < fn->getProto()->getArgs().size(); i++)
+        sig.arrays.push_back(fn->getProto()->isArray(i));
+      I.functions.push_back(sig);
+      if (Inlinable(*F))
+        bodies.insert(F);
+    }
+    else if (auto *A = dynamic_cast<GlobalArrayAST *>(def))
+      I.globals.push_back({A->getName(), A->getDims()});
+    else if (auto *G = dynamic_cast<GlobalVarAST *>(def))
+      I.globals.push_back({G->getName(), {}});
+  }
+
+  std::error_code EC;
+  raw_fd_ostream out(path, EC);
+  if (EC) {
+    errs() << "cannot write " << path << ": " << EC.message() << "\n";
+    return false;
+  }
+  support::endian::Writer w(out, support::little);
+  auto string = [&](StringRef s) {
+    w.write<uint32_t>(s.size());
+    out << s;
+  };
+
+  out.write(magic, sizeof magic);
+  w.write<uint32_t>(I.functions.size());
+  for (auto &fn: I.functions) {
+    string(fn.name);
+    w.write<uint32_t>(fn.arrays.size());
+    for (bool array: fn.arrays)
+      w.write<uint8_t>(array);
+  }
+  w.write<uint32_t>(I.globals.size());
+  for (auto &G: I.globals) {
+    string(G.name);
+    w.write<uint32_t>(G.dims.size());
+    for (int dim: G.dims)
+      w.write<uint32_t>(dim);
+  }
+  //  The bitcode reader wants 32 bit words: aligned in the mapping
+  std::string bitcode = Bodies(M, bodies);
+  w.write<uint32_t>(bitcode.size());
+  out.write_zeros((4 - out.tell() % 4) % 4);
+  out << bitcode;
+  return true;
+}
+
+bool ki::read(const std::string &path, Interface &I, std::string &error) {
+  Expected<sys::fs::file_t> fd = sys::fs::openNativeFileForRead(path);
+  if (not fd) {
+    error = "cannot open " + path + ": " + toString(fd.takeError());
+    return false;
+  }
+  sys::fs::file_status status;
+  std::error_code EC = sys::fs::status(*fd, status);
+  if (not EC and status.getSize() < sizeof magic)
+    EC = std::make_error_code(std::errc::invalid_argument);
+  if (not EC)
+    I.mapping = std::make_shared<sys::fs::mapped_file_region>(*fd, sys::fs::mapped_file_region::readonly,
+                                                               status.getSize(), 0, EC);
+  sys::fs::closeFile(*fd);
+  if (EC) {
+    error = "cannot map " + path + ": " + EC.message();
+    return false;
+  }
+
+  Reader r = {StringRef(I.mapping->const_data(), I.mapping->size())};
+  if (r.bytes(sizeof magic) != StringRef(magic, sizeof magic)) {
+    error = path + " is not an interface file";
+    return false;
+  }
+  for (uint32_t n = r.u32(); n > 0 and r.ok; n--) {
+    Signature fn = {r.bytes(r.u32()).str(), {}};
+    for (uint32_t params = r.u32(); params > 0 and r.ok; params--)
+      fn.arrays.push_back(r.bytes(1) == "\1");
+    I.functions.push_back(fn);
+  }
+  for (uint32_t n = r.u32(); n > 0 and r.ok; n--) {
+    Global G = {r.bytes(r.u32()).str(), {}};
+    for (uint32_t dims = r.u32(); dims > 0 and r.ok; dims--)
+      G.dims.push_back(r.u32());
+    I.globals.push_back(G);
+  }
+  uint32_t size = r.u32();
+  r.align();
+  I.bitcode = r.bytes(size);
+  if (not r.ok) {
+    error = path + " is truncated";
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,66 @@
+#ifndef INTERFACE_HPP
+#define INTERFACE_HPP
+/**
+ * File di interfaccia (.ki) per import "rand".
+ *
+ * kcomp --emit-interface rand.k scrive, accanto al sorgente, rand.ki con le
+ * definizioni di primo livello di rand.k: il nome e i parametri (scalari o
+ * array) di ogni funzione, il nome e le dimensioni di ogni variabile
+ * globale e, in bitcode, i corpi delle funzioni abbastanza piccole da essere
+ * espanse inline. Un import dichiara tutte queste funzioni e variabili, con
+ * il numero corretto di parametri; i corpi diventano definizioni
+ * available_externally, che l'ottimizzatore può espandere inline ma che
+ * non vengono emesse: il codice resta quello dell'oggetto di rand.k.
+ *
+ * Il formato è binario (interi little-endian a 32 bit, stringhe precedute
+ * dalla lunghezza) e il file viene mappato in memoria, senza scanning né
+ * parsing del sorgente importato.
+ */
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+
+class RootAST;
+
+namespace ki {
+
+/// Funzione esportata: per ogni parametro, se è un array
+struct Signature {
+  std::string name;
+  std::vector<bool> arrays;
+};
+
+/// Variabile globale esportata: dimensioni vuote per uno scalare
+struct Global {
+  std::string name;
+  std::vector<int> dims;
+};
+
+struct Interface {
+  std::vector<Signature> functions;
+  std::vector<Global> globals;
+  llvm::StringRef bitcode;  // < Nella regione mappata, vuoto se nessun corpo è esportato
+  std::shared_ptr<llvm::sys::fs::mapped_file_region> mapping;
+};
+
+/// Funzioni espanse inline dai moduli che importano (numero di istruzioni IR)
+constexpr unsigned inlineLimit = 32;
+
+/**
+ * Scrive in path l'interfaccia delle definizioni (FunctionAST, GlobalVarAST
+ * e GlobalArrayAST) di un sorgente, già tradotte in M. Le funzioni rese
+ * interne da --export non sono esportate. Restituisce false (dopo aver
+ * stampato un errore) se il file non può essere scritto.
+ */
+bool write(const std::string &path, const std::vector<RootAST *> &definitions, llvm::Module &M);
+
+/// Mappa in memoria un file di interfaccia. In caso di errore restituisce
+/// false, con il motivo in error
+bool read(const std::string &path, Interface &I, std::string &error);
+
+} // namespace ki
+
+#endif // ! INTERFACE_HPP
@@ -0,0 +1,33 @@
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include <unistd.h>
+
+#include "server.hpp"
+
+// Client di kcomp --server senza LLVM: il suo avvio costa quanto quello di
+// un programma C++ qualsiasi. Gli argomenti sono quelli di kcomp
+int main (int argc, char *argv[]) {
+  std::string socket = defaultSocket();
+  int i = 1;
+  if (i < argc && strncmp(argv[i], "--socket=", 9) == 0)
+    socket = argv[i++] + 9;
+
+  std::vector<char *> args = {const_cast<char *>("kcomp")};
+  args.insert(args.end(), argv + i, argv + argc);
+  int res = runClient(socket, args);
+  if (res >= 0)
+    return res;
+
+  // Nessun server: kcomp viene cercato accanto al client, poi nel PATH
+  args.push_back(nullptr);
+  std::string self = argv[0];
+  if (self.find('/') != std::string::npos) {
+    std::string kcomp = self.substr(0, self.rfind('/') + 1) + "kcomp";
+    execv(kcomp.c_str(), args.data());
+  }
+  execvp("kcomp", args.data());
+  std::cerr << "kcomp-client: no server on " << socket << " and cannot run kcomp: " << strerror(errno) << std::endl;
+  return 1;
+}
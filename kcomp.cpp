@@ -1,24 +1,351 @@
+#include <dlfcn.h>
 #include <iostream>
 #include "driver.hpp"
+#include "bytecode.hpp"
+#include "transforms.hpp"
+#include "perfreport.hpp"
+#include "objcache.hpp"
+#include "interface.hpp"
+#include "server.hpp"
+#include "repl.hpp"
+
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/LLVMRemarkStreamer.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ToolOutputFile.h"
 
 extern LLVMContext *context;
 extern Module *module;
 extern IRBuilder<> *builder;
 
-int main (int argc, char *argv[]) {
+// Target per l'host, già inizializzati da --server: (CPU, PIC) -> TargetMachine
+static std::map<std::pair<std::string, bool>, std::unique_ptr<TargetMachine>> warmTargets;
+
+static std::unique_ptr<TargetMachine> HostTarget(const std::string &cpu, bool pic) {
+  auto warm = warmTargets.find({cpu, pic});
+  if (warm != warmTargets.end() && warm->second)
+    return std::move(warm->second);
+
+  auto JTMB = cantFail(orc::JITTargetMachineBuilder::detectHost());
+  // Gli oggetti possono finire sia in eseguibili PIE che in librerie
+  if (pic)
+    JTMB.setRelocationModel(Reloc::PIC_);
+  if (!cpu.empty()) {
+    // Le feature dell'host non valgono per un'altra CPU
+    JTMB.setCPU(cpu);
+    JTMB.getFeatures() = SubtargetFeatures();
+  }
+  return cantFail(JTMB.createTargetMachine());
+}
+
+// Un ciclo, ottimizzato e tradotto in codice oggetto: la pipeline e il
+// backend costruiscono le loro tabelle (subtarget, lowering) al primo uso
+static const char *warmUpIR = R"(
+define double @warm(ptr %a, i64 %n) {
+entry:
+  br label %loop
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %s = phi double [ 0.0, %entry ], [ %s.next, %loop ]
+  %p = getelementptr double, ptr %a, i64 %i
+  %x = load double, ptr %p
+  %s.next = fadd double %s, %x
+  %i.next = add i64 %i, 1
+  %c = icmp ult i64 %i.next, %n
+  br i1 %c, label %loop, label %exit
+exit:
+  ret double %s.next
+}
+)";
+
+static void WarmUp() {
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  InitializeNativeTargetAsmParser();
+  for (bool pic: {false, true}) {
+    std::unique_ptr<TargetMachine> TM = HostTarget("", pic);
+    LLVMContext ctx;
+    SMDiagnostic err;
+    std::unique_ptr<Module> M = parseAssemblyString(warmUpIR, err, ctx);
+    M->setTargetTriple(TM->getTargetTriple().str());
+    M->setDataLayout(TM->createDataLayout());
+    optimize(*M, 2, TM.get());
+    SmallVector<char, 0> object;
+    raw_svector_ostream out(object);
+    legacy::PassManager PM;
+    if (!TM->addPassesToEmitFile(PM, out, nullptr, CGFT_ObjectFile))
+      PM.run(*M);
+    warmTargets[{"", pic}] = std::move(TM);
+  }
+}
+
+static int Compile (int argc, char *argv[]) {
   int res = 0;
   driver drv;
+  bool interp = false;    // Esecuzione con il backend bytecode
+  bool repl = false;      // Sessione interattiva (repl.hpp)
+  std::vector<std::string> replFiles; // Sorgenti caricati all'avvio della sessione
+  std::vector<std::string> cpus; // Varianti per il multiversioning
+  std::set<std::string> exports;  // Funzioni visibili all'esterno (--export)
+  unsigned optLevel = 0;  // Pipeline di ottimizzazione (-O1, -O2, -O3)
+  std::string remarks[3]; // Regex di -Rpass, -Rpass-missed, -Rpass-analysis
+  std::string remarksOutput; // File YAML con tutti i remark (--remarks-output)
+  bool perfReportMode = false; // Stima del throughput dei cicli (--perf-report)
+  std::string cpu;        // CPU del modello di scheduling (-mcpu, default l'host)
+  std::string output;     // Archivio di oggetti da generare (-o), invece dell'IR
+  std::string cacheDir = defaultCacheDir(); // Cache degli oggetti per unità
+  bool emitInterface = false; // Scrive un file .ki per ogni sorgente
+  std::vector<std::pair<std::string, std::vector<RootAST *>>> sources;
+  bc::Program program;
   int i = 1;
   while (i<argc) {
     if (argv[i] == std::string ("-p"))
       drv.trace_parsing = true; // Abilita tracce debug nel parser
     else if (argv[i] == std::string ("-s"))
       drv.trace_scanning = true;// Abilita tracce debug nello scanner
+    else if (argv[i] == std::string ("-g"))
+      drv.debugInfo = true;     // Line table DWARF dei sorgenti
+    else if (StringRef(argv[i]).size() == 3 && StringRef(argv[i]).startswith("-O") && argv[i][2] >= '0' && argv[i][2] <= '3')
+      optLevel = argv[i][2] - '0';
+    else if (argv[i] == std::string ("--perf-report")) {
+      perfReportMode = true;
+      drv.debugInfo = true;     // Le direttive .loc collegano i cicli ai for
+    }
+    else if (argv[i] == std::string ("-o") && i + 1 < argc)
+      output = argv[++i];       // Compilazione incrementale (objcache.hpp)
+    else if (StringRef(argv[i]).startswith("--cache-dir="))
+      cacheDir = argv[i] + 12;
+    else if (StringRef(argv[i]).startswith("-finstrument=")) {
+      // Profilo di funzioni e cicli, scritto dalla runtime library
+      SmallVector<StringRef, 2> kinds;
+      StringRef(argv[i]).drop_front(13).split(kinds, ',', -1, false);
+      for (auto kind: kinds)
+        if (kind == "functions")
+          drv.instrumentFunctions = true;
+        else if (kind == "loops")
+          drv.instrumentLoops = true;
+        else {
+          std::cerr << "-finstrument: unknown kind " << kind.str() << " (functions, loops)" << std::endl;
+          return 1;
+        }
+    }
+    else if (argv[i] == std::string ("--emit-interface"))
+      emitInterface = true;     // Interfaccia per import (interface.hpp)
+    else if (argv[i] == std::string ("--no-cache"))
+      cacheDir = "";
+    else if (StringRef(argv[i]).startswith("-mcpu="))
+      cpu = argv[i] + 6;
+    else if (StringRef(argv[i]).startswith("-Rpass=")) {
+      remarks[0] = argv[i] + 7;   // Ottimizzazioni applicate
+      drv.trackLocations = true;
+    }
+    else if (StringRef(argv[i]).startswith("-Rpass-missed=")) {
+      remarks[1] = argv[i] + 14;  // Ottimizzazioni mancate
+      drv.trackLocations = true;
+    }
+    else if (StringRef(argv[i]).startswith("-Rpass-analysis=")) {
+      remarks[2] = argv[i] + 16;  // Motivazioni delle decisioni
+      drv.trackLocations = true;
+    }
+    else if (StringRef(argv[i]).startswith("--remarks-output=")) {
+      remarksOutput = argv[i] + 17;
+      drv.trackLocations = true;
+    }
+    else if (argv[i] == std::string ("--batch"))
+      drv.batch_all = true;     // Wrapper batch per tutte le funzioni
+    else if (StringRef(argv[i]).startswith("--batch=")) {
+      SmallVector<StringRef, 4> names; // Wrapper batch solo per quelle elencate
+      StringRef(argv[i]).drop_front(8).split(names, ',', -1, false);
+      for (auto name: names)
+        drv.batch.insert(name.str());
+    }
+    else if (argv[i] == std::string ("--interp"))
+      interp = true;            // Esegue main() con l'interprete bytecode
+    else if (argv[i] == std::string ("--repl"))
+      repl = true;              // Compilazione ed esecuzione riga per riga
+    else if (StringRef(argv[i]).startswith("--multiversion=")) {
+      SmallVector<StringRef, 4> names;  // Es. x86-64,x86-64-v3,x86-64-v4
+      StringRef(argv[i]).drop_front(15).split(names, ',', -1, false);
+      for (auto name: names)
+        cpus.push_back(name.str());
+    }
+    else if (StringRef(argv[i]).startswith("--array-align=")) {
+      unsigned align;   // Allineamento in byte degli array (potenza di 2)
+      if (StringRef(argv[i]).drop_front(14).getAsInteger(10, align) || align < 8 || !isPowerOf2_32(align)) {
+        std::cerr << "--array-align requires a power of 2, at least 8" << std::endl;
+        return 1;
+      }
+      drv.arrayAlign = align;
+    }
+    else if (StringRef(argv[i]).startswith("--export=")) {
+      SmallVector<StringRef, 4> names;  // Le altre funzioni diventano interne
+      StringRef(argv[i]).drop_front(9).split(names, ',', -1, false);
+      for (auto name: names)
+        exports.insert(name.str());
+    }
+    else if (StringRef(argv[i]).startswith("--load=")) {
+      // Libreria in cui cercare le extern (--interp, --repl)
+      if (!dlopen(argv[i] + 7, RTLD_NOW | RTLD_GLOBAL)) {
+        std::cerr << dlerror() << std::endl;
+        res = 1;
+      }
+    }
+    else if (repl)
+      replFiles.push_back(argv[i]);
     else  if (!drv.parse(argv[i])) { // Parsing e creazione dell'AST
-      drv.codegen();                 // Visita AST e generazione dell'IR (su stderr)
+      if (interp) {
+        if (!bc::compile(drv, program))  // Traduzione in bytecode
+          res = 1;
+      } else {
+        if (!drv.codegen())          // Visita AST e generazione dell'IR
+          res = 1;
+        sources.push_back({argv[i], drv.definitions});
+      }
     } else
       res = 1;
     i++;
   };
+
+  if (repl)
+    return res ? res : runRepl(drv, optLevel, replFiles);
+
+  if (interp) {
+    double result;
+    if (res == 0 && !program.link())
+      res = 1;
+    bc::VM vm(program);
+    if (res == 0 && !vm.run("main", result)) {
+      std::cerr << "main() is not defined" << std::endl;
+      res = 1;
+    }
+    return res;
+  }
+
+  // Le ottimizzazioni (in particolare vettorizzazione e unrolling) usano il
+  // cost model della CPU su cui gira kcomp, o di quella scelta con -mcpu
+  std::unique_ptr<TargetMachine> TM;
+  if (perfReportMode && optLevel == 0)
+    optLevel = 2;           // Il report riguarda il codice ottimizzato
+  if (optLevel > 0 || !output.empty()) {
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
+    TM = HostTarget(cpu, !output.empty());
+    if (!cpu.empty() && !TM->getMCSubtargetInfo()->isCPUStringValid(cpu)) {
+      std::cerr << "-mcpu: unknown CPU " << cpu << " for " << TM->getTargetTriple().str() << std::endl;
+      return 1;
+    }
+    module->setTargetTriple(TM->getTargetTriple().str());
+    module->setDataLayout(TM->createDataLayout());
+  }
+
+  if (!exports.empty()) {
+    // Restano esterne anche main e le funzioni che un sorgente dichiara
+    // extern (sono definite in un altro dei sorgenti compilati)
+    exports.insert("main");
+    exports.insert(drv.externs.begin(), drv.externs.end());
+    internalize(*module, exports);
+  }
+  inferAttributes(*module);
+
+  // Dopo --export e inferAttributes: le funzioni interne non sono esportate,
+  // i corpi copiati hanno già gli attributi dedotti
+  if (emitInterface)
+    for (auto &[path, definitions]: sources) {
+      SmallString<128> ki(path);
+      sys::path::replace_extension(ki, "ki");
+      if (!ki::write(std::string(ki), definitions, *module))
+        res = 1;
+    }
+
+  if (!cpus.empty() && !output.empty()) {
+    std::cerr << "--multiversion cannot be used with -o" << std::endl;
+    return 1;
+  }
+  if (!cpus.empty() && !multiversion(*module, cpus))
+    res = 1;
+
+  if (!reportRemarks(*context, remarks[0], remarks[1], remarks[2]))
+    return 1;
+  std::unique_ptr<ToolOutputFile> remarksFile;
+  if (!remarksOutput.empty()) {
+    auto file = setupLLVMOptimizationRemarks(*context, remarksOutput, "", "yaml", false);
+    if (!file) {
+      std::cerr << toString(file.takeError()) << std::endl;
+      return 1;
+    }
+    remarksFile = std::move(*file);
+  }
+  if (!output.empty()) {
+    // Ogni unità è ottimizzata e compilata separatamente, se non è in cache
+    if (res == 0 && !buildObjects(*module, *TM, optLevel, cacheDir, output))
+      res = 1;
+    if (remarksFile)
+      remarksFile->keep();
+    return res;
+  }
+  optimize(*module, optLevel, TM.get());
+  if (remarksFile)
+    remarksFile->keep();
+  if (perfReportMode && !perfReport(*module, *TM, outs()))
+    res = 1;
+
+  module->print(errs(), nullptr);    // Emissione dell'IR (su stderr)
+  return res;
+}
+
+// Richiesta di --server, in un processo che termina senza distruttori
+static int CompileRequest (int argc, char *argv[]) {
+  int res = Compile(argc, argv);
+  outs().flush();
+  errs().flush();
+  std::cout.flush();
+  return res;
+}
+
+int main (int argc, char *argv[]) {
+  // --server e --client (server.hpp) precedono le opzioni di compilazione
+  bool server = argc > 1 && argv[1] == std::string ("--server");
+  bool client = argc > 1 && argv[1] == std::string ("--client");
+  if (!server && !client)
+    return Compile(argc, argv);
+
+  std::string socket = defaultSocket();
+  unsigned jobs = 0;       // Compilazioni contemporanee (0: una per core)
+  int i = 2;
+  for (; i < argc; i++) {
+    if (StringRef(argv[i]).startswith("--socket="))
+      socket = argv[i] + 9;
+    else if (server && StringRef(argv[i]).startswith("--jobs=")) {
+      if (StringRef(argv[i]).drop_front(7).getAsInteger(10, jobs) || jobs == 0) {
+        std::cerr << "--jobs: expected a positive number" << std::endl;
+        return 1;
+      }
+    } else
+      break;
+  }
+
+  if (server) {
+    if (i < argc) {
+      std::cerr << "--server: unexpected argument " << argv[i] << std::endl;
+      return 1;
+    }
+    WarmUp();
+    return runServer(socket, jobs, CompileRequest);
+  }
+
+  std::vector<char *> args = {argv[0]};
+  args.insert(args.end(), argv + i, argv + argc);
+  int res = runClient(socket, args);
+  // Senza server la compilazione avviene qui, come senza --client
+  if (res < 0) {
+    args.push_back(nullptr);
+    res = Compile(args.size() - 1, args.data());
+  }
   return res;
 }
@@ -0,0 +1,195 @@
+#include "objcache.hpp"
+#include "transforms.hpp"
+
+#include "llvm/ADT/EquivalenceClasses.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Object/ArchiveWriter.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/SmallVectorMemoryBuffer.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include <map>
+#include <set>
+
+using namespace llvm;
+
+namespace {
+
+/// Cambia quando cambia il modo in cui gli oggetti sono generati
+const char *cacheVersion = "kcomp-objcache-1";
+
+/// Definizioni compilate in uno stesso oggetto
+struct Unit {
+  std::string name;   // < Nome del membro dell'archivio
+  std::set<const GlobalValue *> definitions;
+};
+
+/// Global value (funzione o variabile) in cui compare l'utente U
+void Owners(const User *U, SmallPtrSetImpl<const GlobalValue *> &owners) {
+  if (auto *I = dyn_cast<Instruction>(U))
+    owners.insert(I->getFunction());
+  else if (auto *GV = dyn_cast<GlobalValue>(U))
+    owners.insert(GV);
+  else
+    for (const User *user: U->users())
+      Owners(user, owners);
+}
+
+/* Una unità per ogni funzione definita. I simboli interni non sono visibili
+   da un altro oggetto: stanno nella stessa unità di chi li usa, e chi usa
+   lo stesso simbolo interno finisce nella stessa unità. */
+std::vector<Unit> Partition(const Module &M) {
+  EquivalenceClasses<const GlobalValue *> classes;
+  for (const GlobalValue &GV: M.global_values()) {
+    if (GV.isDeclaration())
+      continue;
+    classes.insert(&GV);
+    if (not GV.hasLocalLinkage())
+      continue;
+    SmallPtrSet<const GlobalValue *, 4> owners;
+    for (const User *U: GV.users())
+      Owners(U, owners);
+    for (const GlobalValue *owner: owners)
+      classes.unionSets(&GV, owner);
+  }
+
+  std::vector<Unit> units;
+  std::map<const GlobalValue *, size_t> unitOf;   // < Per rappresentante della classe
+  //  Units are named after their first exported function, if any
+  for (bool local: {false, true})
+    for (const Function &F: M) {
+      if (F.isDeclaration() or F.hasLocalLinkage() != local or unitOf.count(classes.getLeaderValue(&F)))
+        continue;
+      unitOf[classes.getLeaderValue(&F)] = units.size();
+      units.push_back({F.getName().str() + ".o", {}});
+      for (auto member = classes.findLeader(&F); member != classes.member_end(); ++member)
+        units.back().definitions.insert(*member);
+    }
+
+  //  The identifiers of the language have no dots: no function has this name
+  Unit globals = {"kcomp.globals.o", {}};
+  for (const GlobalVariable &GV: M.globals())
+    if (not GV.isDeclaration() and not unitOf.count(classes.getLeaderValue(&GV)))
+      globals.definitions.insert(&GV);
+  if (not globals.definitions.empty())
+    units.push_back(std::move(globals));
+  return units;
+}
+
+/// Modulo con le sole definizioni dell'unità, e le dichiarazioni di quanto usano
+std::unique_ptr<Module> Extract(const Module &M, const Unit &unit) {
+  ValueToValueMapTy VMap;
+  std::unique_ptr<Module> code = CloneModule(M, VMap, [&](const GlobalValue *GV) {
+    return unit.definitions.count(GV) > 0;
+  });
+  //  Unused declarations would make the key depend on the rest of the module
+  for (Function &F: make_early_inc_range(code->functions()))
+    if (F.isDeclaration() and F.use_empty())
+      F.eraseFromParent();
+  for (GlobalVariable &GV: make_early_inc_range(code->globals()))
+    if (GV.isDeclaration() and GV.use_empty())
+      GV.eraseFromParent();
+  return code;
+}
+
+/// Chiave dell'unità nella cache: tutto ciò da cui dipende il codice oggetto
+std::string Key(const Module &code, TargetMachine &TM, unsigned optLevel) {
+  std::string text;
+  raw_string_ostream out(text);
+  out << cacheVersion << " LLVM " << LLVM_VERSION_STRING << " -O" << optLevel << " "
+      << TM.getTargetTriple().str() << " " << TM.getTargetCPU() << " " << TM.getTargetFeatureString() << "\n";
+  code.print(out, nullptr);
+  return toHex(SHA1::hash(arrayRefFromStringRef(out.str())), true);
+}
+
+bool EmitObject(Module &code, TargetMachine &TM, SmallVectorImpl<char> &object) {
+  raw_svector_ostream out(object);
+  legacy::PassManager PM;
+  if (TM.addPassesToEmitFile(PM, out, nullptr, CGFT_ObjectFile))
+    return false;
+  PM.run(code);
+  return true;
+}
+
+void Store(const std::string &path, StringRef object) {
+  //  Written under a temporary name: a concurrent kcomp never reads a partial object
+  int fd;
+  SmallString<128> temp;
+  if (std::error_code EC = sys::fs::createUniqueFile(path + ".tmp%%%%%%", fd, temp)) {
+    errs() << "warning: cannot write to the cache: " << EC.message() << "\n";
+    return;
+  }
+  {
+    raw_fd_ostream out(fd, true);
+    out << object;
+  }
+  if (sys::fs::rename(temp, path))
+    sys::fs::remove(temp);
+}
+
+} // namespace
+
+std::string defaultCacheDir() {
+  SmallString<128> dir;
+  if (not sys::path::cache_directory(dir))
+    return "";
+  sys::path::append(dir, "kcomp");
+  return std::string(dir);
+}
+
+bool buildObjects(Module &M, TargetMachine &TM, unsigned optLevel, const std::string &cacheDir,
+                  const std::string &output) {
+  bool useCache = not cacheDir.empty();
+  if (useCache) {
+    if (std::error_code EC = sys::fs::create_directories(cacheDir)) {
+      errs() << "warning: cannot create " << cacheDir << ": " << EC.message() << "\n";
+      useCache = false;
+    }
+  }
+
+  std::vector<Unit> units = Partition(M);
+  std::vector<std::unique_ptr<MemoryBuffer>> objects;
+  std::vector<NewArchiveMember> members;
+  unsigned cached = 0;
+  for (const Unit &unit: units) {
+    std::unique_ptr<Module> code = Extract(M, unit);
+    std::string path = cacheDir + "/" + Key(*code, TM, optLevel) + ".o";
+
+    std::unique_ptr<MemoryBuffer> object;
+    if (useCache) {
+      if (auto hit = MemoryBuffer::getFile(path)) {
+        object = std::move(*hit);
+        cached++;
+      }
+    }
+    if (not object) {
+      optimize(*code, optLevel, &TM);
+      SmallVector<char, 0> buffer;
+      if (not EmitObject(*code, TM, buffer)) {
+        errs() << "cannot generate object code for " << TM.getTargetTriple().str() << "\n";
+        return false;
+      }
+      if (useCache)
+        Store(path, StringRef(buffer.data(), buffer.size()));
+      object = std::make_unique<SmallVectorMemoryBuffer>(std::move(buffer), unit.name);
+    }
+
+    members.emplace_back(object->getMemBufferRef());
+    members.back().MemberName = unit.name;
+    objects.push_back(std::move(object));
+  }
+
+  auto kind = TM.getTargetTriple().isOSDarwin() ? object::Archive::K_DARWIN : object::Archive::K_GNU;
+  if (Error E = writeArchive(output, members, true, kind, true, false)) {
+    errs() << output << ": " << toString(std::move(E)) << "\n";
+    return false;
+  }
+  outs() << output << ": " << units.size() << " units, " << cached << " from cache\n";
+  return true;
+}
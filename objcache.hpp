@@ -0,0 +1,36 @@
+#ifndef OBJCACHE_HPP
+#define OBJCACHE_HPP
+/**
+ * Compilazione incrementale (kcomp -o prog.a): il modulo viene suddiviso in
+ * unità, una per funzione definita, e ciascuna è ottimizzata e tradotta in
+ * codice oggetto separatamente. Gli oggetti sono memorizzati in una cache
+ * su disco indicizzata dal contenuto: l'SHA-1 dell'IR non ottimizzato
+ * dell'unità (che include le dichiarazioni delle funzioni chiamate, con i
+ * loro attributi) insieme al livello di ottimizzazione, al target e alla
+ * versione di LLVM. Modificare una def ricompila solo la sua unità; gli
+ * oggetti sono poi raccolti in un archivio, da passare al linker.
+ *
+ * Funzioni e variabili con linkage interno (ad es. le tabelle di
+ * memoizzazione o le funzioni nascoste da --export) restano nell'unità delle
+ * funzioni che le usano; le variabili globali esterne sono tutte in
+ * un'unità a parte. Non essendoci più un unico modulo, l'inlining avviene
+ * solo all'interno di un'unità.
+ */
+#include <string>
+
+#include "llvm/IR/Module.h"
+#include "llvm/Target/TargetMachine.h"
+
+/// Directory della cache: $XDG_CACHE_HOME/kcomp, o ~/.cache/kcomp
+std::string defaultCacheDir();
+
+/**
+ * Scrive in output l'archivio con gli oggetti delle unità di M, compilando
+ * (a livello optLevel, per TM) solo quelle assenti da cacheDir. Un errore
+ * della cache non impedisce la compilazione; restituisce false (dopo aver
+ * stampato un errore) se non è possibile generare il codice o l'archivio.
+ */
+bool buildObjects(llvm::Module &M, llvm::TargetMachine &TM, unsigned optLevel, const std::string &cacheDir,
+                  const std::string &output);
+
+#endif // ! OBJCACHE_HPP
@@ -34,6 +34,9 @@
   class ArrayAssignmentAST;
   class ArrayExprAST;
   class GlobalArrayAST;
+  class ArrayLengthAST;
+  class SaveFileAST;
+  class ImportAST;
 }
 
 // The parsing context.
@@ -45,7 +48,42 @@
 %define parse.error verbose
 
 %code {
+# include <climits>
+# include <sstream>
 # include "driver.hpp"
+
+extern std::string *diagnostics;
+
+// Dimensioni di un array note a compile time: numeri interi positivi, con
+// un numero totale di elementi rappresentabile come int
+static bool ConstantDims(const std::vector<ExprAST *> &exps, std::vector<int> &dims) {
+  double total = 1;
+  for (auto exp: exps) {
+    auto *N = dynamic_cast<NumberExprAST *>(exp);
+    if (not N)
+      return false;
+    double dim = std::get<double>(N->getLexVal());
+    total *= dim;
+    if (not (dim >= 1 and dim == (int)dim and total <= INT_MAX))
+      return false;
+    dims.push_back(dim);
+  }
+  return true;
+}
+
+// Statement fuori dalle funzioni (--repl): diventa il corpo di una funzione
+// senza parametri, eseguita subito dopo la compilazione. Un'espressione ne
+// è anche il valore restituito, gli altri statement restituiscono 0
+static FunctionAST *TopStatement(driver &drv, RootAST *stmt) {
+  bool value = dynamic_cast<ExprAST *>(stmt) and not dynamic_cast<AssignmentAST *>(stmt)
+               and not dynamic_cast<BlockAST *>(stmt);
+  std::vector<RootAST *> body = {stmt};
+  if (not value)
+    body.insert(body.begin(), new NumberExprAST(0));  // Statements are in reverse order
+  std::string name = "repl." + std::to_string(drv.statements.size());
+  drv.statements.push_back({name, value});
+  return new FunctionAST(new PrototypeAST(name, std::vector<std::string>{}), new BlockAST(body));
+}
 }
 
 %define api.token.prefix {TOK_}
@@ -68,6 +106,7 @@
   EQ         "=="
   EXTERN     "extern"
   GLOBAL     "global"
+  PURE       "pure"
   DEF        "def"
   VAR        "var"
   IF         "if"
@@ -78,20 +117,27 @@
   AND        "and"
   OR         "or"
   NOT        "not"
+  MAPFILE    "mapfile"
+  SAVEFILE   "savefile"
+  LEN        "len"
   LSQBRACK   "["
   RSQBRACK   "]"
+  AT         "@"
+  IMPORT     "import"
 ;
 
 %token <std::string> IDENTIFIER "id"
 %token <double> NUMBER "number"
+%token <std::string> STRING "string"
 %type <ExprAST*> exp idexp initexp
-%type <std::vector<ExprAST*>> optexp explist
+%type <std::vector<ExprAST*>> optexp explist indices
 %type <RootAST*> program top stmt
 %type <std::vector<RootAST *>> stmts
 %type <FunctionAST*> definition
 %type <PrototypeAST*> external
+%type <ImportAST*> import
 %type <PrototypeAST*> proto
-%type <std::vector<std::string>> idseq
+%type <std::vector<std::pair<std::string, bool>>> params
 %type <GlobalVarAST *> globalvar
 %type <BlockAST *> block
 %type <IfExprAST *> expif
@@ -103,6 +149,8 @@
 %type <IfStatementAST *> ifstmt
 %type <ForInitAST *> init
 %type <ForStatementAST *> forstmt
+%type <std::vector<std::pair<std::string, double>>> hints
+%type <std::pair<std::string, double>> hint
 %%
 %start startsymb;
 
@@ -115,54 +163,150 @@ program:
 
 top:
 %empty                  { $$ = nullptr; }
-| definition            { $$ = $1; }
+| definition            { $$ = $1; drv.definitions.push_back($1); }
 | external              { $$ = $1; }
-| globalvar             { $$ = $1; }
+| globalvar             { $$ = $1; drv.definitions.push_back($1); }
+| import                { $$ = $1; }
+| stmt                  {
+                          if (not drv.repl) {
+                            error(@1, "statement outside of a function (allowed only with --repl)");
+                            YYERROR;
+                          }
+                          $1->setLocation(@1);
+                          $$ = TopStatement(drv, $1);
+                          $$->setLocation(@1);
+                        }
 
 definition:
-  "def" proto block       { $$ = new FunctionAST($2,$3); $2->noemit(); };
+  "def" proto block       { $$ = new FunctionAST($2,$3); $$->setLocation(@1); drv.constEval.define($$); }
+| "pure" "def" proto block
+                          { $$ = new FunctionAST($3,$4); $$->setLocation(@1); $$->memoize(); drv.constEval.define($$); }
+| "pure" "(" "number" ")" "def" proto block
+                          {
+                            if (not ($3 >= 1 and $3 <= (1 << 24))) {
+                              error(@3, "memo table size must be between 1 and 16777216");
+                              YYERROR;
+                            }
+                            $$ = new FunctionAST($6,$7); $$->setLocation(@1); $$->memoize($3); drv.constEval.define($$);
+                          };
 
 external:
-  "extern" proto        { $$ = $2; };
+  "extern" proto        { $$ = $2; drv.externs.insert(std::get<std::string>($2->getLexVal())); };
+
+import:
+  "import" "string"     {
+                          ki::Interface I;
+                          std::string msg;
+                          if (not drv.import($2, I, msg)) {
+                            error(@2, msg);
+                            YYERROR;
+                          }
+                          for (auto &fn: I.functions)
+                            drv.externs.insert(fn.name);
+                          $$ = new ImportAST($2, std::move(I));
+                        };
 
 proto:
-  "id" "(" idseq ")"    { $$ = new PrototypeAST($1,$3);  };
+  "id" "(" params ")"   { $$ = new PrototypeAST($1,$3);  };
 
 globalvar:
   "global" "id"                     { $$ = new GlobalVarAST($2); }
-| "global" "id" "[" "number" "]"    { $$ = new GlobalArrayAST($2, $4); }
-
-idseq:
-  %empty                { std::vector<std::string> args;
+| "global" "id" "=" exp             {
+                                      // L'inizializzatore è calcolato subito e diventa un dato costante
+                                      double init;
+                                      if (not drv.constEval.evaluate($4, init)) {
+                                        error(@4, "initializer of global " + $2 + " is not a constant expression");
+                                        YYERROR;
+                                      }
+                                      $$ = new GlobalVarAST($2, init);
+                                    }
+| "global" "id" indices            {
+                                      std::vector<int> dims;
+                                      if (not ConstantDims($3, dims)) {
+                                        error(@3, "the sizes of global array " + $2 + " must be positive integers");
+                                        YYERROR;
+                                      }
+                                      $$ = new GlobalArrayAST($2, dims);
+                                    }
+| "global" "id" indices "=" "{" explist "}" {
+                                      std::vector<int> dims;
+                                      if (not ConstantDims($3, dims)) {
+                                        error(@3, "the sizes of global array " + $2 + " must be positive integers");
+                                        YYERROR;
+                                      }
+                                      // Gli elementi diventano dati statici, come l'inizializzatore di uno scalare
+                                      std::vector<double> values;
+                                      for (auto exp: $6) {
+                                        values.push_back(0);
+                                        if (not drv.constEval.evaluate(exp, values.back())) {
+                                          error(@6, "initializer of global " + $2 + " is not a constant expression");
+                                          YYERROR;
+                                        }
+                                      }
+                                      size_t size = 1;
+                                      for (int dim: dims)
+                                        size *= dim;
+                                      if (values.size() != size) {
+                                        error(@6, "initializer of global " + $2 + " is not the same size as the array");
+                                        YYERROR;
+                                      }
+                                      $$ = new GlobalArrayAST($2, dims, values);
+                                    }
+
+params:
+  %empty                { std::vector<std::pair<std::string, bool>> args;
                          $$ = args; }
-| "id" idseq            { $2.insert($2.begin(),$1); $$ = $2; };
+| "id" params           { $2.insert($2.begin(), {$1, false}); $$ = $2; }
+| "id" "[" "]" params   { $4.insert($4.begin(), {$1, true}); $$ = $4; };
 
 %left ":";
 %left "<" "==";
 %left "+" "-";
 %left "*" "/";
 
+// Ogni statement ricorda la propria posizione, per le line table DWARF
 stmts:
   stmt                  { 
+                          $1->setLocation(@1);
                           std::vector<RootAST *> statements;
                           statements.push_back($1);
                           $$ = statements;
                         }
-| stmt ";" stmts        { $3.push_back($1); $$ = $3; }
+| stmt ";" stmts        { $1->setLocation(@1); $3.push_back($1); $$ = $3; }
 
 stmt:
   assignment            { $$ = $1; }
 | block                 { $$ = $1; }
 | ifstmt                { $$ = $1; }
 | forstmt               { $$ = $1; }
+| hints forstmt         {
+                          for (auto &[name, value]: $1)
+                            if (not $2->addHint(name, value)) {
+                              error(@1, "invalid loop hint @" + name);
+                              YYERROR;
+                            }
+                          // Il ciclo resta nella riga del for, non delle annotazioni
+                          @$ = @2;
+                          $$ = $2;
+                        }
 | exp                   { $$ = $1; }
+| "savefile" "(" "id" "," "string" ")"  { $$ = new SaveFileAST($3, $5); }
 
 ifstmt:
-  "if" "(" condexp ")" stmt                 { $$ = new IfStatementAST($3, $5); }
-| "if" "(" condexp ")" stmt "else" stmt     { $$ = new IfStatementAST($3, $5, $7); }
+  "if" "(" condexp ")" stmt                 { $5->setLocation(@5); $$ = new IfStatementAST($3, $5); }
+| "if" "(" condexp ")" stmt "else" stmt     { $5->setLocation(@5); $7->setLocation(@7); $$ = new IfStatementAST($3, $5, $7); }
 
 forstmt:
-  "for" "(" init ";" condexp ";" assignment ")" stmt  { $$ = new ForStatementAST($3, $5, $7, $9); }
+  "for" "(" init ";" condexp ";" assignment ")" stmt  { $9->setLocation(@9); $$ = new ForStatementAST($3, $5, $7, $9); }
+
+hints:
+  hint                  { $$ = std::vector<std::pair<std::string, double>>{$1}; }
+| hints hint            { $1.push_back($2); $$ = $1; }
+
+hint:
+  "@" "id"                          { $$ = {$2, -1}; }
+| "@" "id" "(" "number" ")"         { $$ = {$2, $4}; }
+| "@" "id" "(" "id" "=" "number" ")" { $$ = {$2 + "." + $4, $6}; }
 
 init:
   binding               { $$ = new ForInitAST($1, true); }
@@ -174,20 +318,35 @@ assignment:
 | "--" "id"             { $$ = new UnaryOperatorBaseAST($2, '-', -1); }
 | "id" "++"             { $$ = new UnaryOperatorBaseAST($1, '+', 1); }
 | "id" "--"             { $$ = new UnaryOperatorBaseAST($1, '-', 1); }
-| "id" "[" exp "]" "=" exp  { $$ = new ArrayAssignmentAST($1, $3, $6); }
+| "id" indices "=" exp  { $$ = new ArrayAssignmentAST($1, $2, $4); }
 
 block:
   "{" stmts "}"               { $$ = new BlockAST($2); }
 | "{" vardefs ";" stmts "}"   { $$ = new BlockAST($2, $4); }
 
 vardefs:
-  binding               { std::vector<VarBindingAST *> bindings; bindings.push_back($1); $$ = bindings; }
-| vardefs ";" binding   { $1.push_back($3); $$ = $1; }
+  binding               { $1->setLocation(@1); std::vector<VarBindingAST *> bindings; bindings.push_back($1); $$ = bindings; }
+| vardefs ";" binding   { $3->setLocation(@3); $1.push_back($3); $$ = $1; }
 
 binding:
   "var" "id" initexp                              { $$ = new VarBindingAST($2, $3); }
-| "var" "id" "[" "number" "]"                     { $$ = new ArrayBindingAST($2, $4); }
-| "var" "id" "[" "number" "]" "=" "{" explist "}" { $$ = new ArrayBindingAST($2, $4, $8); }
+| "var" "id" indices      {
+                            // Dimensioni costanti sono note a compile time
+                            std::vector<int> dims;
+                            if (ConstantDims($3, dims))
+                              $$ = new ArrayBindingAST($2, dims);
+                            else
+                              $$ = new DynamicArrayBindingAST($2, $3);
+                          }
+| "var" "id" indices "=" "{" explist "}" {
+                            std::vector<int> dims;
+                            if (not ConstantDims($3, dims)) {
+                              error(@3, "the sizes of an initialized array must be positive integers");
+                              YYERROR;
+                            }
+                            $$ = new ArrayBindingAST($2, dims, $6);
+                          }
+| "var" "id" "[" "]" "=" "mapfile" "(" "string" ")" { $$ = new MappedArrayBindingAST($2, $8); }
 
 exp:
   exp "+" exp           { $$ = new BinaryExprAST('+',$1,$3); }
@@ -220,14 +379,19 @@ relexp:
 
 idexp:
   "id"                  { $$ = new VariableExprAST($1); }
-| "id" "(" optexp ")"   { $$ = new CallExprAST($1,$3); };
-| "id" "[" exp "]"      { $$ = new ArrayExprAST($1, $3); }
+| "id" "(" optexp ")"   { $$ = new CallExprAST($1,$3); $$->setLocation(@1); };
+| "id" indices          { $$ = new ArrayExprAST($1, $2); }
+| "len" "(" "id" ")"    { $$ = new ArrayLengthAST($3); }
 
 optexp:
   %empty                { std::vector<ExprAST*> args;
 			 $$ = args; }
 | explist               { $$ = $1; };
 
+indices:
+  "[" exp "]"           { std::vector<ExprAST*> idx; idx.push_back($2); $$ = idx; }
+| indices "[" exp "]"   { $1.push_back($3); $$ = $1; };
+
 explist:
   exp                   {
                           std::vector<ExprAST*> args;
@@ -241,5 +405,10 @@ explist:
 void
 yy::parser::error (const location_type& l, const std::string& m)
 {
-  std::cerr << l << ": " << m << '\n';
+  std::ostringstream message;
+  message << l << ": " << m << '\n';
+  if (diagnostics)
+    *diagnostics += message.str();
+  else
+    std::cerr << message.str();
 }
@@ -0,0 +1,364 @@
+#include "perfreport.hpp"
+
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/MC/MCAsmInfo.h"
+#include "llvm/MC/MCContext.h"
+#include "llvm/MC/MCInstrAnalysis.h"
+#include "llvm/MC/MCObjectFileInfo.h"
+#include "llvm/MC/MCParser/MCAsmParser.h"
+#include "llvm/MC/MCParser/MCTargetAsmParser.h"
+#include "llvm/MC/MCStreamer.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/MCA/Context.h"
+#include "llvm/MCA/CustomBehaviour.h"
+#include "llvm/MCA/HWEventListener.h"
+#include "llvm/MCA/InstrBuilder.h"
+#include "llvm/MCA/Pipeline.h"
+#include "llvm/MCA/SourceMgr.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include <algorithm>
+#include <map>
+
+using namespace llvm;
+
+namespace {
+
+/*********************** Loops in the assembly ********************/
+/// Ciclo più interno del codice generato
+struct AsmLoop {
+  std::string function;
+  std::string header;           // < Etichetta del blocco header (BB0_2)
+  std::string block;            // < Nome dell'header nell'IR (body, vector.body...)
+  std::string latchLocation;    // < Riga del salto all'header: la condizione del for
+  std::string firstLocation;
+  bool innermost = false;
+  std::vector<std::string> instructions;
+};
+
+/// Assembly del modulo, con i commenti di AsmPrinter sulla struttura dei
+/// cicli ("=>This Inner Loop Header", "in Loop: Header=BB0_2") e le
+/// direttive .loc delle line table
+bool Assembly(Module &M, TargetMachine &TM, std::string &assembly) {
+  //  The code generator changes the IR, which is printed afterwards
+  std::unique_ptr<Module> clone = CloneModule(M);
+  raw_string_ostream text(assembly);
+  buffer_ostream out(text);
+
+  bool verbose = TM.Options.MCOptions.AsmVerbose;
+  TM.Options.MCOptions.AsmVerbose = true;
+  legacy::PassManager PM;
+  bool failed = TM.addPassesToEmitFile(PM, out, nullptr, CGFT_AssemblyFile);
+  if (not failed)
+    PM.run(*clone);
+  TM.Options.MCOptions.AsmVerbose = verbose;
+  return not failed;
+}
+
+//  The comment string depends on the target: # on x86, // on AArch64, where
+//  # marks the immediates
+std::vector<AsmLoop> FindLoops(StringRef assembly, StringRef privatePrefix, StringRef commentString) {
+  std::map<std::string, AsmLoop> loops;   // < Per funzione e header
+  std::vector<std::string> order;
+  std::map<std::string, std::string> files;
+  std::string function, block, blockName, location;
+  AsmLoop *current = nullptr;
+
+  auto loopOf = [&](const std::string &header) -> AsmLoop * {
+    auto [entry, inserted] = loops.try_emplace(function + ":" + header);
+    if (inserted) {
+      entry->second.function = function;
+      entry->second.header = header;
+      order.push_back(entry->first);
+    }
+    return &entry->second;
+  };
+
+  SmallVector<StringRef, 0> lines;
+  assembly.split(lines, '\n');
+  for (StringRef line: lines) {
+    auto [text, comment] = line.split(commentString);
+    text = text.trim();
+    comment = comment.trim();
+
+    //  Blocks reached only by fall through have no label, just a comment
+    if (text.empty() and comment.startswith("%bb.") and comment.contains(':')) {
+      std::tie(text, comment) = comment.split(commentString);
+      text = text.trim();
+      comment = comment.trim();
+      block = "";
+      blockName = comment.startswith("%") ? comment.drop_front().str() : "";
+      current = nullptr;
+    }
+    else if (text.endswith(":")) {
+      StringRef label = text.drop_back();
+      if (label.consume_front(privatePrefix)) {
+        //  Other local labels (.Ltmp, constant pools) are not blocks
+        if (label.startswith("BB")) {
+          block = label.str();
+          blockName = comment.startswith("%") ? comment.drop_front().str() : "";
+          current = nullptr;
+        }
+        else if (label.startswith("func_end"))
+          current = nullptr;
+      }
+      else if (not label.startswith(".")) {
+        function = label.str();
+        current = nullptr;
+      }
+    }
+
+    //  Loop comments follow the label of the block, one per line
+    if (comment.contains("This Inner Loop Header")) {
+      current = loopOf(block);
+      current->innermost = true;
+      current->block = blockName;
+    }
+    else if (comment.contains("This Loop Header"))
+      current = nullptr;
+    else if (size_t at = comment.find("in Loop: Header="); at != StringRef::npos)
+      current = loopOf(comment.drop_front(at + 16).split(' ').first.str());
+
+    if (text.startswith(".file")) {
+      //  .file 1 "directory" "name", or just .file 1 "name"
+      SmallVector<StringRef, 4> fields;
+      text.split(fields, '"');
+      unsigned id;
+      if (fields.size() >= 3 and not fields[0].drop_front(5).trim().getAsInteger(10, id))
+        files[std::to_string(id)] = fields[fields.size() - 2].str();
+    }
+    else if (text.startswith(".loc")) {
+      SmallVector<StringRef, 4> fields;
+      text.drop_front(4).split(fields, ' ', -1, false);
+      if (fields.size() >= 2)
+        location = files[fields[0].trim().str()] + ":" + fields[1].trim().str();
+    }
+    else if (current and not text.empty() and not text.endswith(":") and not text.startswith(".")) {
+      current->instructions.push_back(text.str());
+      if (current->firstLocation.empty())
+        current->firstLocation = location;
+      //  The branch back to the header is the loop condition, emitted
+      //  with the location of the for statement
+      if (not current->header.empty() and text.endswith(current->header))
+        current->latchLocation = location;
+    }
+  }
+
+  std::vector<AsmLoop> innermost;
+  for (auto &key: order)
+    if (loops[key].innermost and not loops[key].instructions.empty())
+      innermost.push_back(std::move(loops[key]));
+  return innermost;
+}
+
+/************************* MCA simulation *************************/
+/// Raccoglie le istruzioni lette dall'assembler, senza emettere nulla
+class InstCollector: public MCStreamer {
+  public:
+  std::vector<MCInst> instructions;
+
+  explicit InstCollector(MCContext &Ctx): MCStreamer(Ctx) {}
+
+  void emitInstruction(const MCInst &Inst, const MCSubtargetInfo &STI) override {
+    instructions.push_back(Inst);
+  }
+  bool emitSymbolAttribute(MCSymbol *Symbol, MCSymbolAttr Attribute) override { return true; }
+  void emitCommonSymbol(MCSymbol *Symbol, uint64_t Size, Align ByteAlignment) override {}
+  void emitZerofill(MCSection *Section, MCSymbol *Symbol, uint64_t Size, Align ByteAlignment,
+                    SMLoc Loc) override {}
+};
+
+/// Statistiche della simulazione: uso delle porte, cause degli stalli e
+/// registri fisici occupati
+class LoopStatistics: public mca::HWEventListener {
+  private:
+  bool resourcePressure = false, registerPressure = false, memoryPressure = false;
+
+  void track(ArrayRef<unsigned> registers, int sign) {
+    if (inUse.size() < registers.size()) {
+      inUse.resize(registers.size());
+      maxInUse.resize(registers.size());
+    }
+    for (unsigned i = 0; i < registers.size(); i++) {
+      inUse[i] += sign * (int)registers[i];
+      maxInUse[i] = std::max(maxInUse[i], inUse[i]);
+    }
+  }
+
+  public:
+  std::map<std::pair<unsigned, unsigned>, double> portCycles; // < (risorsa, unità)
+  unsigned cycles = 0, resourceCycles = 0, registerCycles = 0, memoryCycles = 0;
+  std::vector<int> inUse, maxInUse;   // < Per register file
+
+  void onEvent(const mca::HWInstructionEvent &Event) override {
+    if (Event.Type == mca::HWInstructionEvent::Issued) {
+      auto &issued = static_cast<const mca::HWInstructionIssuedEvent &>(Event);
+      //  The resources are processor resource indices, with a mask of the units
+      for (auto &[resource, used]: issued.UsedResources)
+        portCycles[{resource.first, countTrailingZeros(resource.second)}] += double(used);
+    }
+    else if (Event.Type == mca::HWInstructionEvent::Dispatched)
+      track(static_cast<const mca::HWInstructionDispatchedEvent &>(Event).UsedPhysRegs, 1);
+    else if (Event.Type == mca::HWInstructionEvent::Retired)
+      track(static_cast<const mca::HWInstructionRetiredEvent &>(Event).FreedPhysRegs, -1);
+  }
+
+  void onEvent(const mca::HWPressureEvent &Event) override {
+    if (Event.Reason == mca::HWPressureEvent::RESOURCES)
+      resourcePressure = true;
+    else if (Event.Reason == mca::HWPressureEvent::REGISTER_DEPS)
+      registerPressure = true;
+    else if (Event.Reason == mca::HWPressureEvent::MEMORY_DEPS)
+      memoryPressure = true;
+  }
+
+  void onCycleEnd() override {
+    cycles++;
+    resourceCycles += resourcePressure;
+    registerCycles += registerPressure;
+    memoryCycles += memoryPressure;
+    resourcePressure = registerPressure = memoryPressure = false;
+  }
+};
+
+/// Parsing delle istruzioni del ciclo (in sintassi assembly) in MCInst
+bool ParseLoop(const AsmLoop &loop, TargetMachine &TM, std::vector<MCInst> &instructions) {
+  const Target &T = TM.getTarget();
+  SourceMgr SrcMgr;
+  SrcMgr.AddNewSourceBuffer(MemoryBuffer::getMemBufferCopy(join(loop.instructions, "\n") + "\n"), SMLoc());
+  //  Errors are reported with the loop, not on the console
+  SrcMgr.setDiagHandler([](const SMDiagnostic &, void *) {});
+
+  MCContext Ctx(TM.getTargetTriple(), TM.getMCAsmInfo(), TM.getMCRegisterInfo(), TM.getMCSubtargetInfo(), &SrcMgr);
+  std::unique_ptr<MCObjectFileInfo> MOFI(T.createMCObjectFileInfo(Ctx, false));
+  Ctx.setObjectFileInfo(MOFI.get());
+
+  InstCollector collector(Ctx);
+  std::unique_ptr<MCAsmParser> parser(createMCAsmParser(SrcMgr, Ctx, collector, *TM.getMCAsmInfo()));
+  std::unique_ptr<MCTargetAsmParser> TAP(T.createMCAsmParser(*TM.getMCSubtargetInfo(), *parser,
+                                                             *TM.getMCInstrInfo(), TM.Options.MCOptions));
+  if (not TAP)
+    return false;
+  parser->setTargetParser(*TAP);
+  //  Not finalized: the branch targets outside the loop are undefined
+  if (parser->Run(false, true))
+    return false;
+  instructions = std::move(collector.instructions);
+  return true;
+}
+
+void Simulate(const AsmLoop &loop, TargetMachine &TM, MCInstrAnalysis *MCIA, unsigned iterations,
+              raw_ostream &out) {
+  const MCSubtargetInfo &STI = *TM.getMCSubtargetInfo();
+  const MCInstrInfo &MCII = *TM.getMCInstrInfo();
+  const MCRegisterInfo &MRI = *TM.getMCRegisterInfo();
+  const MCSchedModel &SM = STI.getSchedModel();
+
+  const std::string &location = loop.latchLocation.empty() ? loop.firstLocation : loop.latchLocation;
+  out << (location.empty() ? "<unknown>" : location) << ": loop in " << loop.function;
+  if (not loop.block.empty())
+    out << " (" << loop.block << ")";
+
+  std::vector<MCInst> instructions;
+  if (not ParseLoop(loop, TM, instructions)) {
+    out << ": cannot parse the generated code\n";
+    return;
+  }
+
+  mca::Context MCA(MRI, STI);
+  mca::InstrumentManager IM(STI, MCII);
+  mca::InstrBuilder IB(STI, MCII, MRI, MCIA, IM);
+  std::vector<std::unique_ptr<mca::Instruction>> sequence;
+  unsigned uops = 0;
+  for (const MCInst &inst: instructions) {
+    Expected<std::unique_ptr<mca::Instruction>> lowered = IB.createInstruction(inst, {});
+    if (not lowered) {
+      out << ": " << toString(lowered.takeError()) << "\n";
+      return;
+    }
+    uops += (*lowered)->getDesc().NumMicroOps;
+    sequence.push_back(std::move(*lowered));
+  }
+
+  mca::CircularSourceMgr source(sequence, iterations);
+  mca::CustomBehaviour CB(STI, source, MCII);
+  mca::PipelineOptions PO(0, 0, 0, 0, 0, 0, /*NoAlias=*/true, /*BottleneckAnalysis=*/true);
+  std::unique_ptr<mca::Pipeline> pipeline = MCA.createDefaultPipeline(PO, source, CB);
+  LoopStatistics stats;
+  pipeline->addEventListener(&stats);
+  Expected<unsigned> total = pipeline->run();
+  if (not total) {
+    out << ": " << toString(total.takeError()) << "\n";
+    return;
+  }
+
+  double perIteration = double(*total) / iterations;
+  out << format(": %zu instructions, %u uops, %.2f cycles/iteration, IPC %.2f\n", sequence.size(), uops,
+                perIteration, sequence.size() / perIteration);
+
+  //  The busiest execution ports bound the throughput
+  std::vector<std::pair<double, std::string>> ports;
+  for (auto &[port, used]: stats.portCycles) {
+    const MCProcResourceDesc *resource = SM.getProcResource(port.first);
+    std::string name = resource->Name;
+    if (resource->NumUnits > 1)
+      name += "." + std::to_string(port.second);
+    ports.push_back({used / iterations, name});
+  }
+  std::sort(ports.rbegin(), ports.rend());
+  out << "    busiest ports:";
+  for (unsigned i = 0; i < ports.size() and i < 3; i++)
+    out << format(" %s %.2f", ports[i].second.c_str(), ports[i].first);
+  out << " cycles/iteration\n";
+
+  if (stats.cycles) {
+    auto percent = [&](unsigned n) { return 100.0 * n / stats.cycles; };
+    out << format("    pressure: resources %.0f%%, register dependencies %.0f%%, memory dependencies %.0f%% of cycles\n",
+                  percent(stats.resourceCycles), percent(stats.registerCycles), percent(stats.memoryCycles));
+  }
+
+  //  Register file 0 stands for all the registers of the target; the
+  //  others, if any, are described by the scheduling model
+  out << "    physical registers in use:";
+  if (SM.hasExtraProcessorInfo() and stats.maxInUse.size() > 1) {
+    const MCExtraProcessorInfo &PI = SM.getExtraProcessorInfo();
+    for (unsigned i = 1; i < stats.maxInUse.size() and i < PI.NumRegisterFiles; i++) {
+      out << " " << PI.RegisterFiles[i].Name << " " << stats.maxInUse[i];
+      if (PI.RegisterFiles[i].NumPhysRegs)
+        out << "/" << PI.RegisterFiles[i].NumPhysRegs;
+    }
+  }
+  else
+    out << " " << (stats.maxInUse.empty() ? 0 : stats.maxInUse[0]);
+  out << "\n";
+}
+
+} // namespace
+
+bool perfReport(Module &M, TargetMachine &TM, raw_ostream &out, unsigned iterations) {
+  const MCSchedModel &SM = TM.getMCSubtargetInfo()->getSchedModel();
+  if (not SM.hasInstrSchedModel()) {
+    errs() << "--perf-report: no scheduling model for CPU " << TM.getTargetCPU() << "\n";
+    return false;
+  }
+
+  std::string assembly;
+  if (not Assembly(M, TM, assembly)) {
+    errs() << "--perf-report: cannot generate code for " << TM.getTargetTriple().str() << "\n";
+    return false;
+  }
+
+  std::unique_ptr<MCInstrAnalysis> MCIA(TM.getTarget().createMCInstrAnalysis(TM.getMCInstrInfo()));
+  const MCAsmInfo *MAI = TM.getMCAsmInfo();
+  std::vector<AsmLoop> loops = FindLoops(assembly, MAI->getPrivateLabelPrefix(), MAI->getCommentString());
+  out << "Loop throughput on " << TM.getTargetCPU() << " (" << iterations << " iterations per loop)\n";
+  if (loops.empty())
+    out << "No loops in the generated code\n";
+  for (auto &loop: loops)
+    Simulate(loop, TM, MCIA.get(), iterations, out);
+  return true;
+}
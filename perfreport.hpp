@@ -0,0 +1,24 @@
+#ifndef PERFREPORT_HPP
+#define PERFREPORT_HPP
+/**
+ * Stima statica delle prestazioni dei cicli generati (--perf-report).
+ *
+ * Il modulo ottimizzato viene tradotto in assembly per la CPU di TM; per ogni
+ * ciclo più interno (i corpi dei for, eventualmente vettorizzati) le
+ * istruzioni sono simulate da LLVM MCA, il modello della pipeline usato da
+ * llvm-mca. Il report indica per ciascun ciclo, con la riga del for nel
+ * sorgente .k: istruzioni e micro-op per iterazione, cicli per iterazione,
+ * le porte di esecuzione più cariche, la causa prevalente degli stalli e
+ * il numero massimo di registri fisici in uso.
+ * La stima non dipende dalla macchina su cui gira kcomp, ma solo dal
+ * modello di scheduling della CPU scelta (-mcpu).
+ */
+#include "llvm/IR/Module.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+
+/// Scrive il report su out. Restituisce false (dopo aver stampato un errore)
+/// se la CPU non ha un modello di scheduling o la generazione del codice fallisce
+bool perfReport(llvm::Module &M, llvm::TargetMachine &TM, llvm::raw_ostream &out, unsigned iterations = 100);
+
+#endif // ! PERFREPORT_HPP
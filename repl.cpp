@@ -0,0 +1,440 @@
+#include "repl.hpp"
+#include "driver.hpp"
+#include "transforms.hpp"
+
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+
+using namespace llvm::orc;
+
+extern LLVMContext *context;
+extern Module *module;
+extern IRBuilder<> *builder;
+
+namespace {
+
+/// Funzione definita (o dichiarata extern) da una riga precedente
+struct ReplFunction {
+  FunctionType *type;
+  bool defined;   // < Definita nella sessione: chiamata attraverso il suo stub
+  bool pure;      // < Può essere chiamata da altre funzioni pure
+};
+
+/// Variabile globale: la memoria è della sessione, non del modulo che la definisce
+struct ReplGlobal {
+  Type *type;
+  char *data;     // < nullptr per le globali importate, definite nel processo
+  size_t size;
+};
+
+/// Tabella di memoizzazione di una funzione pure
+struct MemoTable {
+  void *data;
+  size_t size;
+};
+
+class Session {
+  private:
+  driver &drv;
+  unsigned optLevel;
+  ThreadSafeContext tsc;          // < Condiviso da tutti i moduli: i tipi restano validi
+  IRBuilder<> irb;
+  std::unique_ptr<TargetMachine> target;
+  std::unique_ptr<LLJIT> jit;
+  std::unique_ptr<IndirectStubsManager> stubs;
+  JITDylib *symbols;              // < Stub, globali e simboli del processo
+  JITDylib *transient;            // < Righe di soli statement, rimosse dopo l'esecuzione
+  std::map<std::string, ReplFunction> functions;
+  std::map<std::string, ReplGlobal> globals;
+  std::vector<MemoTable> memoTables;
+  unsigned entries;
+
+  public:
+  Session(driver &drv, unsigned optLevel);
+  ~Session();
+
+  /// Compila ed esegue il sorgente letto da parse (drv.parse o drv.parse_string)
+  bool run(const std::function<int ()> &parse);
+
+  private:
+  GlobalValue *declare(const std::string &name);
+  bool install(std::unique_ptr<Module> M, unsigned entry);
+};
+
+Session::Session(driver &drv, unsigned optLevel): drv(drv), optLevel(optLevel),
+  tsc(std::make_unique<LLVMContext>()), irb(*tsc.getContext()), symbols(nullptr),
+  transient(nullptr), entries(0) {
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+
+  auto JTMB = cantFail(JITTargetMachineBuilder::detectHost());
+  //  Without -O the latency of a line is what matters, not the speed of its code
+  JTMB.setCodeGenOptLevel(optLevel ? CodeGenOpt::Default : CodeGenOpt::None);
+  target = cantFail(JTMB.createTargetMachine());
+  LLJITBuilder jitBuilder;
+  jitBuilder.setJITTargetMachineBuilder(std::move(JTMB));
+  jit = cantFail(jitBuilder.create());
+
+  stubs = createLocalIndirectStubsManagerBuilder(target->getTargetTriple())();
+  symbols = &cantFail(jit->createJITDylib("repl.symbols"));
+  symbols->addGenerator(cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
+    jit->getDataLayout().getGlobalPrefix())));
+  transient = &cantFail(jit->createJITDylib("repl.transient"));
+  transient->addToLinkOrder(*symbols);
+
+  drv.repl = true;
+  drv.declare = [this](const std::string &name) { return declare(name); };
+}
+
+Session::~Session() {
+  drv.declare = nullptr;
+  for (auto &[name, var]: globals)
+    free(var.data);
+}
+
+/* Dichiarazione, nel modulo della riga corrente, di una funzione o di una
+   globale definita da una riga precedente. Le funzioni della sessione sono
+   risolte nei loro stub, le globali nella memoria della sessione */
+GlobalValue *Session::declare(const std::string &name) {
+  if (auto fn = functions.find(name); fn != functions.end()) {
+    Function *F = Function::Create(fn->second.type, Function::ExternalLinkage, name, *module);
+    if (fn->second.pure)
+      drv.memoized.insert(F);
+    return F;
+  }
+  if (auto var = globals.find(name); var != globals.end()) {
+    auto *G = new GlobalVariable(*module, var->second.type, false, GlobalValue::ExternalLinkage, nullptr, name);
+    if (var->second.type->isArrayTy())
+      G->setAlignment(Align(drv.arrayAlign));
+    return G;
+  }
+  return nullptr;
+}
+
+/// Copia in data il valore di C, una costante double o un array (anche annidato) di double
+void StoreConstant(const Constant *C, char *data, const DataLayout &DL) {
+  if (C->isNullValue())
+    return;   // The storage is already zeroed
+  if (auto *FP = dyn_cast<ConstantFP>(C)) {
+    double value = FP->getValueAPF().convertToDouble();
+    memcpy(data, &value, sizeof value);
+  } else if (auto *seq = dyn_cast<ConstantDataSequential>(C)) {
+    for (unsigned i = 0; i < seq->getNumElements(); i++) {
+      double value = seq->getElementAsDouble(i);
+      memcpy(data + i * sizeof value, &value, sizeof value);
+    }
+  } else if (auto *array = dyn_cast<ConstantArray>(C)) {
+    uint64_t stride = DL.getTypeAllocSize(array->getType()->getElementType());
+    for (unsigned i = 0; i < array->getNumOperands(); i++)
+      StoreConstant(array->getOperand(i), data + i * stride, DL);
+  }
+}
+
+bool Session::run(const std::function<int ()> &parse) {
+  unsigned entry = entries++;
+  auto mod = std::make_unique<Module>("repl." + std::to_string(entry), *tsc.getContext());
+  mod->setDataLayout(jit->getDataLayout());
+  mod->setTargetTriple(target->getTargetTriple().str());
+
+  //  Same path as the command line compiler, on a module of this line only
+  //  (see Engine::build)
+  LLVMContext *savedContext = context;
+  Module *savedModule = module;
+  IRBuilder<> *savedBuilder = builder;
+  context = tsc.getContext();
+  module = mod.get();
+  builder = &irb;
+
+  //  Wrappers of other modules, which no longer exist. Only the functions
+  //  of this line are evaluated at compile time: a call folded into a
+  //  constant would not see a later redefinition of the callee
+  drv.memoized.clear();
+  drv.constEval.clear();
+  bool failed = parse() != 0;
+  if (not failed)
+    drv.codegen();
+
+  context = savedContext;
+  module = savedModule;
+  builder = savedBuilder;
+  if (failed)
+    return false;
+
+  //  A definition that fails is removed from the module, after its error
+  //  message: the rest of the line is compiled anyway
+  for (RootAST *def: drv.definitions) {
+    if (auto *F = dynamic_cast<FunctionAST *>(def)) {
+      Function *fn = mod->getFunction(F->getName());
+      failed |= not fn or fn->isDeclaration();
+    } else if (auto *G = dynamic_cast<GlobalVarAST *>(def)) {
+      GlobalVariable *var = mod->getGlobalVariable(G->getName());
+      failed |= not var or var->isDeclaration();
+    }
+  }
+  //  Statements that fail are not run
+  size_t statements = drv.statements.size();
+  drv.statements.erase(std::remove_if(drv.statements.begin(), drv.statements.end(),
+                                      [&](auto &statement) { return not mod->getFunction(statement.first); }),
+                       drv.statements.end());
+  failed |= drv.statements.size() != statements;
+
+  std::string verifierErrors;
+  raw_string_ostream verifierStream(verifierErrors);
+  bool installed = false;
+  if (verifyModule(*mod, &verifierStream))
+    errs() << "invalid module: " << verifierStream.str() << "\n";
+  else
+    installed = install(std::move(mod), entry);
+  return installed and not failed;
+}
+
+/**
+ * Links the module of a line into the session: its globals move to the
+ * memory of the session, its functions are renamed name.N and reached
+ * through the stub name, then the module is compiled in its own JITDylib
+ * and the statements are run.
+ */
+bool Session::install(std::unique_ptr<Module> M, unsigned entry) {
+  const DataLayout &DL = M->getDataLayout();
+  std::set<std::string> statements;
+  for (auto &[name, value]: drv.statements)
+    statements.insert(name);
+
+  //  Checks first: a line that would change the type of a global or the
+  //  purity of a function is not installed at all
+  std::vector<GlobalVariable *> defined;
+  for (GlobalVariable &G: M->globals()) {
+    if (G.isDeclaration() or not (G.hasExternalLinkage() or G.hasCommonLinkage()))
+      continue;
+    auto known = globals.find(G.getName().str());
+    if (known != globals.end() and (known->second.type != G.getValueType() or not known->second.data)) {
+      errs() << "Global variable " << G.getName() << " already defined\n";
+      return false;
+    }
+    defined.push_back(&G);
+  }
+  //  The module is gone after compilation: what is needed later is copied here
+  struct Definition {
+    std::string name;
+    Function *body;
+    FunctionType *type;
+    size_t memoSize;    // < Bytes of the memo table, 0 if not pure
+  };
+  std::vector<Definition> functionDefs;
+  for (Function &F: *M) {
+    std::string name = F.getName().str();
+    if (F.isDeclaration() or not F.hasExternalLinkage() or statements.count(name))
+      continue;
+    //  Only pure functions have a memoized body, name.impl
+    bool pure = M->getFunction(name + ".impl");
+    auto known = functions.find(name);
+    if (known != functions.end() and known->second.pure and not pure) {
+      errs() << "Function " << name << " is declared pure, it can only be redefined as pure\n";
+      return false;
+    }
+    functionDefs.push_back({name, &F, F.getFunctionType(), 0});
+  }
+
+  //  Globals: the definitions become declarations, resolved (by absolute
+  //  symbols) in memory owned by the session. A redefinition resets the value
+  SymbolMap absolute;
+  for (GlobalVariable *G: defined) {
+    std::string name = G->getName().str();
+    auto [var, inserted] = globals.insert({name, {G->getValueType(), nullptr, 0}});
+    if (inserted) {
+      size_t align = std::max<size_t>(drv.arrayAlign, alignof(double));
+      var->second.size = alignTo(DL.getTypeAllocSize(G->getValueType()), align);
+      var->second.data = static_cast<char *>(aligned_alloc(align, var->second.size));
+      absolute[jit->mangleAndIntern(name)] = JITEvaluatedSymbol(pointerToJITTargetAddress(var->second.data),
+                                                                 JITSymbolFlags::Exported);
+    }
+    memset(var->second.data, 0, var->second.size);
+    StoreConstant(G->getInitializer(), var->second.data, DL);
+    G->setInitializer(nullptr);
+    G->setLinkage(GlobalValue::ExternalLinkage);
+  }
+  //  Globals declared by an import live in the process
+  for (GlobalVariable &G: M->globals())
+    if (G.isDeclaration() and G.hasExternalLinkage())
+      globals.insert({G.getName().str(), {G.getValueType(), nullptr, 0}});
+
+  //  Functions: name.N is the body defined by this line. Calls from other
+  //  functions go through the stub, so that they see later definitions too;
+  //  the recursive ones (also from the memoized body) stay direct
+  bool purge = false;
+  for (auto &[name, F, type, memoSize]: functionDefs) {
+    auto known = functions.find(name);
+    purge |= known != functions.end() and known->second.defined;
+    F->setName(name + "." + std::to_string(entry));
+    Function *stub = Function::Create(F->getFunctionType(), Function::ExternalLinkage, name, *M);
+    for (Use &U: make_early_inc_range(F->uses()))
+      if (auto *I = dyn_cast<Instruction>(U.getUser()))
+        if (Function *user = I->getFunction(); user != F and user->getName() != name + ".impl")
+          U.set(stub);
+
+    if (not stubs->findStub(name, false)) {
+      if (Error err = stubs->createStub(name, 0, JITSymbolFlags::Exported | JITSymbolFlags::Callable)) {
+        errs() << toString(std::move(err)) << "\n";
+        return false;
+      }
+      absolute[jit->mangleAndIntern(name)] = stubs->findStub(name, false);
+    }
+    //  The memo table is looked up after compilation, to be cleared
+    if (GlobalVariable *table = M->getGlobalVariable(name + ".memo", true)) {
+      table->setLinkage(GlobalValue::ExternalLinkage);
+      memoSize = DL.getTypeAllocSize(table->getValueType());
+    }
+  }
+  if (not absolute.empty())
+    cantFail(symbols->define(absoluteSymbols(std::move(absolute))));
+
+  //  Declarations of extern functions (and of imported ones), resolved in the process
+  for (const std::string &name: drv.externs)
+    if (Function *F = M->getFunction(name); F and (F->isDeclaration() or F->hasAvailableExternallyLinkage())
+        and not functions.count(name))
+      functions[name] = {F->getFunctionType(), false, false};
+
+  optimize(*M, optLevel, target.get());
+
+  //  A line made only of statements is dropped after running them, by its
+  //  resource tracker: removing a whole JITDylib takes longer the more of
+  //  them exist, that is the more lines defined something. The definitions
+  //  stay with the default tracker of their JITDylib: a tracker released
+  //  while still alive would move its code to it
+  JITDylib *JD = transient;
+  if (not functionDefs.empty()) {
+    auto dylib = jit->createJITDylib("repl." + std::to_string(entry));
+    if (not dylib) {
+      errs() << toString(dylib.takeError()) << "\n";
+      return false;
+    }
+    JD = &*dylib;
+    JD->addToLinkOrder(*symbols);
+  }
+  ResourceTrackerSP tracker = functionDefs.empty() ? JD->createResourceTracker() : JD->getDefaultResourceTracker();
+  if (Error err = jit->addIRModule(tracker, ThreadSafeModule(std::move(M), tsc))) {
+    errs() << toString(std::move(err)) << "\n";
+    cantFail(tracker->remove());
+    return false;
+  }
+
+  //  The first lookup compiles the whole module
+  for (auto &[name, F, type, memoSize]: functionDefs) {
+    auto addr = jit->lookup(*JD, name + "." + std::to_string(entry));
+    if (not addr) {
+      errs() << toString(addr.takeError()) << "\n";
+      return false;
+    }
+    cantFail(stubs->updatePointer(name, pointerToJITTargetAddress(addr->toPtr<void *>())));
+    functions[name] = {type, true, memoSize > 0};
+    if (memoSize) {
+      auto table = jit->lookup(*JD, name + ".memo");
+      if (not table) {
+        errs() << toString(table.takeError()) << "\n";
+        return false;
+      }
+      memoTables.push_back({table->toPtr<void *>(), memoSize});
+    }
+  }
+
+  //  A pure function may call the one just redefined, directly or through
+  //  other functions: the results memoized with the old definition are no
+  //  longer valid, whatever function was redefined
+  if (purge)
+    for (MemoTable &table: memoTables)
+      memset(table.data, 0, table.size);
+
+  bool ok = true;
+  for (auto &[name, value]: drv.statements) {
+    auto addr = jit->lookup(*JD, name);
+    if (not addr) {
+      errs() << toString(addr.takeError()) << "\n";
+      ok = false;
+      continue;
+    }
+    outs().flush();
+    double result = reinterpret_cast<double (*)()>(addr->toPtr<void *>())();
+    fflush(stdout);
+    if (value)
+      outs() << format("%.15g", result) << "\n";
+  }
+  outs().flush();
+
+  if (functionDefs.empty())
+    cantFail(tracker->remove());
+  return ok;
+}
+
+/* Una riga è completa quando le parentesi sono chiuse e non termina con un
+   operatore binario o con l'intestazione di una funzione (il corpo segue
+   nella riga successiva) */
+bool Complete(const std::string &text) {
+  int depth = 0;
+  bool quoted = false;
+  for (char c: text)
+    if (c == '"')
+      quoted = not quoted;
+    else if (not quoted and (c == '(' or c == '{' or c == '['))
+      depth++;
+    else if (not quoted and (c == ')' or c == '}' or c == ']'))
+      depth--;
+  if (depth > 0 or quoted)
+    return false;
+
+  StringRef line = StringRef(text).trim();
+  if (line.endswith("++") or line.endswith("--"))
+    return true;
+  if (not line.empty() and strchr("+-*/=<,?:", line.back()))
+    return false;
+  return not ((line.startswith("def") or line.startswith("pure")) and not line.contains('{'));
+}
+
+} // namespace
+
+int runRepl(driver &drv, unsigned optLevel, const std::vector<std::string> &files) {
+  Session session(drv, optLevel);
+  int res = 0;
+  for (const std::string &file: files)
+    if (not session.run([&] { return drv.parse(file); }))
+      res = 1;
+
+  //  Every top item needs its ";": one more is always appended, since an
+  //  empty item is valid too
+  bool interactive = isatty(STDIN_FILENO);
+  std::string text, line;
+  for (;;) {
+    if (interactive)
+      outs() << (text.empty() ? "kcomp> " : "   ..> ");
+    outs().flush();
+    if (not std::getline(std::cin, line))
+      break;
+    text += line + "\n";
+    if (not Complete(text))
+      continue;
+    if (not StringRef(text).trim().empty()) {
+      text += ";";
+      if (not session.run([&] { return drv.parse_string(text, "<stdin>"); }) and not interactive)
+        res = 1;
+    }
+    text.clear();
+  }
+  if (not StringRef(text).trim().empty()) {
+    text += ";";
+    if (not session.run([&] { return drv.parse_string(text, "<stdin>"); }))
+      res = 1;
+  }
+  if (interactive)
+    outs() << "\n";
+  return res;
+}
@@ -0,0 +1,43 @@
+#ifndef REPL_HPP
+#define REPL_HPP
+/**
+ * Sessione interattiva (kcomp --repl): definizioni, variabili globali,
+ * import e statement vengono letti da stdin, compilati just in time ed
+ * eseguiti man mano che arrivano.
+ *
+ *   kcomp> def f(x) { x*x + 1 };
+ *   kcomp> f(3);
+ *   10
+ *   kcomp> def f(x) { x*x - 1 };
+ *   kcomp> f(3);
+ *   8
+ *
+ * Ogni riga (o gruppo di righe, finché le parentesi non sono chiuse) è un
+ * modulo a sé, compilato nel proprio JITDylib (le righe di soli statement
+ * in uno comune, da cui vengono rimosse dopo l'esecuzione): il costo di una
+ * riga non dipende da quante definizioni la precedono. Le funzioni definite nella
+ * sessione sono chiamate attraverso uno stub (un salto indiretto): una
+ * nuova definizione aggiorna solo il puntatore dello stub, e il codice già
+ * compilato che la chiama usa da subito quella nuova, senza essere
+ * ricompilato. I parametri di una funzione ridefinita non possono cambiare.
+ * Le variabili globali sono allocate dalla sessione: ridefinirle (con la
+ * stessa dimensione) ne reimposta il valore.
+ *
+ * Uno statement fuori dalle funzioni viene eseguito subito; il valore di
+ * un'espressione è stampato su stdout.
+ */
+#include <string>
+#include <vector>
+
+class driver;
+
+/**
+ * Carica i sorgenti files, poi legge stdin fino a EOF (con un prompt se è un
+ * terminale). Le opzioni di drv (-g, -finstrument, --array-align) valgono
+ * per tutta la sessione; optLevel è il livello di ottimizzazione di ogni
+ * riga. Restituisce 1 se un sorgente, o una riga letta da un file o da una
+ * pipe, contiene errori.
+ */
+int runRepl(driver &drv, unsigned optLevel, const std::vector<std::string> &files);
+
+#endif // ! REPL_HPP
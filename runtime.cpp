@@ -0,0 +1,570 @@
+#include "runtime.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*************************** Timer ********************************/
+double clock_ns() {
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+
+/*********************** Buffered output **************************/
+namespace {
+
+char buffer[1 << 16];
+size_t used = 0;
+
+void drain() {
+  fwrite(buffer, 1, used, stdout);
+  used = 0;
+}
+
+//  Output still in the buffer is written when the program exits
+void flushAtExit() {
+  flush_output();
+}
+
+[[maybe_unused]] const int registered = atexit(flushAtExit);
+
+void append(double x) {
+  //  "%g" is the default format of std::cout (6 significant digits)
+  const size_t longest = 32;
+  if (used + longest > sizeof(buffer))
+    drain();
+  used += snprintf(buffer + used, longest, "%g\n", x);
+}
+
+} // namespace
+
+double print(double x) {
+  append(x);
+  return 0;
+}
+
+double print_array(const double *A, int64_t n) {
+  for (int64_t i = 0; i < n; i++)
+    append(A[i]);
+  return 0;
+}
+
+double flush_output() {
+  drain();
+  fflush(stdout);
+  return 0;
+}
+
+/*************************** RNG **********************************/
+namespace {
+
+uint64_t state[4];
+
+uint64_t splitmix64(uint64_t &x) {
+  uint64_t z = (x += 0x9E3779B97F4A7C15ull);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+inline uint64_t rotl(uint64_t x, int k) {
+  return (x << k) | (x >> (64 - k));
+}
+
+inline uint64_t next() {
+  uint64_t result = rotl(state[1] * 5, 7) * 9;
+  uint64_t t = state[1] << 17;
+  state[2] ^= state[0];
+  state[3] ^= state[1];
+  state[1] ^= state[2];
+  state[0] ^= state[3];
+  state[2] ^= t;
+  state[3] = rotl(state[3], 45);
+  return result;
+}
+
+//  The top 53 bits, scaled to [0, 1)
+inline double uniform() {
+  return (next() >> 11) * 0x1.0p-53;
+}
+
+[[maybe_unused]] const double seeded = seed_random(0);
+
+} // namespace
+
+double seed_random(double seed) {
+  uint64_t x;
+  memcpy(&x, &seed, sizeof x);
+  for (auto &s: state)
+    s = splitmix64(x);
+  return 0;
+}
+
+double next_random() {
+  return uniform();
+}
+
+double fill_random(double *A, int64_t n) {
+  for (int64_t i = 0; i < n; i++)
+    A[i] = uniform();
+  return 0;
+}
+
+/************************** Array file I/O ************************/
+namespace {
+
+[[noreturn]] void fail(const char *what, const char *path) {
+  flush_output();
+  fprintf(stderr, "%s %s: %s\n", what, path, strerror(errno));
+  exit(EXIT_FAILURE);
+}
+
+} // namespace
+
+double *krt_mapfile(const char *path, int64_t *length) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    fail("cannot open", path);
+
+  struct stat st;
+  if (fstat(fd, &st) < 0)
+    fail("cannot stat", path);
+  if (st.st_size % sizeof(double) != 0) {
+    errno = EINVAL;
+    fail("size is not a multiple of 8 bytes:", path);
+  }
+
+  *length = st.st_size / sizeof(double);
+  if (*length == 0) {
+    close(fd);
+    //  mmap rejects empty mappings: any non null address will do
+    static double empty;
+    return &empty;
+  }
+
+  //  Private and writable: the program may update the array in place
+  void *A = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (A == MAP_FAILED)
+    fail("cannot map", path);
+  //  The mapping keeps its own reference to the file
+  close(fd);
+  //  Arrays are mostly scanned from start to end
+  madvise(A, st.st_size, MADV_SEQUENTIAL);
+  return static_cast<double *>(A);
+}
+
+void krt_unmapfile(double *A, int64_t length) {
+  if (length > 0)
+    munmap(A, length * sizeof(double));
+}
+
+double krt_savefile(const char *path, const double *A, int64_t n) {
+  //  Truncating path in place would drop the page cache that backs the
+  //  elements of a mapping of path not yet copied: the new content goes to
+  //  a temporary file, renamed over path, and the mapping keeps the old inode
+  std::string temporary = std::string(path) + ".XXXXXX";
+  int fd = mkstemp(temporary.data());
+  if (fd < 0)
+    fail("cannot create a temporary file for", path);
+  //  The permissions open(path, O_CREAT, 0644) would give
+  mode_t mask = umask(0);
+  umask(mask);
+  fchmod(fd, 0644 & ~mask);
+
+  size_t size = n * sizeof(double);
+  if (size > 0) {
+    if (ftruncate(fd, size) < 0) {
+      unlink(temporary.c_str());
+      fail("cannot resize", path);
+    }
+    void *out = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (out == MAP_FAILED) {
+      unlink(temporary.c_str());
+      fail("cannot map", path);
+    }
+    memcpy(out, A, size);
+    munmap(out, size);
+  }
+  close(fd);
+  if (rename(temporary.c_str(), path) < 0) {
+    unlink(temporary.c_str());
+    fail("cannot replace", path);
+  }
+  return 0;
+}
+
+/************************* Arena allocator ************************/
+namespace {
+
+const size_t chunkSize = 1 << 20;
+const size_t largeSize = 1 << 18;   // Da qui in su, mmap dedicata
+const size_t alignment = 64;
+
+struct Chunk {
+  char *base;
+  size_t used;
+  size_t dirty;   // < Oltre dirty la memoria non è mai stata usata: è zero
+};
+
+struct Large {
+  void *base;
+  size_t size;
+  Large *next;
+};
+
+struct Mark {
+  size_t chunk;
+  size_t used;
+  Large *large;
+};
+
+struct Arena {
+  std::vector<Chunk> chunks;    // < Anche quelli liberati, riusati in seguito
+  size_t current = 0;
+  Large *large = nullptr;
+
+  ~Arena() {
+    for (Large *l = large; l; l = l->next)
+      munmap(l->base, l->size);
+    for (auto &chunk: chunks)
+      munmap(chunk.base, chunkSize);
+  }
+};
+
+thread_local Arena arena;
+
+void *mapZeroed(size_t size) {
+  void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    fail("cannot allocate", "array");
+  return p;
+}
+
+char *bump(size_t size) {
+  size = (size + alignment - 1) & ~(alignment - 1);
+
+  Chunk *chunk = arena.chunks.empty() ? nullptr : &arena.chunks[arena.current];
+  if (not chunk or chunk->used + size > chunkSize) {
+    if (chunk)
+      arena.current++;
+    if (arena.current == arena.chunks.size())
+      arena.chunks.push_back({static_cast<char *>(mapZeroed(chunkSize)), 0, 0});
+    chunk = &arena.chunks[arena.current];
+  }
+
+  char *p = chunk->base + chunk->used;
+  if (chunk->used < chunk->dirty)
+    memset(p, 0, std::min(size, chunk->dirty - chunk->used));
+  chunk->used += size;
+  chunk->dirty = std::max(chunk->dirty, chunk->used);
+  return p;
+}
+
+} // namespace
+
+void *krt_arena_mark() {
+  Mark saved = {arena.current, arena.chunks.empty() ? 0 : arena.chunks[arena.current].used, arena.large};
+  //  The mark itself lives in the arena, and is released with the scope
+  Mark *mark = reinterpret_cast<Mark *>(bump(sizeof(Mark)));
+  *mark = saved;
+  return mark;
+}
+
+double *krt_arena_alloc(int64_t n) {
+  if (n < 0 or uint64_t(n) > PTRDIFF_MAX / sizeof(double)) {
+    errno = EINVAL;
+    fail("cannot allocate", "array");
+  }
+
+  size_t size = n * sizeof(double);
+  if (size < largeSize)
+    return reinterpret_cast<double *>(bump(size));
+
+  //  Pages are zeroed by the kernel, on first access
+  Large *l = reinterpret_cast<Large *>(bump(sizeof(Large)));
+  *l = {mapZeroed(size), size, arena.large};
+  arena.large = l;
+  return static_cast<double *>(l->base);
+}
+
+void krt_arena_release(void *m) {
+  Mark mark = *static_cast<Mark *>(m);
+  while (arena.large != mark.large) {
+    Large *l = arena.large;
+    arena.large = l->next;
+    munmap(l->base, l->size);
+  }
+
+  for (size_t i = mark.chunk + 1; i <= arena.current; i++)
+    arena.chunks[i].used = 0;
+  arena.current = mark.chunk;
+  arena.chunks[mark.chunk].used = mark.used;
+}
+
+/**************************** Profiler ****************************/
+namespace {
+
+using Site = const krt_prof_site *;
+
+struct Event {
+  Site site;
+  uint64_t time;
+  int64_t iterations;   // < -1 per l'ingresso
+};
+
+struct Stats {
+  uint64_t calls = 0;
+  uint64_t iterations = 0;
+  uint64_t total = 0;   // < Inclusivo: una chiamata ricorsiva è contata una volta sola
+  uint64_t self = 0;
+
+  Stats &operator+=(const Stats &other) {
+    calls += other.calls;
+    iterations += other.iterations;
+    total += other.total;
+    self += other.self;
+    return *this;
+  }
+};
+
+struct Frame {
+  Site site;
+  uint64_t start;
+  uint64_t children;    // < Tempo inclusivo delle chiamate fatte da qui
+};
+
+const size_t eventBuffer = 1 << 16;
+const size_t traceLimit = 1 << 20;   // Eventi per thread nel trace JSON
+
+struct ThreadProfile {
+  unsigned tid;
+  std::vector<Event> events;      // < Non ancora elaborati
+  std::vector<Event> trace;       // < I primi traceLimit eventi
+  bool truncated = false;
+  std::vector<Frame> stack;       // < Chiamate e cicli in corso
+  std::map<Site, unsigned> active;
+  std::map<Site, Stats> flat;
+  std::map<std::pair<Site, Site>, Stats> edges;   // < (chiamante, chiamato)
+
+  //  Replays the buffered events on the shadow stack
+  void fold() {
+    size_t room = traceLimit - trace.size();
+    trace.insert(trace.end(), events.begin(), events.begin() + std::min(room, events.size()));
+    truncated |= events.size() > room;
+
+    for (const Event &e: events) {
+      if (e.iterations < 0) {
+        stack.push_back({e.site, e.time, 0});
+        active[e.site]++;
+        continue;
+      }
+      //  kcomp always pairs them: an unmatched exit is ignored rather than trusted
+      if (stack.empty() or stack.back().site != e.site)
+        continue;
+      Frame frame = stack.back();
+      stack.pop_back();
+      uint64_t elapsed = e.time - frame.start;
+      bool outermost = --active[e.site] == 0;
+      Site caller = stack.empty() ? nullptr : stack.back().site;
+      for (Stats *s: {&flat[e.site], &edges[{caller, e.site}]}) {
+        s->calls++;
+        s->iterations += e.iterations;
+        s->self += elapsed - frame.children;
+        if (outermost)
+          s->total += elapsed;
+      }
+      if (not stack.empty())
+        stack.back().children += elapsed;
+    }
+    events.clear();
+  }
+};
+
+std::mutex profilesLock;
+std::vector<std::unique_ptr<ThreadProfile>> profiles;
+thread_local ThreadProfile *profile = nullptr;
+
+inline uint64_t now() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+std::string Label(Site site) {
+  if (not site)
+    return "<not instrumented>";
+  std::string name = site->kind == KRT_PROF_LOOP ? std::string("for in ") + site->name : site->name;
+  return name + " (" + site->file + ":" + std::to_string(site->line) + ")";
+}
+
+void JsonString(FILE *out, const char *s) {
+  fputc('"', out);
+  for (; *s; s++) {
+    if (*s == '"' or *s == '\\')
+      fprintf(out, "\\%c", *s);
+    else if (static_cast<unsigned char>(*s) < 0x20)
+      fprintf(out, "\\u%04x", *s);
+    else
+      fputc(*s, out);
+  }
+  fputc('"', out);
+}
+
+double ms(uint64_t ns) {
+  return ns / 1e6;
+}
+
+void writeText(FILE *out, const std::map<Site, Stats> &flat, const std::map<std::pair<Site, Site>, Stats> &edges) {
+  uint64_t instrumented = 0;
+  std::vector<std::pair<Site, Stats>> sites(flat.begin(), flat.end());
+  for (auto &[site, stats]: sites)
+    instrumented += stats.self;
+
+  std::sort(sites.begin(), sites.end(), [](auto &a, auto &b) { return a.second.self > b.second.self; });
+  fprintf(out, "Flat profile (times in ms, %.3f ms instrumented)\n\n", ms(instrumented));
+  fprintf(out, "%8s %10s %10s %12s %12s  %s\n", "self %", "self", "total", "calls", "iterations", "name");
+  for (auto &[site, stats]: sites) {
+    fprintf(out, "%8.2f %10.3f %10.3f %12llu ", instrumented ? 100.0 * stats.self / instrumented : 0.0,
+            ms(stats.self), ms(stats.total), (unsigned long long)stats.calls);
+    if (site->kind == KRT_PROF_LOOP)
+      fprintf(out, "%12llu", (unsigned long long)stats.iterations);
+    else
+      fprintf(out, "%12s", "-");
+    fprintf(out, "  %s\n", Label(site).c_str());
+  }
+
+  //  Callers and callees of every site, heaviest first
+  std::sort(sites.begin(), sites.end(), [](auto &a, auto &b) { return a.second.total > b.second.total; });
+  fprintf(out, "\nCall graph (times in ms)\n");
+  for (auto &[site, stats]: sites) {
+    fprintf(out, "\n%s: %llu calls, %.3f total, %.3f self\n", Label(site).c_str(),
+            (unsigned long long)stats.calls, ms(stats.total), ms(stats.self));
+    std::vector<std::pair<std::pair<Site, Site>, Stats>> callers, callees;
+    for (auto &edge: edges) {
+      if (edge.first.second == site)
+        callers.push_back(edge);
+      if (edge.first.first == site)
+        callees.push_back(edge);
+    }
+    auto heaviest = [](auto &a, auto &b) { return a.second.total > b.second.total; };
+    std::sort(callers.begin(), callers.end(), heaviest);
+    std::sort(callees.begin(), callees.end(), heaviest);
+    for (auto &[edge, e]: callers)
+      fprintf(out, "    called by %s: %llu calls, %.3f\n", Label(edge.first).c_str(),
+              (unsigned long long)e.calls, ms(e.total));
+    for (auto &[edge, e]: callees)
+      fprintf(out, "    calls %s: %llu calls, %.3f\n", Label(edge.second).c_str(),
+              (unsigned long long)e.calls, ms(e.total));
+  }
+}
+
+//  Chrome trace format: "B" and "E" events, timestamps in microseconds
+void writeTrace(FILE *out, uint64_t origin, bool truncated) {
+  fprintf(out, "{\"displayTimeUnit\": \"ns\",%s\n\"traceEvents\": [",
+          truncated ? " \"otherData\": {\"truncated\": \"true\"}," : "");
+  const char *separator = "\n";
+  for (auto &p: profiles)
+    for (const Event &e: p->trace) {
+      fprintf(out, "%s{\"name\": ", separator);
+      JsonString(out, (e.site->kind == KRT_PROF_LOOP ? std::string("for in ") + e.site->name : e.site->name).c_str());
+      fprintf(out, ", \"cat\": \"%s\", \"ph\": \"%s\", \"ts\": %.3f, \"pid\": %d, \"tid\": %u, \"args\": {",
+              e.site->kind == KRT_PROF_LOOP ? "loop" : "function", e.iterations < 0 ? "B" : "E",
+              (e.time - origin) / 1e3, getpid(), p->tid);
+      if (e.iterations < 0) {
+        fprintf(out, "\"source\": ");
+        JsonString(out, (std::string(e.site->file) + ":" + std::to_string(e.site->line)).c_str());
+      } else if (e.site->kind == KRT_PROF_LOOP)
+        fprintf(out, "\"iterations\": %lld", (long long)e.iterations);
+      fprintf(out, "}}");
+      separator = ",\n";
+    }
+  fprintf(out, "\n]}\n");
+}
+
+void writeProfile() {
+  std::lock_guard<std::mutex> lock(profilesLock);
+  std::map<Site, Stats> flat;
+  std::map<std::pair<Site, Site>, Stats> edges;
+  uint64_t origin = UINT64_MAX;
+  bool truncated = false;
+  for (auto &p: profiles) {
+    p->fold();
+    for (auto &[site, stats]: p->flat)
+      flat[site] += stats;
+    for (auto &[edge, stats]: p->edges)
+      edges[edge] += stats;
+    if (not p->trace.empty())
+      origin = std::min(origin, p->trace.front().time);
+    truncated |= p->truncated;
+  }
+
+  const char *prefix = getenv("KRT_PROFILE");
+  if (not prefix or not *prefix)
+    prefix = "kprof";
+  std::string text = std::string(prefix) + ".txt";
+  std::string json = std::string(prefix) + ".json";
+  FILE *out = fopen(text.c_str(), "w");
+  if (not out) {
+    fprintf(stderr, "cannot write %s: %s\n", text.c_str(), strerror(errno));
+    return;
+  }
+  writeText(out, flat, edges);
+  fclose(out);
+
+  out = fopen(json.c_str(), "w");
+  if (not out) {
+    fprintf(stderr, "cannot write %s: %s\n", json.c_str(), strerror(errno));
+    return;
+  }
+  writeTrace(out, origin, truncated);
+  fclose(out);
+  if (truncated)
+    fprintf(stderr, "profile: the trace in %s only has the first %zu events of each thread\n", json.c_str(),
+            traceLimit);
+}
+
+ThreadProfile &threadProfile() {
+  if (not profile) {
+    std::lock_guard<std::mutex> lock(profilesLock);
+    //  The profile is written only by programs compiled with -finstrument
+    if (profiles.empty())
+      atexit(writeProfile);
+    profiles.push_back(std::make_unique<ThreadProfile>());
+    profile = profiles.back().get();
+    profile->tid = profiles.size() - 1;
+    profile->events.reserve(eventBuffer);
+  }
+  return *profile;
+}
+
+} // namespace
+
+void krt_prof_enter(const krt_prof_site *site) {
+  ThreadProfile &p = threadProfile();
+  if (p.events.size() == eventBuffer)
+    p.fold();
+  //  The clock is read last on entry and first on exit
+  p.events.push_back({site, now(), -1});
+}
+
+void krt_prof_exit(const krt_prof_site *site, int64_t iterations) {
+  uint64_t time = now();
+  ThreadProfile &p = threadProfile();
+  if (p.events.size() == eventBuffer)
+    p.fold();
+  p.events.push_back({site, time, iterations});
+}
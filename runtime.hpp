@@ -0,0 +1,110 @@
+#ifndef RUNTIME_HPP
+#define RUNTIME_HPP
+/**
+ * Runtime library dei programmi Kaleidoscope (libkrt.a, libkrt.so).
+ *
+ * Tutte le funzioni hanno linkage C e, come ogni funzione del linguaggio,
+ * restituiscono un double; si dichiarano nei sorgenti con extern:
+ *
+ *   extern clock_ns();
+ *   extern print(x);
+ *
+ * Un array è passato come puntatore al primo elemento e numero di elementi.
+ *
+ * L'output di print e print_array è bufferizzato: viene scritto a blocchi,
+ * con flush_output() e comunque all'uscita del programma, così che la stampa
+ * non pesi sui tempi misurati.
+ */
+#include <cstdint>
+
+extern "C" {
+
+/// Tempo monotono in nanosecondi, da un'origine arbitraria
+double clock_ns();
+
+/// Stampa x (come std::cout) seguito da un a capo
+double print(double x);
+/// Stampa gli n elementi di A, uno per riga
+double print_array(const double *A, int64_t n);
+/// Scrive su stdout l'output accumulato
+double flush_output();
+
+/**
+ * Generatore pseudocasuale xoshiro256** (Blackman, Vigna): lo stato di 256
+ * bit è inizializzato da seed con splitmix64. Senza seed_random la sequenza
+ * parte da seed 0.
+ */
+double seed_random(double seed);
+/// Numero uniforme in [0, 1), con 53 bit casuali
+double next_random();
+/// Riempie A con n numeri uniformi in [0, 1)
+double fill_random(double *A, int64_t n);
+
+/**
+ * I/O di array su file binari: sequenze di double in formato nativo, senza
+ * intestazione. Sono i builtin del linguaggio
+ *
+ *   var A[] = mapfile("in.bin");
+ *   savefile(A, "out.bin");
+ *
+ * che il compilatore traduce in chiamate a queste funzioni.
+ * krt_mapfile mappa il file in memoria (copy-on-write: le modifiche ad A non
+ * arrivano al file) e scrive in *length il numero di elementi; la mappatura
+ * è rimossa con krt_unmapfile all'uscita dallo scope che dichiara A. In
+ * caso di errore il programma termina con un messaggio.
+ */
+double *krt_mapfile(const char *path, int64_t *length);
+/// Rimuove la mappatura di krt_mapfile (length elementi)
+void krt_unmapfile(double *A, int64_t length);
+/**
+ * Scrive gli n elementi di A nel file path, sostituendone il contenuto. Il
+ * file viene scritto accanto a path e poi rinominato: A può essere la
+ * mappatura dello stesso path, che continua a leggere il file originale
+ */
+double krt_savefile(const char *path, const double *A, int64_t n);
+
+/**
+ * Arena (bump allocator) per thread, in cui il compilatore alloca gli array
+ * di dimensione nota solo a runtime (var A[n]) e quelli troppo grandi per
+ * lo stack. Uno scope che alloca prende un mark all'inizio e lo rilascia
+ * all'uscita, liberando in blocco tutto ciò che è stato allocato dopo.
+ *
+ * La memoria arriva da mmap ed è quindi già azzerata: viene azzerata con
+ * memset solo la parte già usata da scope precedenti. Le allocazioni grandi
+ * hanno una mmap dedicata, restituita al sistema al rilascio dello scope.
+ */
+void *krt_arena_mark();
+/// n double azzerati, allineati a 64 byte. n negativo termina il programma
+double *krt_arena_alloc(int64_t n);
+/// Libera tutto ciò che è stato allocato dopo mark
+void krt_arena_release(void *mark);
+
+/**
+ * Profilo dei programmi compilati con -finstrument=functions,loops. Ogni
+ * funzione e ogni ciclo for strumentati hanno un descrittore costante,
+ * generato dal compilatore, e chiamano krt_prof_enter all'ingresso e
+ * krt_prof_exit all'uscita (per un ciclo, con il numero di iterazioni).
+ *
+ * Gli eventi, con un timestamp di CLOCK_MONOTONIC, vanno in un buffer per
+ * thread, elaborato solo quando è pieno: la strumentazione costa una
+ * lettura del clock e una scrittura in memoria. All'uscita del programma
+ * vengono scritti KRT_PROFILE.txt (profilo flat e call graph, con tempi
+ * inclusivi e numero esatto di chiamate e iterazioni) e KRT_PROFILE.json
+ * (trace per chrome://tracing o Perfetto), dove KRT_PROFILE è la variabile
+ * d'ambiente omonima, "kprof" se non è definita.
+ */
+enum krt_prof_kind : int32_t { KRT_PROF_FUNCTION, KRT_PROF_LOOP };
+
+struct krt_prof_site {
+  const char *name;   // < La funzione (per un ciclo, quella che lo contiene)
+  const char *file;   // < Il sorgente .k
+  int32_t line;
+  int32_t kind;       // < krt_prof_kind
+};
+
+void krt_prof_enter(const krt_prof_site *site);
+void krt_prof_exit(const krt_prof_site *site, int64_t iterations);
+
+}
+
+#endif // ! RUNTIME_HPP
@@ -52,10 +52,13 @@ blank   [ \t]
 "}"      return yy::parser::make_RBRACE    (loc);
 "["      return yy::parser::make_LSQBRACK  (loc);
 "]"      return yy::parser::make_RSQBRACK  (loc);
+"@"      return yy::parser::make_AT        (loc);
 "and"    return yy::parser::make_AND       (loc);
 "or"     return yy::parser::make_OR        (loc);
 "not"    return yy::parser::make_NOT       (loc);
 
+\"[^"\n]*\"  return yy::parser::make_STRING(std::string(yytext + 1, yyleng - 2), loc);
+
 {num}    { errno = 0;
            double n = strtod(yytext, NULL);
            if (! (n!=HUGE_VAL && n!=-HUGE_VAL && errno != ERANGE))
@@ -67,10 +70,15 @@ blank   [ \t]
 "def"    { return yy::parser::make_DEF(loc); }
 "extern" { return yy::parser::make_EXTERN(loc); }
 "global" { return yy::parser::make_GLOBAL(loc); }
+"pure"   { return yy::parser::make_PURE(loc); }
 "var"    { return yy::parser::make_VAR(loc); }
 "if"     { return yy::parser::make_IF(loc); }
 "else"   { return yy::parser::make_ELSE(loc); }
 "for"    { return yy::parser::make_FOR(loc); }
+"mapfile"  { return yy::parser::make_MAPFILE(loc); }
+"savefile" { return yy::parser::make_SAVEFILE(loc); }
+"len"      { return yy::parser::make_LEN(loc); }
+"import"   { return yy::parser::make_IMPORT(loc); }
 
 {id}     { return yy::parser::make_IDENTIFIER (yytext, loc); }
 
@@ -83,6 +91,10 @@ blank   [ \t]
 
 void driver::scan_begin () {
   yy_flex_debug = trace_scanning;
+  if (in_memory) {
+    yy_scan_bytes (source.data (), source.size ());
+    return;
+  }
   if (file.empty () || file == "-")
     yyin = stdin;
   else if (!(yyin = fopen (file.c_str (), "r")))
@@ -90,10 +102,17 @@ void driver::scan_begin () {
       std::cerr << "cannot open " << file << ": " << strerror(errno) << '\n';
       exit (EXIT_FAILURE);
     }
+  // Il buffer dello scanner potrebbe riferirsi ancora al file (o alla
+  // stringa) precedente, che è già stato letto fino a EOF
+  yyrestart (yyin);
 }
 
 void
 driver::scan_end ()
 {
+  if (in_memory) {
+    yy_delete_buffer (YY_CURRENT_BUFFER);
+    return;
+  }
   fclose (yyin);
 }
@@ -0,0 +1,366 @@
+#include "server.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+namespace {
+
+//  Client and server run on the same machine: integers in native order
+const uint32_t maxStrings = 1 << 16;
+const uint32_t maxLength = 1 << 20;
+
+/* SOCK_CLOEXEC, accept4 e MSG_CMSG_CLOEXEC esistono solo su Linux. Tra la
+   creazione di un descrittore e fcntl un altro thread può fare fork, ma il
+   figlio chiude comunque ciò che eredita (CloseInherited) */
+int CloseOnExec(int fd) {
+  if (fd >= 0)
+    fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+  return fd;
+}
+
+bool WriteAll(int fd, const void *data, size_t size) {
+  const char *p = static_cast<const char *>(data);
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n < 0 and errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool ReadAll(int fd, void *data, size_t size) {
+  char *p = static_cast<char *>(data);
+  while (size > 0) {
+    ssize_t n = read(fd, p, size);
+    if (n < 0 and errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+/// Numero di stringhe, poi lunghezza e contenuto di ciascuna
+bool WriteStrings(int fd, const std::vector<std::string> &strings) {
+  uint32_t count = strings.size();
+  if (not WriteAll(fd, &count, sizeof count))
+    return false;
+  for (const std::string &s: strings) {
+    uint32_t length = s.size();
+    if (not WriteAll(fd, &length, sizeof length) or not WriteAll(fd, s.data(), s.size()))
+      return false;
+  }
+  return true;
+}
+
+bool ReadStrings(int fd, std::vector<std::string> &strings) {
+  uint32_t count;
+  if (not ReadAll(fd, &count, sizeof count) or count > maxStrings)
+    return false;
+  strings.resize(count);
+  for (std::string &s: strings) {
+    uint32_t length;
+    if (not ReadAll(fd, &length, sizeof length) or length > maxLength)
+      return false;
+    s.resize(length);
+    if (not ReadAll(fd, s.data(), length))
+      return false;
+  }
+  return true;
+}
+
+//  stdin, stdout and stderr travel as ancillary data of a one byte message
+bool SendFds(int sock, const int (&fds)[3]) {
+  char byte = 'k';
+  iovec iov = {&byte, 1};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof fds)] = {};
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof control;
+  cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof fds);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof fds);
+  ssize_t n;
+  do
+    n = sendmsg(sock, &msg, 0);
+  while (n < 0 and errno == EINTR);
+  return n == 1;
+}
+
+bool ReceiveFds(int sock, int (&fds)[3]) {
+  char byte;
+  iovec iov = {&byte, 1};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof fds)] = {};
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof control;
+  ssize_t n;
+  do
+    n = recvmsg(sock, &msg, 0);
+  while (n < 0 and errno == EINTR);
+  cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (n != 1 or not cmsg or cmsg->cmsg_type != SCM_RIGHTS or cmsg->cmsg_len != CMSG_LEN(sizeof fds))
+    return false;
+  memcpy(fds, CMSG_DATA(cmsg), sizeof fds);
+  for (int fd: fds)
+    CloseOnExec(fd);
+  return true;
+}
+
+bool Address(const std::string &path, sockaddr_un &addr) {
+  addr = {};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof addr.sun_path) {
+    fprintf(stderr, "socket path too long: %s\n", path.c_str());
+    return false;
+  }
+  memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+  return true;
+}
+
+/* Chi è all'altro capo del socket: il client gli affida i propri file e
+   l'ambiente (che può contenere credenziali), il server esegue le richieste
+   con i propri diritti. Entrambi accettano solo lo stesso utente, anche se
+   il socket in /tmp fosse stato creato da un altro */
+bool SameUser(int sock) {
+  uid_t uid;
+#ifdef SO_PEERCRED
+  ucred cred;
+  socklen_t length = sizeof cred;
+  if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &length) < 0)
+    return false;
+  uid = cred.uid;
+#else
+  gid_t gid;
+  if (getpeereid(sock, &uid, &gid) < 0)
+    return false;
+#endif
+  return uid == getuid();
+}
+
+int Connect(const std::string &path) {
+  sockaddr_un addr;
+  if (not Address(path, addr))
+    return -1;
+  int sock = CloseOnExec(socket(AF_UNIX, SOCK_STREAM, 0));
+  if (sock >= 0 and connect(sock, reinterpret_cast<sockaddr *>(&addr), sizeof addr) == 0)
+    return sock;
+  if (sock >= 0)
+    close(sock);
+  return -1;
+}
+
+/* Il figlio eredita anche le connessioni e i file delle altre richieste in
+   corso: vanno chiusi, o un client che legge da una pipe ne vedrebbe la
+   fine solo quando termina anche il figlio di un'altra richiesta */
+void CloseInherited() {
+  std::vector<int> open;
+  if (DIR *dir = opendir("/proc/self/fd")) {
+    while (dirent *entry = readdir(dir)) {
+      int fd = atoi(entry->d_name);
+      if (fd > 2 and fd != dirfd(dir))
+        open.push_back(fd);
+    }
+    closedir(dir);
+  } else
+    for (int fd = 3; fd < 1024; fd++)
+      open.push_back(fd);
+  for (int fd: open)
+    close(fd);
+}
+
+[[noreturn]] void RunChild(const int (&fds)[3], const std::string &cwd, const std::vector<std::string> &args,
+                           const std::vector<std::string> &env, int (*compile)(int, char **)) {
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGPIPE, SIG_DFL);
+  for (int i = 0; i < 3; i++)
+    dup2(fds[i], i);
+  CloseInherited();
+  if (chdir(cwd.c_str()) < 0) {
+    fprintf(stderr, "kcomp --server: cannot enter %s: %s\n", cwd.c_str(), strerror(errno));
+    _exit(1);
+  }
+
+  //  The cache directory, for instance, depends on the environment of the
+  //  client. clearenv is not portable: environ is replaced, and lives until
+  //  _exit
+  std::vector<char *> vars;
+  for (const std::string &var: env)
+    vars.push_back(const_cast<char *>(var.c_str()));
+  vars.push_back(nullptr);
+  environ = vars.data();
+
+  std::vector<char *> argv;
+  for (const std::string &arg: args)
+    argv.push_back(const_cast<char *>(arg.c_str()));
+  argv.push_back(nullptr);
+  //  The state inherited from the server is not destroyed: compile flushes
+  //  its own streams
+  int code = compile(args.size(), argv.data());
+  fflush(nullptr);
+  _exit(code);
+}
+
+void Serve(int conn, int (*compile)(int, char **)) {
+  if (not SameUser(conn)) {
+    fprintf(stderr, "kcomp --server: connection from another user refused\n");
+    return;
+  }
+  int fds[3];
+  if (not ReceiveFds(conn, fds))
+    return;
+
+  std::vector<std::string> cwd, args, env;
+  int32_t code = 1;
+  if (ReadStrings(conn, cwd) and cwd.size() == 1 and ReadStrings(conn, args) and not args.empty()
+      and ReadStrings(conn, env)) {
+    //  Other workers may be inside malloc or stdio while this one forks: the
+    //  child is consistent only because glibc takes their locks around fork
+    //  (other C libraries do the same). Workers use nothing else that locks
+    //  before forking, LLVM runs only in the children
+    pid_t pid = fork();
+    if (pid == 0)
+      RunChild(fds, cwd[0], args, env, compile);
+    int status;
+    if (pid > 0) {
+      while (waitpid(pid, &status, 0) < 0 and errno == EINTR)
+        ;
+      code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    } else
+      fprintf(stderr, "kcomp --server: fork: %s\n", strerror(errno));
+  }
+  for (int fd: fds)
+    close(fd);
+  WriteAll(conn, &code, sizeof code);
+}
+
+char socketPath[sizeof(sockaddr_un::sun_path)];
+
+void Shutdown(int) {
+  unlink(socketPath);
+  _exit(0);
+}
+
+} // namespace
+
+std::string defaultSocket() {
+  const char *runtime = getenv("XDG_RUNTIME_DIR");
+  if (runtime and *runtime)
+    return std::string(runtime) + "/kcomp.sock";
+  return "/tmp/kcomp-" + std::to_string(getuid()) + ".sock";
+}
+
+int runServer(const std::string &path, unsigned jobs, int (*compile)(int, char **)) {
+  sockaddr_un addr;
+  if (not Address(path, addr))
+    return 1;
+  //  A socket nobody listens on is left over by a server that crashed
+  if (int sock = Connect(path); sock >= 0) {
+    close(sock);
+    fprintf(stderr, "kcomp --server: a server is already listening on %s\n", path.c_str());
+    return 1;
+  }
+  unlink(path.c_str());
+
+  int listener = CloseOnExec(socket(AF_UNIX, SOCK_STREAM, 0));
+  //  Only the owner may connect: requests run with the rights of the server
+  mode_t mask = umask(077);
+  bool bound = listener >= 0 and bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof addr) == 0;
+  umask(mask);
+  if (not bound or listen(listener, SOMAXCONN) < 0) {
+    fprintf(stderr, "kcomp --server: cannot listen on %s: %s\n", path.c_str(), strerror(errno));
+    return 1;
+  }
+
+  memcpy(socketPath, addr.sun_path, sizeof socketPath);
+  signal(SIGINT, Shutdown);
+  signal(SIGTERM, Shutdown);
+  signal(SIGPIPE, SIG_IGN);   // A client may go away before its answer
+
+  if (jobs == 0)
+    jobs = std::max(1u, std::thread::hardware_concurrency());
+  fprintf(stderr, "kcomp --server: listening on %s, %u jobs\n", path.c_str(), jobs);
+  fflush(stderr);
+
+  std::vector<std::thread> pool;
+  for (unsigned i = 0; i < jobs; i++)
+    pool.emplace_back([listener, compile] {
+      for (;;) {
+        int conn = CloseOnExec(accept(listener, nullptr, nullptr));
+        if (conn < 0) {
+          if (errno == EINTR or errno == ECONNABORTED)
+            continue;
+          fprintf(stderr, "kcomp --server: accept: %s\n", strerror(errno));
+          return;
+        }
+        Serve(conn, compile);
+        close(conn);
+      }
+    });
+  for (std::thread &worker: pool)
+    worker.join();
+  unlink(path.c_str());
+  return 1;
+}
+
+int runClient(const std::string &path, const std::vector<char *> &args) {
+  int sock = Connect(path);
+  if (sock < 0)
+    return -1;
+  if (not SameUser(sock)) {
+    fprintf(stderr, "kcomp --client: %s is not a server of this user\n", path.c_str());
+    close(sock);
+    return 1;
+  }
+
+  char cwd[PATH_MAX];
+  if (not getcwd(cwd, sizeof cwd)) {
+    fprintf(stderr, "kcomp --client: getcwd: %s\n", strerror(errno));
+    close(sock);
+    return 1;
+  }
+  std::vector<std::string> env;
+  for (char **var = environ; *var; var++)
+    env.push_back(*var);
+
+  const int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  int32_t code;
+  bool ok = SendFds(sock, fds) and WriteStrings(sock, {cwd}) and WriteStrings(sock, {args.begin(), args.end()})
+            and WriteStrings(sock, env) and ReadAll(sock, &code, sizeof code);
+  close(sock);
+  if (not ok) {
+    fprintf(stderr, "kcomp --client: connection to %s lost\n", path.c_str());
+    return 1;
+  }
+  return code;
+}
@@ -0,0 +1,42 @@
+#ifndef SERVER_HPP
+#define SERVER_HPP
+/**
+ * Server di compilazione (kcomp --server) e client (kcomp --client).
+ *
+ * Il server ascolta su un socket Unix, accessibile solo al suo utente (client
+ * e server verificano l'uid dell'altro capo), e inizializza LLVM una volta
+ * sola: i target sono già creati e usati quando arriva una richiesta. Il
+ * client invia la directory corrente, gli argomenti e l'ambiente, insieme
+ * ai propri stdin, stdout e stderr (come file descriptor, SCM_RIGHTS), e
+ * termina con l'exit status della compilazione: kcomp --client -O2 prog.k
+ * 2> prog.ll si comporta come kcomp -O2 prog.k.
+ *
+ * Ogni richiesta viene eseguita in un processo figlio del server, con un
+ * proprio contesto LLVM: la generazione del codice usa stato globale (il
+ * modulo, lo scanner, lo stderr su cui viene scritto l'IR). Il figlio
+ * eredita per copia (fork) tutto lo stato già inizializzato. Un pool di
+ * thread accetta le connessioni e attende i figli: il numero di thread è il
+ * numero massimo di compilazioni contemporanee.
+ */
+#include <string>
+#include <vector>
+
+/// $XDG_RUNTIME_DIR/kcomp.sock, o /tmp/kcomp-UID.sock
+std::string defaultSocket();
+
+/**
+ * Serve le richieste su path con jobs thread (0: uno per core), eseguendo
+ * compile(argc, argv) in un processo figlio per ciascuna; il figlio termina
+ * subito dopo, senza distruttori statici, quindi compile deve svuotare i
+ * propri stream. Termina solo in caso di errore (restituisce 1) o con
+ * SIGINT/SIGTERM, rimuovendo il socket.
+ */
+int runServer(const std::string &path, unsigned jobs, int (*compile)(int, char **));
+
+/// Esegue args (argv completo, con argv[0]) sul server in ascolto su path e
+/// ne restituisce l'exit status; -1 se nessun server è in ascolto, 1 (senza
+/// inviare nulla) se il server appartiene a un altro utente.
+/// Non usa LLVM: kcomp-client non carica le librerie di kcomp
+int runClient(const std::string &path, const std::vector<char *> &args);
+
+#endif // ! SERVER_HPP
@@ -0,0 +1,14 @@
+#include <iostream>
+
+extern "C" {
+    double bench(double);
+}
+
+// bench stampa la media di n numeri casuali e il tempo (ns) per numero,
+// usando la runtime library di kcomp (libkrt)
+int main() {
+    double n;
+    std::cout << "Inserisci il numero di campioni: ";
+    std::cin >> n;
+    bench(n);
+}
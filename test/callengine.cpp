@@ -0,0 +1,54 @@
+#include <iostream>
+#include "../engine.hpp"
+
+const char *formula =
+    "def err(a b) { a<b ? b-a : a-b };"
+    "def iterate(y x) {"
+    "   var eps = 0.0001;"
+    "   for (var z = x*x; eps<err(z,y); x = (x+y/x)/2) z = x*x;"
+    "   x"
+    "};"
+    "def hyp(a b) { iterate(a*a+b*b, (a*a+b*b)/2) };";
+
+int main() {
+    kcomp::Engine engine;
+
+    kcomp::Handle h = engine.compile(formula);
+    if (!h) {
+        std::cerr << "Errore di compilazione: " << engine.lastError() << std::endl;
+        return 1;
+    }
+    auto hyp = h.get<double(double, double)>("hyp");
+    std::cout << "hyp(3,4) = " << hyp(3, 4) << std::endl;
+
+    // La seconda compilazione dello stesso sorgente è una lookup in cache
+    kcomp::Handle again = engine.compile(formula);
+    std::cout << "Stessa unità dalla cache: "
+              << (again.get<double(double, double)>("hyp") == hyp ? "si" : "no") << std::endl;
+    std::cout << "Unità in cache: " << engine.cachedUnits()
+              << ", codice: " << engine.memoryUsage() << " byte" << std::endl;
+
+    // Un errore semantico non produce un'unità: il messaggio è in lastError()
+    kcomp::Handle bad = engine.compile("def g(x) { x + y };");
+    std::cout << "Errore atteso: " << (bad ? "nessuno" : engine.lastError()) << std::endl;
+
+    // Valutazione vettoriale su input colonnare
+    kcomp::Engine::Options opts;
+    opts.batch = true;
+    kcomp::Engine batchEngine(opts);
+    kcomp::Handle b = batchEngine.compile("def lerp(a b t) { a+(b-a)*t };");
+    auto lerp = b.get<void(const double *, const double *, const double *, double *, size_t)>("lerp_batch");
+    double a[4] = {0, 1, 2, 3}, bb[4] = {10, 11, 12, 13}, t[4] = {0, 0.25, 0.5, 1}, out[4];
+    lerp(a, bb, t, out, 4);
+    for (int i=0; i<4; i++)
+        std::cout << "lerp(" << a[i] << "," << bb[i] << "," << t[i] << ") = " << out[i] << std::endl;
+
+    // Codice registrato presso gdb e perf (/tmp/perf-PID.map), con le line table di formula.k
+    kcomp::Engine::Options profileOpts;
+    profileOpts.debugInfo = true;
+    profileOpts.perfMap = true;
+    kcomp::Engine profileEngine(profileOpts);
+    kcomp::Handle p = profileEngine.compile(formula, "formula.k");
+    std::cout << "hyp(5,12) = " << p.get<double(double, double)>("hyp")(5, 12) << std::endl;
+    return 0;
+}
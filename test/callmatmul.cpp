@@ -0,0 +1,21 @@
+#include <iostream>
+
+extern "C" {
+    extern double A[64][64], B[64][64], C[64][64];
+    double matmul();
+}
+
+// matmul calcola C = A*B su matrici globali 64x64, memorizzate per righe
+// (la stessa disposizione degli array C++ a due dimensioni)
+int main() {
+    for (int i = 0; i < 64; i++)
+        for (int j = 0; j < 64; j++) {
+            A[i][j] = i + j;
+            B[i][j] = i == j ? 2 : 0;
+        }
+    matmul();
+    double trace = 0;
+    for (int i = 0; i < 64; i++)
+        trace += C[i][i];
+    std::cout << "Traccia di A*B: " << trace << " (attesa " << 4 * 63 * 32 << ")" << std::endl;
+}
@@ -0,0 +1,15 @@
+#include <iostream>
+
+extern "C" {
+    double sum(double);
+}
+
+// sum somma i primi n numeri di Fibonacci, calcolati ricorsivamente: con
+// -finstrument=functions,loops il programma scrive all'uscita il profilo
+// in kprof.txt e il trace in kprof.json
+int main() {
+    double n;
+    std::cout << "Inserisci il valore di n: ";
+    std::cin >> n;
+    std::cout << "Somma dei primi " << n << " numeri di Fibonacci: " << sum(n) << std::endl;
+}
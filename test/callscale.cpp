@@ -0,0 +1,22 @@
+#include <iostream>
+#include <fstream>
+
+extern "C" {
+    double scale(double);
+}
+
+// scale legge l'array di double in scale.in (mappandolo in memoria),
+// moltiplica ogni elemento per k e scrive il risultato in scale.out
+int main() {
+    double v[] = {1, 2, 3, 4, 5};
+    std::ofstream("scale.in", std::ios::binary).write((char *)v, sizeof v);
+
+    double k;
+    std::cout << "Inserisci il fattore di scala: ";
+    std::cin >> k;
+    std::cout << "Somma degli elementi scalati: " << scale(k) << std::endl;
+
+    std::ifstream out("scale.out", std::ios::binary);
+    while (out.read((char *)v, sizeof(double)))
+        std::cout << v[0] << std::endl;
+}
@@ -0,0 +1,14 @@
+#include <iostream>
+
+extern "C" {
+    double sieve(double);
+}
+
+// sieve conta i numeri primi minori o uguali a n (crivello di Eratostene),
+// con un array di n+1 elementi allocato a runtime
+int main() {
+    double n;
+    std::cout << "Inserisci il valore di n: ";
+    std::cin >> n;
+    std::cout << "Numeri primi fino a " << n << ": " << sieve(n) << std::endl;
+}
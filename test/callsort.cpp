@@ -0,0 +1,22 @@
+#include <iostream>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+extern "C" {
+    double sort(double *A, int64_t n);
+}
+
+// sort ordina (insertion sort) un array qualsiasi, ricevuto per riferimento:
+// qui un buffer del programma C++, senza copie
+int main() {
+    double n;
+    std::cout << "Inserisci il numero di elementi: ";
+    std::cin >> n;
+    std::vector<double> A(n);
+    for (auto &x: A)
+        x = rand() % 1000;
+    sort(A.data(), A.size());
+    for (auto x: A)
+        std::cout << x << std::endl;
+}
@@ -0,0 +1,318 @@
+#include "transforms.hpp"
+
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/Regex.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/IPO/FunctionAttrs.h"
+#include "llvm/Transforms/IPO/GlobalDCE.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include <algorithm>
+#include <map>
+#include <optional>
+
+using namespace llvm;
+
+/*************************** Pass pipelines ***********************/
+namespace {
+
+/// Runs the module passes added by populate, with all the analyses
+/// registered as PassBuilder does for the default pipelines
+template <typename Populate>
+void runPasses(Module &M, TargetMachine *TM, Populate populate) {
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  PassBuilder PB(TM);
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  ModulePassManager MPM;
+  populate(PB, MPM);
+  MPM.run(M, MAM);
+}
+
+} // namespace
+
+void optimize(Module &M, unsigned level, TargetMachine *TM) {
+  if (level == 0)
+    return;
+
+  OptimizationLevel O = level == 1 ? OptimizationLevel::O1
+                      : level == 2 ? OptimizationLevel::O2
+                                   : OptimizationLevel::O3;
+  runPasses(M, TM, [&](PassBuilder &PB, ModulePassManager &MPM) {
+    MPM.addPass(PB.buildPerModuleDefaultPipeline(O));
+  });
+}
+
+/************************ Optimization remarks ********************/
+namespace {
+
+/// Prints the enabled remarks, leaving warnings and errors to the default
+/// handler of the context
+class RemarkPrinter: public DiagnosticHandler {
+  private:
+  std::optional<Regex> passed, missed, analysis;
+
+  static bool matches(const std::optional<Regex> &filter, StringRef pass) {
+    return filter and filter->match(pass);
+  }
+
+  public:
+  RemarkPrinter(std::optional<Regex> passed, std::optional<Regex> missed, std::optional<Regex> analysis):
+    passed(std::move(passed)), missed(std::move(missed)), analysis(std::move(analysis)) {}
+
+  bool isPassedOptRemarkEnabled(StringRef pass) const override { return matches(passed, pass); }
+  bool isMissedOptRemarkEnabled(StringRef pass) const override { return matches(missed, pass); }
+  bool isAnalysisRemarkEnabled(StringRef pass) const override { return matches(analysis, pass); }
+
+  bool handleDiagnostics(const DiagnosticInfo &DI) override {
+    auto *remark = dyn_cast<DiagnosticInfoOptimizationBase>(&DI);
+    if (not remark)
+      return false;
+
+    const char *flag = isa<OptimizationRemark>(remark)       ? "-Rpass"
+                     : isa<OptimizationRemarkMissed>(remark) ? "-Rpass-missed"
+                                                             : "-Rpass-analysis";
+    //  Without a location (code compiled without -g) the function is the best hint
+    if (remark->isLocationAvailable())
+      outs() << remark->getLocationStr();
+    else
+      outs() << remark->getFunction().getName();
+    outs() << ": remark: " << remark->getMsg() << " [" << flag << "=" << remark->getPassName() << "]\n";
+    return true;
+  }
+};
+
+bool remarkFilter(const std::string &pattern, const char *flag, std::optional<Regex> &filter) {
+  if (pattern.empty())
+    return true;
+
+  std::string error;
+  filter.emplace(pattern);
+  if (not filter->isValid(error)) {
+    errs() << "Invalid regular expression for " << flag << ": " << error << "\n";
+    return false;
+  }
+  return true;
+}
+
+} // namespace
+
+bool reportRemarks(LLVMContext &C, const std::string &passed, const std::string &missed,
+                   const std::string &analysis) {
+  std::optional<Regex> passedFilter, missedFilter, analysisFilter;
+  if (not remarkFilter(passed, "-Rpass", passedFilter) or not remarkFilter(missed, "-Rpass-missed", missedFilter)
+      or not remarkFilter(analysis, "-Rpass-analysis", analysisFilter))
+    return false;
+
+  //  The context asks the handler whether a remark is enabled before passing it
+  C.setDiagnosticHandler(std::make_unique<RemarkPrinter>(std::move(passedFilter), std::move(missedFilter),
+                                                         std::move(analysisFilter)), true);
+  return true;
+}
+
+/************************ Function attributes *********************/
+void inferAttributes(Module &M) {
+  //  Callees are visited before their callers (post order on the SCCs of
+  //  the call graph), so the attributes of a call are known when the caller
+  //  is analyzed; norecurse needs the opposite order (top-down)
+  runPasses(M, nullptr, [](PassBuilder &PB, ModulePassManager &MPM) {
+    MPM.addPass(createModuleToPostOrderCGSCCPassAdaptor(PostOrderFunctionAttrsPass()));
+    MPM.addPass(ReversePostOrderFunctionAttrsPass());
+  });
+}
+
+void internalize(Module &M, const std::set<std::string> &exports) {
+  for (Function &F: M) {
+    if (F.isDeclaration() or exports.count(F.getName().str()))
+      continue;
+
+    F.setLinkage(GlobalValue::InternalLinkage);
+    F.setCallingConv(CallingConv::Fast);
+    //  Caller and callee must agree on the calling convention
+    for (User *U: F.users())
+      if (auto *call = dyn_cast<CallBase>(U); call and call->getCalledFunction() == &F)
+        call->setCallingConv(CallingConv::Fast);
+  }
+
+  runPasses(M, nullptr, [](PassBuilder &PB, ModulePassManager &MPM) {
+    MPM.addPass(GlobalDCEPass());
+  });
+}
+
+/********************** Function multiversioning ******************/
+namespace {
+
+//  Bits of __cpu_model.__cpu_features[0], as defined by libgcc and
+//  compiler-rt (enum ProcessorFeatures): the same ABI used by clang for
+//  __builtin_cpu_supports and target_clones
+enum CPUFeatureBit {
+  POPCNT = 2, SSSE3 = 6, SSE4_1 = 7, SSE4_2 = 8, AVX = 9, AVX2 = 10,
+  FMA = 14, AVX512F = 15, BMI = 16, BMI2 = 17,
+  AVX512VL = 20, AVX512BW = 21, AVX512DQ = 22, AVX512CD = 23
+};
+
+struct CPULevel {
+  const char *cpu;
+  unsigned level;       // < Ordine di preferenza (più alto = migliore)
+  uint32_t mask;        // < Feature richieste a runtime
+  const char *features; // < Valore dell'attributo target-features
+};
+
+#define BIT(f) (1u << f)
+const uint32_t V2 = BIT(POPCNT) | BIT(SSSE3) | BIT(SSE4_1) | BIT(SSE4_2);
+const uint32_t V3 = V2 | BIT(AVX) | BIT(AVX2) | BIT(FMA) | BIT(BMI) | BIT(BMI2);
+const uint32_t V4 = V3 | BIT(AVX512F) | BIT(AVX512VL) | BIT(AVX512BW) | BIT(AVX512DQ) | BIT(AVX512CD);
+#undef BIT
+
+const CPULevel levels[] = {
+  {"x86-64", 1, 0, "+cx8,+fxsr,+mmx,+sse,+sse2"},
+  {"x86-64-v2", 2, V2, "+cx8,+fxsr,+mmx,+sse,+sse2,+cx16,+popcnt,+sahf,+sse3,+sse4.1,+sse4.2,+ssse3"},
+  {"x86-64-v3", 3, V3, "+cx8,+fxsr,+mmx,+sse,+sse2,+cx16,+popcnt,+sahf,+sse3,+sse4.1,+sse4.2,+ssse3,"
+                       "+avx,+avx2,+bmi,+bmi2,+f16c,+fma,+lzcnt,+movbe,+xsave"},
+  {"x86-64-v4", 4, V4, "+cx8,+fxsr,+mmx,+sse,+sse2,+cx16,+popcnt,+sahf,+sse3,+sse4.1,+sse4.2,+ssse3,"
+                       "+avx,+avx2,+bmi,+bmi2,+f16c,+fma,+lzcnt,+movbe,+xsave,"
+                       "+avx512f,+avx512bw,+avx512cd,+avx512dq,+avx512vl"},
+};
+
+bool hasLoops(Function &F) {
+  DominatorTree DT(F);
+  LoopInfo LI(DT);
+  return not LI.empty();
+}
+
+/// Emits the load of __cpu_model.__cpu_features[0], initializing the model
+/// first: resolvers run before constructors, __cpu_indicator_init included
+Value *cpuFeatures(Module &M, IRBuilder<> &B) {
+  LLVMContext &C = M.getContext();
+  Type *i32 = Type::getInt32Ty(C);
+  StructType *model = StructType::get(C, {i32, i32, i32, ArrayType::get(i32, 1)});
+
+  FunctionCallee init = M.getOrInsertFunction("__cpu_indicator_init", Type::getVoidTy(C));
+  B.CreateCall(init);
+
+  GlobalVariable *cpuModel = M.getNamedGlobal("__cpu_model");
+  if (not cpuModel) {
+    cpuModel = new GlobalVariable(M, model, false, GlobalValue::ExternalLinkage, nullptr, "__cpu_model");
+    cpuModel->setDSOLocal(true);
+  }
+  Value *features = B.CreateConstInBoundsGEP2_32(model, cpuModel, 0, 3);
+  return B.CreateLoad(i32, features, "features");
+}
+
+} // namespace
+
+bool multiversion(Module &M, const std::vector<std::string> &cpus) {
+  Triple triple(M.getTargetTriple().empty() ? sys::getDefaultTargetTriple() : M.getTargetTriple());
+  if (triple.getArch() != Triple::x86_64 or not triple.isOSBinFormatELF()) {
+    errs() << "--multiversion requires an x86-64 ELF target\n";
+    return false;
+  }
+
+  std::vector<const CPULevel *> variants;
+  for (auto &cpu: cpus) {
+    const CPULevel *found = nullptr;
+    for (auto &level: levels)
+      if (cpu == level.cpu)
+        found = &level;
+    if (not found) {
+      errs() << "Unsupported CPU for --multiversion: " << cpu << "\n";
+      return false;
+    }
+    variants.push_back(found);
+  }
+  //  The resolver tries the most capable variants first
+  std::sort(variants.begin(), variants.end(),
+            [](const CPULevel *a, const CPULevel *b) { return a->level > b->level; });
+
+  std::vector<Function *> hot;
+  for (Function &F: M)
+    if (not F.isDeclaration() and F.hasExternalLinkage() and hasLoops(F))
+      hot.push_back(&F);
+
+  //  Clones are created first, calls between multiversioned functions are
+  //  then redirected to the clone of the same variant, avoiding the PLT
+  std::map<Function *, std::vector<Function *>> clones;
+  for (Function *F: hot) {
+    for (auto variant: variants) {
+      ValueToValueMapTy VMap;
+      Function *clone = CloneFunction(F, VMap);
+      clone->setName(F->getName() + "." + variant->cpu);
+      clone->setLinkage(GlobalValue::InternalLinkage);
+      clone->addFnAttr("target-cpu", variant->cpu);
+      clone->addFnAttr("target-features", variant->features);
+      clones[F].push_back(clone);
+    }
+  }
+
+  for (auto &[F, versions]: clones) {
+    for (unsigned v = 0; v < versions.size(); v++) {
+      for (auto &BB: *versions[v])
+        for (auto &I: BB)
+          if (auto *call = dyn_cast<CallInst>(&I))
+            if (auto target = clones.find(call->getCalledFunction()); target != clones.end())
+              call->setCalledFunction(target->second[v]);
+    }
+  }
+
+  LLVMContext &C = M.getContext();
+  std::vector<Function *> replaced;
+  for (auto &[F, versions]: clones) {
+    std::string name = F->getName().str();
+    FunctionType *FT = F->getFunctionType();
+
+    //  Without a baseline variant, the original function is the fallback
+    Function *fallback = F;
+    if (variants.back()->mask == 0)
+      fallback = versions.back();
+    F->setName(name + ".default");
+    F->setLinkage(GlobalValue::InternalLinkage);
+
+    Type *ptrTy = PointerType::getUnqual(C);
+    Function *resolver = Function::Create(FunctionType::get(ptrTy, false),
+                                          GlobalValue::InternalLinkage, name + ".resolver", M);
+    IRBuilder<> B(BasicBlock::Create(C, "entry", resolver));
+    Value *features = cpuFeatures(M, B);
+
+    Value *chosen = fallback;
+    for (int v = versions.size() - 1; v >= 0; v--) {
+      if (variants[v]->mask == 0)
+        continue;
+      Value *mask = B.getInt32(variants[v]->mask);
+      Value *supported = B.CreateICmpEQ(B.CreateAnd(features, mask), mask);
+      chosen = B.CreateSelect(supported, versions[v], chosen);
+    }
+    B.CreateRet(chosen);
+
+    GlobalIFunc *ifunc = GlobalIFunc::create(FT, 0, GlobalValue::ExternalLinkage, name, resolver, &M);
+    //  Every other user (callers outside the multiversioned set, C++ code
+    //  through the symbol) goes through the dispatch
+    F->replaceUsesWithIf(ifunc, [&](Use &U) {
+      auto *I = dyn_cast<Instruction>(U.getUser());
+      return not I or (I->getFunction() != resolver and not clones.count(I->getFunction()));
+    });
+    if (fallback != F)
+      replaced.push_back(F);
+  }
+
+  //  Originals superseded by a baseline clone may still call each other
+  for (Function *F: replaced)
+    F->dropAllReferences();
+  for (Function *F: replaced)
+    F->eraseFromParent();
+
+  return true;
+}
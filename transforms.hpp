@@ -0,0 +1,54 @@
+#ifndef TRANSFORMS_HPP
+#define TRANSFORMS_HPP
+/**
+ * Trasformazioni applicate all'intero modulo dopo la generazione del codice
+ * di tutti i sorgenti, prima dell'emissione dell'IR.
+ */
+#include <set>
+#include <string>
+#include <vector>
+
+#include "llvm/IR/Module.h"
+#include "llvm/Target/TargetMachine.h"
+
+/// Pipeline di ottimizzazione standard di LLVM (-O1, -O2, -O3); a livello 0
+/// non fa nulla. TM può essere nullptr (nessuna informazione sul target)
+void optimize(llvm::Module &M, unsigned level, llvm::TargetMachine *TM = nullptr);
+
+/**
+ * Remark delle ottimizzazioni (-Rpass=, -Rpass-missed=, -Rpass-analysis=):
+ * i remark emessi dai pass il cui nome corrisponde alla regex della
+ * categoria (ottimizzazioni applicate, mancate, analisi) sono stampati su
+ * stdout come in clang, con la posizione file:riga:colonna nel sorgente .k.
+ * Una regex vuota disabilita la categoria. Restituisce false (dopo aver
+ * stampato un errore) se una regex non è valida.
+ */
+bool reportRemarks(llvm::LLVMContext &C, const std::string &passed, const std::string &missed,
+                   const std::string &analysis);
+
+/**
+ * Analisi interprocedurale degli attributi: marca le funzioni definite nel
+ * modulo come readnone/readonly (memory), nounwind, willreturn e norecurse
+ * quando è dimostrabile. Permette di eliminare o spostare fuori dai cicli
+ * chiamate pure, come err(z,y) nella condizione del ciclo di test/sqrt.k
+ */
+void inferAttributes(llvm::Module &M);
+
+/**
+ * Le funzioni definite che non compaiono in exports ricevono linkage interno
+ * e calling convention fastcc; quelle non più referenziate vengono rimosse.
+ */
+void internalize(llvm::Module &M, const std::set<std::string> &exports);
+
+/**
+ * Function multiversioning: ogni funzione che contiene un ciclo viene
+ * clonata per ciascuna delle CPU indicate (x86-64, x86-64-v2, x86-64-v3,
+ * x86-64-v4), con i relativi attributi target-cpu/target-features. Il
+ * simbolo originale diventa un ifunc, il cui resolver sceglie al caricamento
+ * la variante migliore supportata dalla CPU.
+ * Restituisce false (dopo aver stampato un errore) se una CPU non è
+ * supportata o il target non è x86-64.
+ */
+bool multiversion(llvm::Module &M, const std::vector<std::string> &cpus);
+
+#endif // ! TRANSFORMS_HPP